@@ -0,0 +1,355 @@
+#pragma once
+
+// Splitting stb_image's packed pixels into the three planes of an RGB24 frame.
+//
+// Every kernel takes `count` pixels of tightly packed input and writes `count` bytes to each of
+// r, g and b. Gray and gray+alpha input is replicated into all three planes and alpha is
+// dropped, which gives exactly the same result as asking stbi_load for 3 components.
+//
+// The SSSE3 and AVX2 versions are picked at runtime, so the plugin still runs on CPUs without them.
+// Gray+alpha only has an SSSE3 version.
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define STB_DEINTERLEAVE_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define STB_TARGET(x)
+#else
+#include <cpuid.h>
+#define STB_TARGET(x) __attribute__((target(x)))
+#endif
+#include <immintrin.h>
+#endif
+
+typedef void (*DeinterleaveFunc)(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count);
+
+typedef struct {
+	DeinterleaveFunc gray_alpha;
+	DeinterleaveFunc rgb;
+	DeinterleaveFunc rgba;
+} DeinterleaveKernels;
+
+//////////
+// Scalar
+//////////
+
+static void
+DeinterleaveGrayAlpha_C(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		r[i] = src[i * 2];
+
+	memcpy(g, r, count);
+	memcpy(b, r, count);
+}
+
+static void
+DeinterleaveRGB_C(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		r[i] = *(src++);
+		g[i] = *(src++);
+		b[i] = *(src++);
+	}
+}
+
+static void
+DeinterleaveRGBA_C(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		r[i] = src[0];
+		g[i] = src[1];
+		b[i] = src[2];
+		src += 4;
+	}
+}
+
+#ifdef STB_DEINTERLEAVE_X86
+
+/////////
+// SSSE3
+/////////
+
+// For each plane, one pshufb mask per 16-byte source vector of a 48-byte (16 pixel) RGB block.
+// -1 zeroes the byte so the three shuffled vectors can simply be OR'd together.
+#define STB_RGB_MASKS \
+	__m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+	__m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1); \
+	__m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13); \
+	__m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+	__m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1); \
+	__m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14); \
+	__m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+	__m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1); \
+	__m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)
+
+// Gathers R, G, B and A of four pixels into the four dwords of a vector
+#define STB_RGBA_MASK \
+	_mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15)
+
+STB_TARGET("ssse3") static void
+DeinterleaveGrayAlpha_SSSE3(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	const __m128i low = _mm_set1_epi16(0x00FF);
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i * 2));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i * 2 + 16));
+		__m128i gray = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(c, low));
+		_mm_storeu_si128((__m128i *)(r + i), gray);
+		_mm_storeu_si128((__m128i *)(g + i), gray);
+		_mm_storeu_si128((__m128i *)(b + i), gray);
+	}
+
+	DeinterleaveGrayAlpha_C(src + i * 2, r + i, g + i, b + i, count - i);
+}
+
+STB_TARGET("ssse3") static void
+DeinterleaveRGB_SSSE3(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	STB_RGB_MASKS;
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		const uint8_t *p = src + i * 3;
+		__m128i a = _mm_loadu_si128((const __m128i *)p);
+		__m128i c = _mm_loadu_si128((const __m128i *)(p + 16));
+		__m128i e = _mm_loadu_si128((const __m128i *)(p + 32));
+
+		__m128i red = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(c, r1)), _mm_shuffle_epi8(e, r2));
+		__m128i green = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(c, g1)), _mm_shuffle_epi8(e, g2));
+		__m128i blue = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(c, b1)), _mm_shuffle_epi8(e, b2));
+
+		_mm_storeu_si128((__m128i *)(r + i), red);
+		_mm_storeu_si128((__m128i *)(g + i), green);
+		_mm_storeu_si128((__m128i *)(b + i), blue);
+	}
+
+	DeinterleaveRGB_C(src + i * 3, r + i, g + i, b + i, count - i);
+}
+
+STB_TARGET("ssse3") static void
+DeinterleaveRGBA_SSSE3(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	const __m128i mask = STB_RGBA_MASK;
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		const uint8_t *p = src + i * 4;
+		__m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), mask);
+		__m128i c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), mask);
+		__m128i e = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), mask);
+		__m128i f = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), mask);
+
+		// 4x4 transpose of dwords: RRRR GGGG BBBB AAAA per vector -> one plane per vector
+		__m128i ac_lo = _mm_unpacklo_epi32(a, c);
+		__m128i ac_hi = _mm_unpackhi_epi32(a, c);
+		__m128i ef_lo = _mm_unpacklo_epi32(e, f);
+		__m128i ef_hi = _mm_unpackhi_epi32(e, f);
+
+		_mm_storeu_si128((__m128i *)(r + i), _mm_unpacklo_epi64(ac_lo, ef_lo));
+		_mm_storeu_si128((__m128i *)(g + i), _mm_unpackhi_epi64(ac_lo, ef_lo));
+		_mm_storeu_si128((__m128i *)(b + i), _mm_unpacklo_epi64(ac_hi, ef_hi));
+	}
+
+	DeinterleaveRGBA_C(src + i * 4, r + i, g + i, b + i, count - i);
+}
+
+////////
+// AVX2
+////////
+
+// The AVX2 versions run the SSSE3 algorithm on two 16 pixel blocks at once, one per 128-bit lane,
+// since pshufb can't move bytes between lanes. Loading block 0 into the low lanes and block 1
+// into the high lanes makes each plane's 32 output bytes come out contiguous.
+STB_TARGET("avx2") static inline __m256i
+LoadLanes(const uint8_t *low, const uint8_t *high)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)low)),
+		_mm_loadu_si128((const __m128i *)high), 1);
+}
+
+STB_TARGET("avx2") static void
+DeinterleaveRGB_AVX2(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	STB_RGB_MASKS;
+	__m256i wr0 = _mm256_broadcastsi128_si256(r0), wr1 = _mm256_broadcastsi128_si256(r1), wr2 = _mm256_broadcastsi128_si256(r2);
+	__m256i wg0 = _mm256_broadcastsi128_si256(g0), wg1 = _mm256_broadcastsi128_si256(g1), wg2 = _mm256_broadcastsi128_si256(g2);
+	__m256i wb0 = _mm256_broadcastsi128_si256(b0), wb1 = _mm256_broadcastsi128_si256(b1), wb2 = _mm256_broadcastsi128_si256(b2);
+
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		const uint8_t *p = src + i * 3;
+		__m256i a = LoadLanes(p, p + 48);
+		__m256i c = LoadLanes(p + 16, p + 64);
+		__m256i e = LoadLanes(p + 32, p + 80);
+
+		__m256i red = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, wr0), _mm256_shuffle_epi8(c, wr1)), _mm256_shuffle_epi8(e, wr2));
+		__m256i green = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, wg0), _mm256_shuffle_epi8(c, wg1)), _mm256_shuffle_epi8(e, wg2));
+		__m256i blue = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, wb0), _mm256_shuffle_epi8(c, wb1)), _mm256_shuffle_epi8(e, wb2));
+
+		_mm256_storeu_si256((__m256i *)(r + i), red);
+		_mm256_storeu_si256((__m256i *)(g + i), green);
+		_mm256_storeu_si256((__m256i *)(b + i), blue);
+	}
+
+	DeinterleaveRGB_SSSE3(src + i * 3, r + i, g + i, b + i, count - i);
+}
+
+STB_TARGET("avx2") static void
+DeinterleaveRGBA_AVX2(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	const __m256i mask = _mm256_broadcastsi128_si256(STB_RGBA_MASK);
+
+	size_t i = 0;
+	for (; i + 32 <= count; i += 32)
+	{
+		const uint8_t *p = src + i * 4;
+		__m256i a = _mm256_shuffle_epi8(LoadLanes(p, p + 64), mask);
+		__m256i c = _mm256_shuffle_epi8(LoadLanes(p + 16, p + 80), mask);
+		__m256i e = _mm256_shuffle_epi8(LoadLanes(p + 32, p + 96), mask);
+		__m256i f = _mm256_shuffle_epi8(LoadLanes(p + 48, p + 112), mask);
+
+		__m256i ac_lo = _mm256_unpacklo_epi32(a, c);
+		__m256i ac_hi = _mm256_unpackhi_epi32(a, c);
+		__m256i ef_lo = _mm256_unpacklo_epi32(e, f);
+		__m256i ef_hi = _mm256_unpackhi_epi32(e, f);
+
+		_mm256_storeu_si256((__m256i *)(r + i), _mm256_unpacklo_epi64(ac_lo, ef_lo));
+		_mm256_storeu_si256((__m256i *)(g + i), _mm256_unpackhi_epi64(ac_lo, ef_lo));
+		_mm256_storeu_si256((__m256i *)(b + i), _mm256_unpacklo_epi64(ac_hi, ef_hi));
+	}
+
+	DeinterleaveRGBA_SSSE3(src + i * 4, r + i, g + i, b + i, count - i);
+}
+
+#undef STB_RGB_MASKS
+#undef STB_RGBA_MASK
+
+///////////////
+// CPU support
+///////////////
+
+static void
+CPUID(int leaf, int regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, 0);
+#else
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, 0, a, b, c, d);
+	regs[0] = a; regs[1] = b; regs[2] = c; regs[3] = d;
+#endif
+}
+
+STB_TARGET("xsave") static uint64_t
+XGETBV()
+{
+	return _xgetbv(0);
+}
+
+#endif // STB_DEINTERLEAVE_X86
+
+// Instruction set levels the kernels come in
+enum {
+	DeinterleaveC,
+	DeinterleaveSSSE3,
+	DeinterleaveAVX2,
+};
+
+// The best level the CPU (and OS) supports
+static int
+DetectDeinterleaveLevel()
+{
+	int level = DeinterleaveC;
+
+#ifdef STB_DEINTERLEAVE_X86
+	int regs[4];
+	CPUID(0, regs);
+	int max_leaf = regs[0];
+
+	CPUID(1, regs);
+	bool ssse3 = (regs[2] & (1 << 9)) != 0;
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx = (regs[2] & (1 << 28)) != 0;
+
+	if (ssse3)
+		level = DeinterleaveSSSE3;
+
+	// AVX2 also needs the OS to save the YMM registers on context switches
+	if (ssse3 && osxsave && avx && max_leaf >= 7 && (XGETBV() & 0x6) == 0x6)
+	{
+		CPUID(7, regs);
+		if (regs[1] & (1 << 5))
+			level = DeinterleaveAVX2;
+	}
+#endif
+
+	return level;
+}
+
+// The kernels for a level, which the CPU must support
+static DeinterleaveKernels
+GetDeinterleaveKernels(int level)
+{
+	DeinterleaveKernels k = { DeinterleaveGrayAlpha_C, DeinterleaveRGB_C, DeinterleaveRGBA_C };
+
+#ifdef STB_DEINTERLEAVE_X86
+	if (level >= DeinterleaveSSSE3)
+	{
+		k.gray_alpha = DeinterleaveGrayAlpha_SSSE3;
+		k.rgb = DeinterleaveRGB_SSSE3;
+		k.rgba = DeinterleaveRGBA_SSSE3;
+	}
+
+	// Gray+alpha stays on SSSE3: it's a single pack per 16 pixels, and the AVX2 version's extra
+	// cross-lane permute made it slower (4.7 against 5.5 GB/s in kernelbench)
+	if (level >= DeinterleaveAVX2)
+	{
+		k.rgb = DeinterleaveRGB_AVX2;
+		k.rgba = DeinterleaveRGBA_AVX2;
+	}
+#endif
+
+	return k;
+}
+
+// Splits `count` packed pixels with `comp` channels (1 to 4, as returned by stbi_load) into three planes.
+// Returns false for any other channel count.
+static bool
+Deinterleave(const uint8_t *src, int comp, uint8_t *r, uint8_t *g, uint8_t *b, size_t count)
+{
+	static const DeinterleaveKernels kernels = GetDeinterleaveKernels(DetectDeinterleaveLevel());
+
+	switch (comp)
+	{
+	case 1:
+		memcpy(r, src, count);
+		memcpy(g, src, count);
+		memcpy(b, src, count);
+		break;
+	case 2:
+		kernels.gray_alpha(src, r, g, b, count);
+		break;
+	case 3:
+		kernels.rgb(src, r, g, b, count);
+		break;
+	case 4:
+		kernels.rgba(src, r, g, b, count);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
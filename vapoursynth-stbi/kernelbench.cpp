@@ -0,0 +1,353 @@
+// Throughput of stb_image's JPEG and PNG kernels, and of the plugin's deinterleave kernels, at each
+// instruction set level the build and the CPU have.
+//
+// This isn't part of the plugin. Build it on its own, with optimizations, next to stb_image.h:
+//   cl /O2 /EHsc kernelbench.cpp
+//   g++ -O2 kernelbench.cpp -o kernelbench
+// Every kernel runs over the same random data at each level, and the best of several runs is
+// reported in megapixels written per second, or for deinterleaving in gigabytes of packed pixels
+// read per second.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "deinterleave.h"
+
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+enum {
+	LevelC,
+	LevelSSE2,
+	LevelAVX2,
+	LevelNEON,
+	LevelCount,
+};
+
+static const char *LevelNames[LevelCount] = { "C", "SSE2", "AVX2", "NEON" };
+
+typedef void (*IdctKernel)(stbi_uc *out, int out_stride, short data[64]);
+typedef stbi_uc *(*ResampleKernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+typedef void (*ConvertKernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+typedef void (*PlanarKernel)(stbi_uc *r, stbi_uc *g, stbi_uc *b, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count);
+typedef void (*UpsampleKernel)(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc *pa, int step, const stbi_uc *y, const stbi_uc *cb_near, const stbi_uc *cb_far, const stbi_uc *cr_near, const stbi_uc *cr_far, int count);
+typedef stbi__unfilter_kernel UnfilterKernel;
+
+// One kernel's versions, nullptr where a level doesn't have one
+typedef struct {
+	IdctKernel idct[LevelCount];
+	ResampleKernel resample[LevelCount];
+	ConvertKernel convert[LevelCount];
+	PlanarKernel planar[LevelCount];
+	UpsampleKernel upsample[LevelCount];
+	UnfilterKernel unfilter[LevelCount][5][5]; // By bytes per pixel and filter type
+} Kernels;
+
+static const int Width = 2048; // Pixels per row
+static const int Rows = 32;
+static const int Blocks = 1024; // For the IDCT, a 256x256 image
+
+static const int PagePixels = 3840 * 1080; // Deinterleaving runs over a strip of a 4K page
+
+static STBI_SIMD_ALIGN(short, Coefficients[Blocks * 64]);
+static std::vector<stbi_uc> Luma, ChromaNear, ChromaFar, Filtered, Output, Packed, Planes;
+
+static bool
+LevelAvailable(int level)
+{
+	switch (level)
+	{
+	case LevelC:
+		return true;
+#ifdef STBI_SSE2
+	case LevelSSE2:
+		return stbi__sse2_available() != 0;
+#endif
+#ifdef STBI_AVX2
+	case LevelAVX2:
+		return stbi__avx2_available() != 0;
+#endif
+#ifdef STBI_NEON
+	case LevelNEON:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+static Kernels
+GetKernels()
+{
+	Kernels k = {};
+	k.idct[LevelC] = stbi__idct_block;
+	k.resample[LevelC] = stbi__resample_row_hv_2;
+	k.convert[LevelC] = stbi__YCbCr_to_RGB_row;
+	k.planar[LevelC] = stbi__YCbCr_to_RGB_planar_row;
+	for (int bpp = 3; bpp <= 4; ++bpp)
+	{
+		k.unfilter[LevelC][bpp][STBI__F_up] = stbi__unfilter_up;
+		k.unfilter[LevelC][bpp][STBI__F_sub] = bpp == 3 ? stbi__unfilter_sub_3 : stbi__unfilter_sub_4;
+		k.unfilter[LevelC][bpp][STBI__F_avg] = bpp == 3 ? stbi__unfilter_avg_3 : stbi__unfilter_avg_4;
+		k.unfilter[LevelC][bpp][STBI__F_paeth] = bpp == 3 ? stbi__unfilter_paeth_3 : stbi__unfilter_paeth_4;
+	}
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+#ifdef STBI_SSE2
+	const int simd = LevelSSE2;
+#else
+	const int simd = LevelNEON;
+#endif
+	k.idct[simd] = stbi__idct_simd;
+	k.resample[simd] = stbi__resample_row_hv_2_simd;
+#ifndef STBI_JPEG_OLD
+	k.convert[simd] = stbi__YCbCr_to_RGB_simd;
+	k.planar[simd] = stbi__YCbCr_to_RGB_planar_simd;
+	k.upsample[simd] = stbi__YCbCr_upsample_to_RGB_simd;
+#endif
+#endif
+
+#ifdef STBI_SSE2
+	// Where SSE2 falls back on the C loop, there's nothing to measure
+	for (int bpp = 3; bpp <= 4; ++bpp)
+	{
+		stbi__setup_png_unfilter(k.unfilter[LevelSSE2][bpp], bpp);
+		for (int filter = 0; filter < 5; ++filter)
+			if (k.unfilter[LevelSSE2][bpp][filter] == k.unfilter[LevelC][bpp][filter])
+				k.unfilter[LevelSSE2][bpp][filter] = nullptr;
+	}
+#endif
+
+#ifdef STBI_AVX2
+	k.idct[LevelAVX2] = stbi__idct_avx2;
+	k.resample[LevelAVX2] = stbi__resample_row_hv_2_avx2;
+#ifndef STBI_JPEG_OLD
+	k.convert[LevelAVX2] = stbi__YCbCr_to_RGB_avx2;
+	k.planar[LevelAVX2] = stbi__YCbCr_to_RGB_planar_avx2;
+	k.upsample[LevelAVX2] = stbi__YCbCr_upsample_to_RGB_avx2;
+#endif
+#endif
+	return k;
+}
+
+// Runs one pass of a kernel over the test data, returning the pixels written, or 0 if the level
+// doesn't have that kernel
+typedef int (*BenchPass)(const Kernels &k, int level);
+
+static int
+IdctPass(const Kernels &k, int level)
+{
+	if (!k.idct[level])
+		return 0;
+	for (int i = 0; i < Blocks; ++i)
+		k.idct[level](&Output[(i / 32) * 8 * 256 + (i % 32) * 8], 256, Coefficients + i * 64);
+	return Blocks * 64;
+}
+
+static int
+ResamplePass(const Kernels &k, int level)
+{
+	if (!k.resample[level])
+		return 0;
+	for (int j = 0; j < Rows; ++j)
+		k.resample[level](&Output[0], &ChromaNear[j * Width / 2], &ChromaFar[j * Width / 2], Width / 2, 2);
+	return Rows * Width;
+}
+
+static int
+ConvertPass(const Kernels &k, int level)
+{
+	if (!k.convert[level])
+		return 0;
+	for (int j = 0; j < Rows; ++j)
+		k.convert[level](&Output[0], &Luma[j * Width], &ChromaNear[j * Width], &ChromaFar[j * Width], Width, 4);
+	return Rows * Width;
+}
+
+static int
+PlanarPass(const Kernels &k, int level)
+{
+	if (!k.planar[level])
+		return 0;
+	for (int j = 0; j < Rows; ++j)
+		k.planar[level](&Output[0], &Output[Width], &Output[Width * 2], &Luma[j * Width], &ChromaNear[j * Width], &ChromaFar[j * Width], Width);
+	return Rows * Width;
+}
+
+static int
+UpsamplePlanarPass(const Kernels &k, int level)
+{
+	if (!k.upsample[level])
+		return 0;
+	for (int j = 0; j < Rows; ++j)
+	{
+		const stbi_uc *cb = &ChromaNear[j * Width / 2], *cr = &ChromaFar[j * Width / 2];
+		k.upsample[level](&Output[0], &Output[Width], &Output[Width * 2], nullptr, 1, &Luma[j * Width], cb, cr, cr, cb, Width);
+	}
+	return Rows * Width;
+}
+
+static int
+UpsampleRGBAPass(const Kernels &k, int level)
+{
+	if (!k.upsample[level])
+		return 0;
+	for (int j = 0; j < Rows; ++j)
+	{
+		const stbi_uc *cb = &ChromaNear[j * Width / 2], *cr = &ChromaFar[j * Width / 2];
+		k.upsample[level](&Output[0], &Output[1], &Output[2], &Output[3], 4, &Luma[j * Width], cb, cr, cr, cb, Width);
+	}
+	return Rows * Width;
+}
+
+// Unfilters rows of random bytes in place of filtered PNG scanlines
+template <int Filter, int Bpp>
+static int
+UnfilterPass(const Kernels &k, int level)
+{
+	UnfilterKernel kernel = k.unfilter[level][Bpp][Filter];
+	if (!kernel)
+		return 0;
+	for (int j = 0; j < Rows; ++j)
+	{
+		stbi_uc *cur = &Output[(j & 1) * Width * 4];
+		stbi_uc *prior = &Output[(~j & 1) * Width * 4];
+		kernel(cur + Bpp, prior + Bpp, &Filtered[j * Width * 4], (Width - 1) * Bpp);
+	}
+	return Rows * Width;
+}
+
+// Splits a page of `Comp` channel pixels into three planes, returning the packed bytes read
+template <int Comp>
+static int
+DeinterleavePass(const DeinterleaveKernels &k)
+{
+	DeinterleaveFunc kernel = Comp == 2 ? k.gray_alpha : Comp == 3 ? k.rgb : k.rgba;
+	kernel(&Packed[0], &Planes[0], &Planes[PagePixels], &Planes[PagePixels * 2], PagePixels);
+	return PagePixels * Comp;
+}
+
+// Best of 5 runs of at least 50 ms each, in millions of whatever the pass counts per second
+static double
+Measure(const std::function<int()> &pass)
+{
+	if (!pass())
+		return 0;
+
+	double best = 0;
+	for (int run = 0; run < 5; ++run)
+	{
+		auto start = std::chrono::steady_clock::now();
+		double seconds = 0;
+		long long units = 0;
+		do
+		{
+			units += pass();
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		} while (seconds < 0.05);
+		if (units / seconds > best)
+			best = units / seconds;
+	}
+	return best / 1e6;
+}
+
+int
+main()
+{
+	srand(1);
+	// Mostly small coefficients with many zeros, like dequantized blocks of a real image
+	for (int i = 0; i < Blocks * 64; ++i)
+		Coefficients[i] = (i % 64 < 16 || rand() % 4 == 0) ? (short)(rand() % 512 - 256) : 0;
+	Luma.resize(Width * Rows);
+	ChromaNear.resize(Width * Rows);
+	ChromaFar.resize(Width * Rows);
+	Filtered.resize(Width * 4 * Rows);
+	Output.resize(Width * 4 + 256 * 256);
+	for (int i = 0; i < Width * Rows; ++i)
+	{
+		Luma[i] = (stbi_uc)rand();
+		ChromaNear[i] = (stbi_uc)rand();
+		ChromaFar[i] = (stbi_uc)rand();
+	}
+	for (size_t i = 0; i < Filtered.size(); ++i)
+		Filtered[i] = (stbi_uc)rand();
+	Packed.resize(PagePixels * 4);
+	Planes.resize(PagePixels * 3);
+	for (size_t i = 0; i < Packed.size(); ++i)
+		Packed[i] = (stbi_uc)rand();
+
+	static const struct {
+		const char *name;
+		BenchPass pass;
+	} benches[] = {
+		{ "idct", IdctPass },
+		{ "resample_row_hv_2", ResamplePass },
+		{ "YCbCr_to_RGB (RGBA)", ConvertPass },
+		{ "YCbCr_to_RGB_planar", PlanarPass },
+		{ "YCbCr_upsample_to_RGB (planar)", UpsamplePlanarPass },
+		{ "YCbCr_upsample_to_RGB (RGBA)", UpsampleRGBAPass },
+		{ "PNG unfilter Sub (RGB)", UnfilterPass<STBI__F_sub, 3> },
+		{ "PNG unfilter Sub (RGBA)", UnfilterPass<STBI__F_sub, 4> },
+		{ "PNG unfilter Up (RGB)", UnfilterPass<STBI__F_up, 3> },
+		{ "PNG unfilter Up (RGBA)", UnfilterPass<STBI__F_up, 4> },
+		{ "PNG unfilter Avg (RGB)", UnfilterPass<STBI__F_avg, 3> },
+		{ "PNG unfilter Avg (RGBA)", UnfilterPass<STBI__F_avg, 4> },
+		{ "PNG unfilter Paeth (RGB)", UnfilterPass<STBI__F_paeth, 3> },
+		{ "PNG unfilter Paeth (RGBA)", UnfilterPass<STBI__F_paeth, 4> },
+	};
+
+	Kernels k = GetKernels();
+	printf("%-32s", "Mpixels/s");
+	for (int level = 0; level < LevelCount; ++level)
+		printf("%10s", LevelNames[level]);
+	printf("\n");
+
+	for (const auto &bench : benches)
+	{
+		printf("%-32s", bench.name);
+		for (int level = 0; level < LevelCount; ++level)
+		{
+			double rate = LevelAvailable(level) ? Measure([&] { return bench.pass(k, level); }) : 0;
+			if (rate > 0)
+				printf("%10.0f", rate);
+			else
+				printf("%10s", "-");
+		}
+		printf("\n");
+	}
+
+	static const char *DeinterleaveLevelNames[] = { "C", "SSSE3", "AVX2" };
+	static const struct {
+		const char *name;
+		int (*pass)(const DeinterleaveKernels &k);
+	} deinterleaves[] = {
+		{ "Deinterleave (gray+alpha)", DeinterleavePass<2> },
+		{ "Deinterleave (RGB)", DeinterleavePass<3> },
+		{ "Deinterleave (RGBA)", DeinterleavePass<4> },
+	};
+
+	printf("\n%-32s", "GB/s");
+	for (int level = DeinterleaveC; level <= DeinterleaveAVX2; ++level)
+		printf("%10s", DeinterleaveLevelNames[level]);
+	printf("\n");
+
+	int detected = DetectDeinterleaveLevel();
+	for (const auto &bench : deinterleaves)
+	{
+		printf("%-32s", bench.name);
+		for (int level = DeinterleaveC; level <= DeinterleaveAVX2; ++level)
+		{
+			if (level > detected)
+			{
+				printf("%10s", "-");
+				continue;
+			}
+			DeinterleaveKernels dk = GetDeinterleaveKernels(level);
+			printf("%10.2f", Measure([&] { return bench.pass(dk); }) / 1000);
+		}
+		printf("\n");
+	}
+	return 0;
+}
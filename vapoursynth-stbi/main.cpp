@@ -1,15 +1,864 @@
-
 #include "VapourSynth.h"
 #include "VSHelper.h"
 
+#include "deinterleave.h"
+#include "threadpool.h"
+#include "ziparchive.h"
+
+// Formats stb_image can't decode planar natively get split into the frame's planes by our SIMD kernels
+#define STBI_PLANAR_SPLIT_ROW(src, n, req_comp, dest, count) \
+	((req_comp) == 3 && Deinterleave((src), (n), (dest)[0], (dest)[1], (dest)[2], (count)))
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <ctype.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// How pages get turned into frames
+typedef struct {
+	int yuv;   // Output JPEGs in their native YUV (or gray) instead of converting to RGB
+	int scale; // Shrink pages by 1, 2, 4 or 8; JPEGs do it during the IDCT
+	int crop;  // Only decode the rectangle below, in scaled pixels
+	int left, top;
+	int width, height; // 0 for the rest of the page
+	int animated; // Give every frame of an animated GIF a page of its own
+} stbDecodeOptions;
+
+// One frame of a clip: an image file of its own, or a member of a ZIP/CBZ archive.
+typedef struct {
+	char *filename;        // The image, or the archive it's in
+	char *member;          // nullptr for a file of its own
+	int method;            // ZipStored or ZipDeflated
+	int64_t header_offset; // Of the member's local header
+	int64_t packed_size;
+	int64_t size;
+	int num_frames;        // In the animated GIF this page is a frame of; 0 for any other page
+	int frame;
+	int delay;             // How long the frame shows, in hundredths of a second
+	int animation;         // Index into the clip's animations
+} stbPage;
+
+// What a page decodes to: its format and frame size.
+typedef struct {
+	int color_family; // cmRGB, or cmYUV/cmGray for native JPEG output
+	int ssw, ssh;     // log2 of the chroma subsampling
+	int width, height;
+} stbPageLayout;
+
+static inline int
+PlaneCount(const stbPageLayout &layout)
+{
+	return layout.color_family == cmGray ? 1 : 3;
+}
+
+static inline int
+PlaneWidth(const stbPageLayout &layout, int plane)
+{
+	return plane ? layout.width >> layout.ssw : layout.width;
+}
+
+static inline int
+PlaneHeight(const stbPageLayout &layout, int plane)
+{
+	return plane ? layout.height >> layout.ssh : layout.height;
+}
+
+static inline bool
+SameFormat(const stbPageLayout &a, const stbPageLayout &b)
+{
+	return a.color_family == b.color_family && a.ssw == b.ssw && a.ssh == b.ssh;
+}
+
+static const VSFormat *
+GetPageFormat(const stbPageLayout &layout, VSCore *core, const VSAPI *vsapi)
+{
+	return vsapi->registerFormat(layout.color_family, stInteger, 8, layout.ssw, layout.ssh, core);
+}
+
+/////////////////////
+// Decoded page cache
+/////////////////////
+
+// A decoded page, stored as tightly packed planes one after another.
+typedef struct {
+	stbPageLayout layout;
+	std::shared_ptr<uint8_t> planes;
+} stbDecodedPage;
+
+typedef struct {
+	std::string key;
+	int64_t file_size;
+	int64_t file_mtime;
+	int64_t bytes;
+	stbDecodedPage page;
+} stbCacheEntry;
+
+// Shared by every stb.Image instance in the process, so re-requesting a page (seeking back,
+// several nodes using the same file, reloading the script) doesn't run the decoder again.
+// Entries are keyed by path and decode options, and only reused while the file's size and
+// mtime still match.
+static struct {
+	std::mutex lock;
+	std::list<stbCacheEntry> lru; // Most recently used at the front
+	std::unordered_map<std::string, std::list<stbCacheEntry>::iterator> lookup;
+	int64_t budget = 512 * 1024 * 1024;
+	int64_t used = 0;
+	int64_t hits = 0;
+	int64_t misses = 0;
+	int64_t evictions = 0;
+} g_cache;
+
+static bool
+GetFileStamp(const char *filename, int64_t *size, int64_t *mtime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(filename, &st))
+		return false;
+#else
+	struct stat st;
+	if (stat(filename, &st))
+		return false;
+#endif
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return true;
+}
+
+static std::string
+CacheKey(const stbPage &page, const stbDecodeOptions &options)
+{
+	std::string key = page.filename;
+	// Can't appear in a path, so the member and options can never be mistaken for part of one
+	if (page.member)
+	{
+		key += '\0';
+		key += page.member;
+	}
+	if (page.num_frames)
+	{
+		key += '\0';
+		key += "frame" + std::to_string(page.frame);
+	}
+	key += '\0';
+	key += options.yuv ? 'y' : 'r';
+	key += (char)('0' + options.scale);
+	if (options.crop)
+	{
+		key += '\0';
+		key += std::to_string(options.left) + ',' + std::to_string(options.top) + ',' +
+			std::to_string(options.width) + ',' + std::to_string(options.height);
+	}
+	return key;
+}
+
+static size_t
+PageBytes(const stbPageLayout &layout)
+{
+	size_t bytes = 0;
+	for (int plane = 0; plane < PlaneCount(layout); ++plane)
+		bytes += (size_t)PlaneWidth(layout, plane) * PlaneHeight(layout, plane);
+	return bytes;
+}
+
+// Must be called with g_cache.lock held.
+static void
+CacheEvict(int64_t budget)
+{
+	while (g_cache.used > budget && !g_cache.lru.empty())
+	{
+		stbCacheEntry &entry = g_cache.lru.back();
+		g_cache.used -= entry.bytes;
+		g_cache.lookup.erase(entry.key);
+		g_cache.lru.pop_back();
+		++g_cache.evictions;
+	}
+}
+
+static bool
+CacheLookup(const std::string &key, int64_t file_size, int64_t file_mtime, stbDecodedPage *page)
+{
+	std::lock_guard<std::mutex> guard(g_cache.lock);
+
+	auto it = g_cache.lookup.find(key);
+	if (it != g_cache.lookup.end())
+	{
+		auto entry = it->second;
+		if (entry->file_size == file_size && entry->file_mtime == file_mtime)
+		{
+			g_cache.lru.splice(g_cache.lru.begin(), g_cache.lru, entry);
+			*page = entry->page;
+			++g_cache.hits;
+			return true;
+		}
+
+		// The file changed on disk since it was cached
+		g_cache.used -= entry->bytes;
+		g_cache.lru.erase(entry);
+		g_cache.lookup.erase(it);
+	}
+
+	++g_cache.misses;
+	return false;
+}
+
+// Like CacheLookup, but without using the page or counting a hit or miss.
+static bool
+CacheHas(const std::string &key, int64_t file_size, int64_t file_mtime)
+{
+	std::lock_guard<std::mutex> guard(g_cache.lock);
+	auto it = g_cache.lookup.find(key);
+	return it != g_cache.lookup.end() && it->second->file_size == file_size && it->second->file_mtime == file_mtime;
+}
+
+static bool
+CacheFits(int64_t bytes)
+{
+	std::lock_guard<std::mutex> guard(g_cache.lock);
+	return bytes <= g_cache.budget;
+}
+
+// Takes ownership of planes, which hold the page laid out as in stbDecodedPage.
+static void
+CacheStore(const std::string &key, int64_t file_size, int64_t file_mtime, const stbPageLayout &layout, uint8_t *planes)
+{
+	stbDecodedPage page;
+	page.layout = layout;
+	page.planes = std::shared_ptr<uint8_t>(planes, free);
+
+	int64_t bytes = (int64_t)PageBytes(layout);
+
+	std::lock_guard<std::mutex> guard(g_cache.lock);
+
+	// The budget may have shrunk while the planes were being filled
+	if (bytes > g_cache.budget)
+		return;
+
+	// Another thread may have decoded the same page in the meantime
+	auto it = g_cache.lookup.find(key);
+	if (it != g_cache.lookup.end())
+	{
+		g_cache.used -= it->second->bytes;
+		g_cache.lru.erase(it->second);
+		g_cache.lookup.erase(it);
+	}
+
+	CacheEvict(g_cache.budget - bytes);
+
+	g_cache.lru.push_front({ key, file_size, file_mtime, bytes, page });
+	g_cache.lookup[key] = g_cache.lru.begin();
+	g_cache.used += bytes;
+}
+
+// Copies a freshly decoded frame into the cache, if it fits in the budget at all.
+static void
+CacheInsert(const std::string &key, int64_t file_size, int64_t file_mtime, const stbPageLayout &layout, const VSFrameRef *frame, const VSAPI *vsapi)
+{
+	int64_t bytes = (int64_t)PageBytes(layout);
+	if (!CacheFits(bytes))
+		return;
+
+	uint8_t *planes = (uint8_t *)malloc((size_t)bytes);
+	if (!planes)
+		return;
+
+	uint8_t *dst = planes;
+	for (int plane = 0; plane < PlaneCount(layout); ++plane)
+	{
+		int width = PlaneWidth(layout, plane);
+		int height = PlaneHeight(layout, plane);
+		vs_bitblt(dst, width, vsapi->getReadPtr(frame, plane), vsapi->getStride(frame, plane), width, height);
+		dst += (size_t)width * height;
+	}
+
+	CacheStore(key, file_size, file_mtime, layout, planes);
+}
+
+/////////////
+// Page files
+/////////////
+
+// A page's encoded bytes in memory, so stb_image decodes it through its memory path instead of
+// refilling a small stdio buffer over and over. Files are mapped rather than read; anything that
+// can't be (pipes, devices, empty or >2 GiB files) is left unmapped and read through stdio as
+// before. Archive members are mapped straight out of the archive when stored, and inflated into
+// a buffer when deflated.
+// Only worth it for decoding: probing reads just the header, and mapping a cold file for that
+// makes the OS read around the first page fault, far more than stdio would.
+typedef struct {
+	const char *filename; // Read through stdio when data is nullptr
+	const stbi_uc *data;
+	int size;
+	void *view;           // Mapping to release, if any
+	size_t view_size;
+	stbi_uc *buffer;      // Inflated member to free, if any
+} stbPageFile;
+
+// Maps length bytes from offset (clipped to the end of the file), and asks the OS to read them
+// ahead since they're about to be decoded from start to end.
+static bool
+MapFileRange(const char *filename, int64_t offset, int64_t length, stbPageFile *file)
+{
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (GetFileType(handle) != FILE_TYPE_DISK || !GetFileSizeEx(handle, &size))
+	{
+		CloseHandle(handle);
+		return false;
+	}
+	int64_t file_size = size.QuadPart;
+
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	int64_t granularity = system_info.dwAllocationGranularity;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return false;
+	}
+	int64_t file_size = st.st_size;
+	int64_t granularity = sysconf(_SC_PAGESIZE);
+#endif
+
+	if (offset < 0 || offset >= file_size)
+		length = 0;
+	else if (length > file_size - offset)
+		length = file_size - offset;
+
+	// Views have to start on a granularity boundary
+	int64_t view_offset = offset - offset % granularity;
+	int64_t view_size = length + (offset - view_offset);
+	bool mapped = false;
+
+	if (length > 0 && length <= INT_MAX && (uint64_t)view_size <= SIZE_MAX)
+	{
+#ifdef _WIN32
+		HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+		{
+			void *view = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(view_offset >> 32), (DWORD)view_offset, (SIZE_T)view_size);
+			if (view)
+			{
+				file->view = view;
+				mapped = true;
+			}
+			// The view keeps the mapping and the file open
+			CloseHandle(mapping);
+		}
+#else
+		void *view = mmap(nullptr, (size_t)view_size, PROT_READ, MAP_PRIVATE, fd, (off_t)view_offset);
+		if (view != MAP_FAILED)
+		{
+			madvise(view, (size_t)view_size, MADV_SEQUENTIAL);
+			madvise(view, (size_t)view_size, MADV_WILLNEED);
+			file->view = view;
+			mapped = true;
+		}
+#endif
+	}
+
+#ifdef _WIN32
+	CloseHandle(handle);
+#else
+	// The mapping keeps the file open
+	close(fd);
+#endif
+
+	if (!mapped)
+		return false;
+
+	file->view_size = (size_t)view_size;
+	file->data = (const stbi_uc *)file->view + (offset - view_offset);
+	file->size = (int)length;
+	return true;
+}
+
+static void
+ClosePageFile(stbPageFile *file)
+{
+	if (file->view)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(file->view);
+#else
+		munmap(file->view, file->view_size);
+#endif
+	}
+	free(file->buffer);
+	file->data = nullptr;
+	file->view = nullptr;
+	file->buffer = nullptr;
+}
+
+// Reads length bytes from offset through stdio, for when mapping them failed.
+static stbi_uc *
+ReadFileRange(const char *filename, int64_t offset, int64_t length)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return nullptr;
+
+	stbi_uc *buffer = (stbi_uc *)malloc((size_t)length);
+	if (buffer && !ZipReadAt(f, offset, buffer, (size_t)length))
+	{
+		free(buffer);
+		buffer = nullptr;
+	}
+	fclose(f);
+	return buffer;
+}
+
+static bool
+OpenPageFile(const stbPage &page, stbPageFile *file)
+{
+	*file = { page.filename, nullptr, 0, nullptr, 0, nullptr };
+
+	if (!page.member)
+	{
+		MapFileRange(page.filename, 0, INT64_MAX, file);
+		return true;
+	}
+
+	if (page.packed_size > INT_MAX || page.size > INT_MAX || (page.method == ZipStored && page.packed_size != page.size))
+		return false;
+
+	// Map the local header along with the data, since only it says exactly where the data starts
+	const stbi_uc *packed = nullptr;
+	stbi_uc *packed_buffer = nullptr;
+	if (MapFileRange(page.filename, page.header_offset, ZipMaxLocalHeader + page.packed_size, file))
+	{
+		int64_t data_offset = file->size >= 30 ? ZipDataOffset(page.header_offset, file->data) : -1;
+		if (data_offset >= 0 && data_offset - page.header_offset + page.packed_size <= file->size)
+			packed = file->data + (data_offset - page.header_offset);
+	}
+	else
+	{
+		FILE *f = fopen(page.filename, "rb");
+		uint8_t header[30];
+		int64_t data_offset = -1;
+		if (f && ZipReadAt(f, page.header_offset, header, sizeof(header)))
+			data_offset = ZipDataOffset(page.header_offset, header);
+		if (f)
+			fclose(f);
+		if (data_offset >= 0)
+			packed = packed_buffer = ReadFileRange(page.filename, data_offset, page.packed_size);
+	}
+
+	if (!packed)
+	{
+		ClosePageFile(file);
+		return false;
+	}
+
+	if (page.method == ZipStored)
+	{
+		// Decoded right out of the mapping (or read buffer)
+		file->data = packed;
+		file->size = (int)page.size;
+		if (packed_buffer)
+			file->buffer = packed_buffer;
+		return true;
+	}
+
+	stbi_uc *buffer = (stbi_uc *)malloc(page.size ? (size_t)page.size : 1);
+	bool inflated = buffer && stbi_zlib_decode_noheader_buffer((char *)buffer, (int)page.size,
+		(const char *)packed, (int)page.packed_size) == page.size;
+	free(packed_buffer);
+	ClosePageFile(file);
+	if (!inflated)
+	{
+		free(buffer);
+		return false;
+	}
+
+	file->data = file->buffer = buffer;
+	file->size = (int)page.size;
+	return true;
+}
+
+////////////
+// Decoding
+////////////
+
+// Native output only covers the subsamplings VapourSynth can represent, i.e. powers of two with
+// Cb and Cr sampled alike. Anything else (and every non-JPEG) is converted to RGB.
+static bool
+ProbeJPEGLayout(const stbPageFile &file, int scale, stbPageLayout *layout)
+{
+	int width, height, comp, h_samp[4], v_samp[4];
+	if (!(file.data ? stbi_jpeg_components_info_from_memory(file.data, file.size, &width, &height, &comp, h_samp, v_samp)
+		: stbi_jpeg_components_info(file.filename, &width, &height, &comp, h_samp, v_samp)))
+		return false;
+
+	width = (width + scale - 1) / scale;
+	height = (height + scale - 1) / scale;
+
+	if (comp == 1)
+	{
+		*layout = { cmGray, 0, 0, width, height };
+		return true;
+	}
+
+	if (comp != 3 || h_samp[1] != h_samp[2] || v_samp[1] != v_samp[2] ||
+		h_samp[0] % h_samp[1] || v_samp[0] % v_samp[1])
+		return false;
+
+	int ssw = 0, ssh = 0;
+	while ((h_samp[1] << ssw) < h_samp[0]) ++ssw;
+	while ((v_samp[1] << ssh) < v_samp[0]) ++ssh;
+	if ((h_samp[1] << ssw) != h_samp[0] || (v_samp[1] << ssh) != v_samp[0])
+		return false;
+
+	// Round odd sizes up to whole chroma samples; the extra luma comes from the JPEG's edge blocks
+	// (or repeats the last column/row when a scaled block has none to spare)
+	width = ((width + (1 << ssw) - 1) >> ssw) << ssw;
+	height = ((height + (1 << ssh) - 1) >> ssh) << ssh;
+
+	*layout = { cmYUV, ssw, ssh, width, height };
+	return true;
+}
+
+static bool
+ProbePage(const stbPageFile &file, const stbDecodeOptions &options, stbPageLayout *layout)
+{
+	if (options.yuv && ProbeJPEGLayout(file, options.scale, layout))
+		return true;
+
+	int width, height, comp;
+	if (!(file.data ? stbi_info_from_memory(file.data, file.size, &width, &height, &comp)
+		: stbi_info(file.filename, &width, &height, &comp)) || width == 0 || height == 0)
+		return false;
+
+	*layout = { cmRGB, 0, 0, (width + options.scale - 1) / options.scale, (height + options.scale - 1) / options.scale };
+	return true;
+}
+
+// Narrows a probed page down to the crop, if there is one. Fails if the crop doesn't fit.
+static bool
+CropLayout(const stbDecodeOptions &options, stbPageLayout *layout)
+{
+	if (!options.crop)
+		return true;
+	if (options.left >= layout->width || options.top >= layout->height)
+		return false;
+	int width = options.width ? options.width : layout->width - options.left;
+	int height = options.height ? options.height : layout->height - options.top;
+	if (width > layout->width - options.left || height > layout->height - options.top)
+		return false;
+	layout->width = width;
+	layout->height = height;
+	return true;
+}
+
+// Decodes just enough of an archive member to probe it: the start of its data, growing until
+// stb_image has seen the whole header.
+static bool
+ProbeMember(const stbPage &page, const stbDecodeOptions &options, stbPageLayout *layout)
+{
+	FILE *f = fopen(page.filename, "rb");
+	if (!f)
+		return false;
+
+	uint8_t header[30];
+	int64_t data_offset = -1;
+	if (ZipReadAt(f, page.header_offset, header, sizeof(header)))
+		data_offset = ZipDataOffset(page.header_offset, header);
+
+	bool probed = false;
+	std::vector<stbi_uc> packed, data;
+	for (int64_t want = 64 * 1024; data_offset >= 0; want *= 4)
+	{
+		int64_t size = std::min(want, page.size);
+		int n;
+
+		if (page.method == ZipStored)
+		{
+			data.resize((size_t)size);
+			if (!ZipReadAt(f, data_offset, data.data(), data.size()))
+				break;
+			n = (int)size;
+		}
+		else
+		{
+			// Headers compress well, so a prefix of the packed data about as long as the output
+			// usually covers it; when it doesn't, read more
+			int64_t packed_size = std::min(size, page.packed_size);
+			for (;;)
+			{
+				packed.resize((size_t)packed_size);
+				data.resize((size_t)size);
+				if (!ZipReadAt(f, data_offset, packed.data(), packed.size()))
+				{
+					n = -1;
+					break;
+				}
+				n = stbi_zlib_decode_noheader_prefix((char *)data.data(), (int)size, (const char *)packed.data(), (int)packed_size);
+				if (n >= 0 || packed_size == page.packed_size)
+					break;
+				packed_size = std::min(packed_size * 4, page.packed_size);
+			}
+			if (n < 0)
+				break;
+		}
+
+		stbPageFile file = { page.filename, data.data(), n, nullptr, 0, nullptr };
+		if (n > 0 && ProbePage(file, options, layout))
+		{
+			probed = true;
+			break;
+		}
+		if (size == page.size)
+			break;
+	}
+
+	fclose(f);
+	return probed;
+}
+
+// Decodes straight into the frame, without an intermediate interleaved copy.
+static bool
+DecodePage(const stbPageFile &file, const stbDecodeOptions &options, const stbPageLayout &layout, VSFrameRef *frame, const VSAPI *vsapi)
+{
+	stbi_uc *planes[3];
+	int strides[3], widths[3], heights[3];
+	for (int plane = 0; plane < PlaneCount(layout); ++plane)
+	{
+		planes[plane] = vsapi->getWritePtr(frame, plane);
+		strides[plane] = vsapi->getStride(frame, plane);
+		widths[plane] = PlaneWidth(layout, plane);
+		heights[plane] = PlaneHeight(layout, plane);
+	}
+
+	if (layout.color_family != cmRGB)
+	{
+		if (file.data)
+			return stbi_load_jpeg_components_from_memory(file.data, file.size, options.scale, planes, strides, widths, heights) != 0;
+		return stbi_load_jpeg_components(file.filename, options.scale, planes, strides, widths, heights) != 0;
+	}
+
+	int comp;
+	if (options.crop)
+	{
+		// Only the blocks (or rows, for PNGs) the crop needs get decoded in full
+		if (file.data)
+			return stbi_load_planar_region_from_memory(file.data, file.size, options.left, options.top, layout.width, layout.height, options.scale, &comp, 3, planes, strides) != 0;
+		return stbi_load_planar_region(file.filename, options.left, options.top, layout.width, layout.height, options.scale, &comp, 3, planes, strides) != 0;
+	}
+	if (file.data)
+		return stbi_load_planar_from_memory(file.data, file.size, layout.width, layout.height, options.scale, &comp, 3, planes, strides) != 0;
+	return stbi_load_planar(file.filename, layout.width, layout.height, options.scale, &comp, 3, planes, strides) != 0;
+}
+
+static void
+SetFrameProps(VSFrameRef *frame, const stbPage &page, const stbPageLayout &layout, const VSVideoInfo &vi, const VSAPI *vsapi)
+{
+	// A GIF frame shows as long as the file says. Clips that mix those durations have a variable
+	// frame rate, in which the other pages get the 1/30 s they'd have in a constant rate clip.
+	if (page.num_frames || !vi.fpsNum)
+	{
+		VSMap *props = vsapi->getFramePropsRW(frame);
+		vsapi->propSetInt(props, "_DurationNum", page.num_frames ? page.delay : 1, paReplace);
+		vsapi->propSetInt(props, "_DurationDen", page.num_frames ? 100 : 30, paReplace);
+	}
+
+	if (layout.color_family == cmRGB)
+		return;
+
+	// JFIF: full range BT.601, chroma sited in the center
+	VSMap *props = vsapi->getFramePropsRW(frame);
+	vsapi->propSetInt(props, "_ColorRange", 0, paReplace);
+	if (layout.color_family == cmYUV)
+	{
+		vsapi->propSetInt(props, "_Matrix", 5, paReplace);
+		vsapi->propSetInt(props, "_ChromaLocation", 1, paReplace);
+	}
+}
+
+////////////////
+// Animated GIFs
+////////////////
+
+// An animated GIF being read a frame at a time. Each frame is drawn over what the ones before it
+// left, so the reader is kept between requests and only starts over for an earlier frame.
+typedef struct {
+	std::mutex lock;
+	stbi_gif_reader *reader = nullptr;
+	stbPageFile file = {};
+	int next;                 // The frame the reader comes to next
+	int width, height;        // Of the canvas
+	int64_t file_size, file_mtime;
+} stbAnimation;
+
 typedef struct {
 	VSVideoInfo vi;
-	char *filename;
+	stbPage *pages;
+	int num_pages;
+	stbAnimation *animations;
+	int num_animations;
+	stbDecodeOptions options;
+	const char *name; // Of the function that made the clip, for error messages
 } stbImageData;
 
+// The delays of an animated GIF's frames, read without decoding them; empty for anything else.
+// Archive members are only looked at if they're named like GIFs, so the other pages aren't read.
+static void
+CountGIFFrames(const stbPage &page, std::vector<int> *delays)
+{
+	delays->clear();
+	if (page.member)
+	{
+		size_t dot = strlen(page.member) >= 4 ? strlen(page.member) - 4 : 0;
+		std::string ext = page.member + dot;
+		for (char &c : ext)
+			c = (char)tolower((unsigned char)c);
+		if (ext != ".gif")
+			return;
+	}
+
+	// A file of its own is read through stdio: a non-GIF gives up after its first few bytes
+	stbPageFile file = { page.filename, nullptr, 0, nullptr, 0, nullptr };
+	if (page.member && !OpenPageFile(page, &file))
+		return;
+	stbi_gif_reader *reader = file.data ? stbi_gif_open_from_memory(file.data, file.size, nullptr, nullptr)
+		: stbi_gif_open(file.filename, nullptr, nullptr);
+	int *frame_delays = nullptr;
+	int count = reader ? stbi_gif_count_frames(reader, &frame_delays) : 0;
+	if (count > 0)
+		delays->assign(frame_delays, frame_delays + count);
+	stbi_image_free(frame_delays);
+	stbi_gif_close(reader);
+	ClosePageFile(&file);
+}
+
+static bool
+OpenAnimation(const stbPage &page, stbAnimation *animation)
+{
+	if (!OpenPageFile(page, &animation->file))
+		return false;
+	const stbPageFile &file = animation->file;
+	animation->reader = file.data ? stbi_gif_open_from_memory(file.data, file.size, &animation->width, &animation->height)
+		: stbi_gif_open(file.filename, &animation->width, &animation->height);
+	animation->next = 0;
+	if (!animation->reader)
+	{
+		ClosePageFile(&animation->file);
+		return false;
+	}
+	return true;
+}
+
+static void
+CloseAnimation(stbAnimation *animation)
+{
+	stbi_gif_close(animation->reader);
+	animation->reader = nullptr;
+	ClosePageFile(&animation->file);
+}
+
+// Scales and crops the canvas into the frame the way DecodePage does a page.
+static bool
+SplitCanvas(const stbi_uc *canvas, const stbAnimation &animation, const stbDecodeOptions &options, const stbPageLayout &layout, VSFrameRef *frame, const VSAPI *vsapi)
+{
+	stbi_uc *planes[3];
+	int strides[3];
+	for (int plane = 0; plane < 3; ++plane)
+	{
+		planes[plane] = vsapi->getWritePtr(frame, plane);
+		strides[plane] = vsapi->getStride(frame, plane);
+	}
+	return stbi_split_planar(canvas, animation.width, animation.height, 4, options.left, options.top, layout.width, layout.height,
+		options.scale, 3, planes, strides) != 0;
+}
+
+// Draws the frames of page n's GIF up to n itself. Every frame drawn on the way is cached as well,
+// so playing the clip through decodes each frame once. Must be called with the animation's lock held.
+static VSFrameRef *
+DecodeAnimationFrame(stbImageData *d, int n, int64_t file_size, int64_t file_mtime, VSCore *core, const VSAPI *vsapi)
+{
+	const stbPage &source = d->pages[n];
+	stbAnimation &animation = d->animations[source.animation];
+
+	// Start over for an earlier frame, or if the file changed
+	if (animation.reader && (animation.next > source.frame || animation.file_size != file_size || animation.file_mtime != file_mtime))
+		CloseAnimation(&animation);
+	if (!animation.reader)
+	{
+		if (!OpenAnimation(source, &animation))
+			return nullptr;
+		animation.file_size = file_size;
+		animation.file_mtime = file_mtime;
+	}
+
+	stbPageLayout layout = { cmRGB, 0, 0, (animation.width + d->options.scale - 1) / d->options.scale,
+		(animation.height + d->options.scale - 1) / d->options.scale };
+	if (!CropLayout(d->options, &layout))
+		return nullptr;
+	const VSFormat *format = GetPageFormat(layout, core, vsapi);
+
+	VSFrameRef *frame = nullptr;
+	while (animation.next <= source.frame)
+	{
+		const stbi_uc *canvas;
+		int delay;
+		if (stbi_gif_next(animation.reader, &canvas, &delay) != 1)
+		{
+			CloseAnimation(&animation);
+			return nullptr;
+		}
+
+		const stbPage &page = d->pages[n - source.frame + animation.next++];
+		VSFrameRef *drawn = vsapi->newVideoFrame(format, layout.width, layout.height, nullptr, core);
+		if (!SplitCanvas(canvas, animation, d->options, layout, drawn, vsapi))
+		{
+			vsapi->freeFrame(drawn);
+			CloseAnimation(&animation);
+			return nullptr;
+		}
+		SetFrameProps(drawn, page, layout, d->vi, vsapi);
+		CacheInsert(CacheKey(page, d->options), file_size, file_mtime, layout, drawn, vsapi);
+
+		if (page.frame == source.frame)
+			frame = drawn;
+		else
+			vsapi->freeFrame(drawn);
+	}
+	return frame;
+}
+
+////////////
+// stb.Image
+////////////
+
 static void VS_CC filterInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
 	stbImageData *d = (stbImageData *)* instanceData;
 	vsapi->setVideoInfo(&d->vi, 1, node);
@@ -22,79 +871,690 @@ static const VSFrameRef *VS_CC filterGetFrame(int n, int activationReason, void
 	{
 		VSFrameRef *frame = nullptr;
 
-		int width, height;
-		auto image_data = stbi_load(d->filename, &width, &height, nullptr, 3);
-		if (!image_data)
+		// Each frame is one page; it's only decoded once it's actually requested.
+		const stbPage &source = d->pages[n];
+
+		char msg[1024];
+		int64_t file_size, file_mtime;
+		if (!GetFileStamp(source.filename, &file_size, &file_mtime))
 		{
-			vsapi->setFilterError("Image: Somehow the file couldn't be found.", frameCtx);
+			snprintf(msg, sizeof(msg), "%s: Somehow the file couldn't be found.", d->name);
+			vsapi->setFilterError(msg, frameCtx);
 			return nullptr;
 		}
 
-		frame = vsapi->newVideoFrame(d->vi.format, width, height, nullptr, core);
+		std::string key = CacheKey(source, d->options);
+
+		// A GIF's frames are composited in order, by one request at a time
+		std::unique_lock<std::mutex> animation_lock;
+		if (source.num_frames)
+			animation_lock = std::unique_lock<std::mutex>(d->animations[source.animation].lock);
 
-		int stride = vsapi->getStride(frame, 0);
+		stbDecodedPage page;
+		if (CacheLookup(key, file_size, file_mtime, &page))
+		{
+			const stbPageLayout &layout = page.layout;
+			frame = vsapi->newVideoFrame(GetPageFormat(layout, core, vsapi), layout.width, layout.height, nullptr, core);
 
-		uint8_t *r = vsapi->getWritePtr(frame, 0);
-		uint8_t *g = vsapi->getWritePtr(frame, 1);
-		uint8_t *b = vsapi->getWritePtr(frame, 2);
+			const uint8_t *src = page.planes.get();
+			for (int plane = 0; plane < PlaneCount(layout); ++plane)
+			{
+				int width = PlaneWidth(layout, plane);
+				int height = PlaneHeight(layout, plane);
+				vs_bitblt(vsapi->getWritePtr(frame, plane), vsapi->getStride(frame, plane), src, width, width, height);
+				src += (size_t)width * height;
+			}
 
-		uint8_t *ptr = image_data;
+			SetFrameProps(frame, source, layout, d->vi, vsapi);
+			return frame;
+		}
 
-		for (int y = 0; y < height; ++y)
+		if (source.num_frames)
 		{
-			for (int x = 0; x < width; ++x)
+			frame = DecodeAnimationFrame(d, n, file_size, file_mtime, core, vsapi);
+			if (!frame)
 			{
-				r[x] = *(ptr++);
-				g[x] = *(ptr++);
-				b[x] = *(ptr++);
+				snprintf(msg, sizeof(msg), "%s: Somehow the file couldn't be decoded.", d->name);
+				vsapi->setFilterError(msg, frameCtx);
 			}
+			return frame;
+		}
 
-			r += stride;
-			g += stride;
-			b += stride;
+		stbPageFile file;
+		stbPageLayout layout;
+		if (!OpenPageFile(source, &file) || !ProbePage(file, d->options, &layout) || !CropLayout(d->options, &layout))
+		{
+			ClosePageFile(&file);
+			snprintf(msg, sizeof(msg), "%s: Somehow the file couldn't be decoded.", d->name);
+			vsapi->setFilterError(msg, frameCtx);
+			return nullptr;
 		}
 
+		frame = vsapi->newVideoFrame(GetPageFormat(layout, core, vsapi), layout.width, layout.height, nullptr, core);
+
+		bool decoded = DecodePage(file, d->options, layout, frame, vsapi);
+		ClosePageFile(&file);
+		if (!decoded)
+		{
+			vsapi->freeFrame(frame);
+			snprintf(msg, sizeof(msg), "%s: Somehow the file couldn't be decoded.", d->name);
+			vsapi->setFilterError(msg, frameCtx);
+			return nullptr;
+		}
+
+		SetFrameProps(frame, source, layout, d->vi, vsapi);
+
+		CacheInsert(key, file_size, file_mtime, layout, frame, vsapi);
+
 		return frame;
 	}
 	return nullptr;
 }
 
+static void
+FreePages(stbPage *pages, int num_pages)
+{
+	for (int i = 0; i < num_pages; ++i)
+	{
+		free(pages[i].filename);
+		free(pages[i].member);
+	}
+	free(pages);
+}
+
 static void VS_CC filterFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
 	stbImageData *d = (stbImageData *)instanceData;
-	free(d->filename);
+	FreePages(d->pages, d->num_pages);
+	for (int i = 0; i < d->num_animations; ++i)
+		CloseAnimation(&d->animations[i]);
+	delete[] d->animations;
 	free(d);
 }
 
+static char *
+CopyString(const char *s)
+{
+	int count = strlen(s) + 1;
+	char *copy = (char *)malloc(count * sizeof(char));
+	strcpy_s(copy, count, s);
+	return copy;
+}
+
+static bool
+ParseOptions(const VSMap *in, VSMap *out, const char *name, stbDecodeOptions *options, const VSAPI *vsapi)
+{
+	int err;
+	options->yuv = !!vsapi->propGetInt(in, "yuv", 0, &err);
+	options->animated = !!vsapi->propGetInt(in, "animated", 0, &err);
+
+	int64_t scale = vsapi->propGetInt(in, "scale", 0, &err);
+	if (err)
+		scale = 1;
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+	{
+		char msg[1024];
+		snprintf(msg, sizeof(msg), "%s: scale must be 1, 2, 4 or 8.", name);
+		vsapi->setError(out, msg);
+		return false;
+	}
+	options->scale = (int)scale;
+
+	// Like std.CropAbs, but in the page's own (scaled) pixels
+	static const char *const crop_names[] = { "left", "top", "width", "height" };
+	int64_t crop[4];
+	options->crop = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		crop[i] = vsapi->propGetInt(in, crop_names[i], 0, &err);
+		if (err)
+		{
+			crop[i] = 0;
+			continue;
+		}
+		options->crop = 1;
+		if (crop[i] < (i < 2 ? 0 : 1) || crop[i] > INT_MAX)
+		{
+			char msg[1024];
+			snprintf(msg, sizeof(msg), "%s: %s must be %s.", name, crop_names[i], i < 2 ? "0 or more" : "1 or more");
+			vsapi->setError(out, msg);
+			return false;
+		}
+	}
+	if (options->crop && options->yuv)
+	{
+		char msg[1024];
+		snprintf(msg, sizeof(msg), "%s: Cropping only works with RGB output, not with yuv.", name);
+		vsapi->setError(out, msg);
+		return false;
+	}
+	options->left = (int)crop[0];
+	options->top = (int)crop[1];
+	options->width = (int)crop[2];
+	options->height = (int)crop[3];
+	return true;
+}
+
+// Replaces every page that's an animated GIF (with more than one delay) with a page per frame.
+static void
+ExpandAnimations(stbImageData *d, const std::vector<std::vector<int>> &delays, int num_frames)
+{
+	stbPage *pages = (stbPage *)calloc(num_frames, sizeof(stbPage));
+	int num_animations = 0;
+	for (int i = 0, k = 0; i < d->num_pages; ++i)
+	{
+		if (delays[i].empty())
+		{
+			pages[k++] = d->pages[i];
+			continue;
+		}
+		for (int frame = 0; frame < (int)delays[i].size(); ++frame)
+		{
+			stbPage &page = pages[k++];
+			page = d->pages[i];
+			if (frame)
+			{
+				page.filename = CopyString(page.filename);
+				page.member = page.member ? CopyString(page.member) : nullptr;
+			}
+			page.num_frames = (int)delays[i].size();
+			page.frame = frame;
+			// Like browsers, frames with a delay of 0 or 1 show for 1/10 s
+			page.delay = delays[i][frame] > 1 ? delays[i][frame] : 10;
+			page.animation = num_animations;
+		}
+		++num_animations;
+	}
+	free(d->pages);
+	d->pages = pages;
+	d->num_pages = num_frames;
+	d->animations = new stbAnimation[num_animations];
+	d->num_animations = num_animations;
+}
+
+// Probes every page of d and creates the clip. Takes ownership of d's pages either way.
+static void
+CreateClip(const VSMap *in, VSMap *out, stbImageData d, VSCore *core, const VSAPI *vsapi)
+{
+	// Only the headers are parsed here; the pixels are decoded on the first frame request.
+	// If the pages don't all share the same size or format, the clip gets variable ones.
+	stbPageLayout clip_layout = {};
+	bool constant_format = true;
+	std::vector<std::vector<int>> delays(d.num_pages);
+	int num_frames = 0;
+	for (int i = 0; i < d.num_pages; ++i)
+	{
+		const stbPage &page = d.pages[i];
+
+		stbPageFile file = { page.filename, nullptr, 0, nullptr, 0, nullptr };
+		stbPageLayout layout;
+		if (page.member ? !ProbeMember(page, d.options, &layout) : !ProbePage(file, d.options, &layout))
+		{
+			char msg[1024];
+			if (page.member)
+				snprintf(msg, sizeof(msg), "%s: Couldn't open %s in %s.", d.name, page.member, page.filename);
+			else
+				snprintf(msg, sizeof(msg), "%s: Couldn't open the file %s.", d.name, page.filename);
+			vsapi->setError(out, msg);
+			FreePages(d.pages, d.num_pages);
+			return;
+		}
+		if (!CropLayout(d.options, &layout))
+		{
+			char msg[1024];
+			snprintf(msg, sizeof(msg), "%s: The crop doesn't fit in %s (%dx%d).", d.name, page.member ? page.member : page.filename, layout.width, layout.height);
+			vsapi->setError(out, msg);
+			FreePages(d.pages, d.num_pages);
+			return;
+		}
+
+		// Animated GIFs are skimmed for their frames' delays, but only decoded on request too
+		if (d.options.animated)
+			CountGIFFrames(page, &delays[i]);
+		if (delays[i].size() < 2)
+			delays[i].clear();
+		num_frames += delays[i].empty() ? 1 : (int)delays[i].size();
+
+		if (i == 0)
+		{
+			clip_layout = layout;
+		}
+		else
+		{
+			if (layout.width != clip_layout.width || layout.height != clip_layout.height)
+			{
+				clip_layout.width = 0;
+				clip_layout.height = 0;
+			}
+			if (!SameFormat(layout, clip_layout))
+				constant_format = false;
+		}
+	}
+
+	if (num_frames != d.num_pages)
+		ExpandAnimations(&d, delays, num_frames);
+
+	d.vi = { nullptr, 30, 1, clip_layout.width, clip_layout.height, d.num_pages, 0 };
+
+	// GIF frames show as long as they say; if every frame of the clip shows for the same time,
+	// the clip gets that rate, otherwise a variable one
+	if (d.num_animations)
+	{
+		bool constant_rate = true;
+		for (int i = 0; i < d.num_pages; ++i)
+			if (!d.pages[i].num_frames || d.pages[i].delay != d.pages[0].delay)
+				constant_rate = false;
+		d.vi.fpsNum = constant_rate ? 1 : 0;
+		d.vi.fpsDen = constant_rate ? 1 : 0;
+		if (constant_rate)
+			muldivRational(&d.vi.fpsNum, &d.vi.fpsDen, 100, d.pages[0].delay);
+	}
+
+	if (constant_format)
+		d.vi.format = GetPageFormat(clip_layout, core, vsapi);
+
+	stbImageData *data = (stbImageData *)malloc(sizeof(d));
+	*data = d;
+
+	vsapi->createFilter(in, out, d.name, filterInit, filterGetFrame, filterFree, fmParallel, 0, data, core);
+}
+
 static void VS_CC filterCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
 	stbImageData d = { nullptr };
-	stbImageData *data;
+	d.name = "Image";
+
+	int num_files = vsapi->propNumElements(in, "filename");
+	if (num_files < 1)
+	{
+		vsapi->setError(out, "Image: No files were given.");
+		return;
+	}
+
+	if (!ParseOptions(in, out, d.name, &d.options, vsapi))
+		return;
+
+	d.num_pages = num_files;
+	d.pages = (stbPage *)calloc(num_files, sizeof(stbPage));
+	for (int i = 0; i < num_files; ++i)
+		d.pages[i].filename = CopyString(vsapi->propGetData(in, "filename", i, nullptr));
+
+	CreateClip(in, out, d, core, vsapi);
+}
+
+//////////////
+// stb.Archive
+//////////////
+
+static bool
+IsImageName(const std::string &name)
+{
+	// macOS litters archives with resource forks that share the pages' names
+	if (name.empty() || name.back() == '/' || name.compare(0, 9, "__MACOSX/") == 0)
+		return false;
+	size_t base = name.find_last_of('/');
+	base = base == std::string::npos ? 0 : base + 1;
+	if (name.compare(base, 2, "._") == 0)
+		return false;
+
+	size_t dot = name.find_last_of('.');
+	if (dot == std::string::npos || dot < base)
+		return false;
+	std::string ext = name.substr(dot + 1);
+	for (char &c : ext)
+		c = (char)tolower((unsigned char)c);
+
+	static const char *const extensions[] = {
+		"jpg", "jpeg", "jpe", "jfif", "png", "bmp", "gif", "tga", "psd", "hdr", "pic", "pnm", "ppm", "pgm",
+	};
+	for (const char *extension : extensions)
+		if (ext == extension)
+			return true;
+	return false;
+}
+
+// Orders names the way a reader would: runs of digits compare by value, so page2 comes before
+// page10, and letters compare without regard to case.
+static bool
+NaturalLess(const std::string &a, const std::string &b)
+{
+	size_t i = 0, j = 0;
+	while (i < a.size() && j < b.size())
+	{
+		if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j]))
+		{
+			size_t i_end, j_end;
+			while (i < a.size() && a[i] == '0')
+				++i;
+			while (j < b.size() && b[j] == '0')
+				++j;
+			for (i_end = i; i_end < a.size() && isdigit((unsigned char)a[i_end]); ++i_end);
+			for (j_end = j; j_end < b.size() && isdigit((unsigned char)b[j_end]); ++j_end);
+
+			if (i_end - i != j_end - j)
+				return i_end - i < j_end - j;
+			int cmp = a.compare(i, i_end - i, b, j, j_end - j);
+			if (cmp)
+				return cmp < 0;
+			i = i_end;
+			j = j_end;
+			continue;
+		}
+
+		int ca = tolower((unsigned char)a[i]), cb = tolower((unsigned char)b[j]);
+		if (ca != cb)
+			return ca < cb;
+		++i;
+		++j;
+	}
+	if (a.size() - i != b.size() - j)
+		return a.size() - i < b.size() - j;
+	return a < b;
+}
+
+// Adds the images in a ZIP archive to pages, in natural order. On failure, none are added and
+// msg says why.
+static bool
+ListArchivePages(const char *filename, const char *name, std::vector<stbPage> *pages, char *msg, size_t msg_size)
+{
+	// Pages are read straight out of the archive, so nothing is extracted up front
+	std::vector<ZipMember> members;
+	FILE *f = fopen(filename, "rb");
+	bool listed = f && ReadZipDirectory(f, &members);
+	if (f)
+		fclose(f);
+
+	if (!listed)
+	{
+		snprintf(msg, msg_size, "%s: Couldn't read %s as a ZIP archive.", name, filename);
+		return false;
+	}
+
+	std::vector<const ZipMember *> images;
+	for (const ZipMember &member : members)
+	{
+		if (!IsImageName(member.name))
+			continue;
+		if (member.encrypted || (member.method != ZipStored && member.method != ZipDeflated))
+		{
+			snprintf(msg, msg_size, "%s: %s in %s is encrypted or compressed in a way that can't be read.", name, member.name.c_str(), filename);
+			return false;
+		}
+		images.push_back(&member);
+	}
+
+	if (images.empty())
+	{
+		snprintf(msg, msg_size, "%s: There are no images in %s.", name, filename);
+		return false;
+	}
+
+	std::stable_sort(images.begin(), images.end(), [](const ZipMember *a, const ZipMember *b) {
+		return NaturalLess(a->name, b->name);
+	});
+
+	for (const ZipMember *member : images)
+	{
+		stbPage page = {};
+		page.filename = CopyString(filename);
+		page.member = CopyString(member->name.c_str());
+		page.method = member->method;
+		page.header_offset = member->header_offset;
+		page.packed_size = member->packed_size;
+		page.size = member->size;
+		pages->push_back(page);
+	}
+	return true;
+}
+
+static void VS_CC archiveCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+	stbImageData d = { nullptr };
+	d.name = "Archive";
 
 	const char *filename = vsapi->propGetData(in, "filename", 0, nullptr);
 
-	int width = 0, height = 0;
-	stbi_load(filename, &width, &height, nullptr, 3);
-	if (width == 0 || height == 0)
+	if (!ParseOptions(in, out, d.name, &d.options, vsapi))
+		return;
+
+	char msg[1024];
+	std::vector<stbPage> pages;
+	if (!ListArchivePages(filename, d.name, &pages, msg, sizeof(msg)))
 	{
-		vsapi->setError(out, "Image: Couldn't open the file.");
+		vsapi->setError(out, msg);
 		return;
 	}
 
-	int count = strlen(filename) + 1;
-	d.filename = (char *)malloc(count * sizeof(char));
-	strcpy_s(d.filename, count, filename);
+	d.num_pages = (int)pages.size();
+	d.pages = (stbPage *)calloc(pages.size(), sizeof(stbPage));
+	std::copy(pages.begin(), pages.end(), d.pages);
 
-	d.vi = { nullptr, 30, 1, width, height, 1, 0 };
+	CreateClip(in, out, d, core, vsapi);
+}
 
-	d.vi.format = vsapi->getFormatPreset(pfRGB24, core);
+//////////////
+// stb.Preload
+//////////////
 
-	data = (stbImageData *)malloc(sizeof(d));
-	*data = d;
+// Pages are opened this many times max_in_flight at a time, so a big archive's deflated members
+// aren't all inflated at once, but there's always another page ready when one is decoded.
+static const int PreloadBatchPerDecode = 2;
+
+// A batch of pages being decoded into the cache, the nth source being pages[n].
+typedef struct {
+	const stbPage *const *pages;
+	stbPageFile *files;
+	const int64_t *file_sizes;
+	const int64_t *file_mtimes;
+	stbDecodeOptions options;
+	std::atomic<int> decoded;
+	std::atomic<int> failed;
+} stbPreload;
 
-	vsapi->createFilter(in, out, "Image", filterInit, filterGetFrame, filterFree, fmParallel, 0, data, core);
+static bool
+IsArchiveName(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	if (!dot)
+		return false;
+	std::string ext = dot + 1;
+	for (char &c : ext)
+		c = (char)tolower((unsigned char)c);
+	return ext == "zip" || ext == "cbz";
 }
 
+// Called on whichever thread decoded the page, as soon as it has.
+static void
+PreloadDone(void *user, int index, stbi_uc *data, int x, int y, int comp)
+{
+	stbPreload *p = (stbPreload *)user;
+	ClosePageFile(&p->files[index]);
+	if (!data)
+	{
+		++p->failed;
+		return;
+	}
+
+	// At full size, splitting the decoded page gives the same pixels stb.Image would decode
+	stbPageLayout layout = { cmRGB, 0, 0, x, y };
+	size_t bytes = PageBytes(layout);
+	uint8_t *planes = CacheFits((int64_t)bytes) ? (uint8_t *)malloc(bytes) : nullptr;
+	if (planes)
+	{
+		stbi_uc *dst[3];
+		int strides[3];
+		for (int plane = 0; plane < 3; ++plane)
+		{
+			dst[plane] = planes + (size_t)plane * x * y;
+			strides[plane] = x;
+		}
+		stbi_split_planar(data, x, y, 3, 0, 0, x, y, 1, 3, dst, strides);
+		CacheStore(CacheKey(*p->pages[index], p->options), p->file_sizes[index], p->file_mtimes[index], layout, planes);
+	}
+	stbi_image_free(data);
+	++p->decoded;
+}
+
+static void VS_CC preloadCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+	int err;
+	int64_t max_in_flight = vsapi->propGetInt(in, "max_in_flight", 0, &err);
+	if (err)
+		max_in_flight = std::max(1u, std::thread::hardware_concurrency());
+	if (max_in_flight < 1 || max_in_flight > INT_MAX)
+	{
+		vsapi->setError(out, "Preload: max_in_flight must be 1 or more.");
+		return;
+	}
+
+	// An archive stands for every image in it, as in stb.Archive
+	std::vector<stbPage> pages;
+	int num_files = vsapi->propNumElements(in, "filename");
+	for (int i = 0; i < num_files; ++i)
+	{
+		const char *filename = vsapi->propGetData(in, "filename", i, nullptr);
+		char msg[1024];
+		if (!IsArchiveName(filename))
+		{
+			stbPage page = {};
+			page.filename = CopyString(filename);
+			pages.push_back(page);
+		}
+		else if (!ListArchivePages(filename, "Preload", &pages, msg, sizeof(msg)))
+		{
+			for (stbPage &page : pages)
+			{
+				free(page.filename);
+				free(page.member);
+			}
+			vsapi->setError(out, msg);
+			return;
+		}
+	}
+
+	// The pages are cached as stb.Image and stb.Archive decode them without any options
+	stbPreload p;
+	p.options = { 0, 1 };
+	p.decoded = 0;
+	p.failed = 0;
+	int cached = 0;
+
+	size_t batch_size = (size_t)std::min<int64_t>(max_in_flight * PreloadBatchPerDecode, INT_MAX);
+	for (size_t next = 0; next < pages.size();)
+	{
+		std::vector<const stbPage *> batch;
+		std::vector<int64_t> file_sizes, file_mtimes;
+		std::vector<stbPageFile> files;
+		std::vector<stbi_load_source> sources;
+
+		// Pages that are cached already don't count towards the batch
+		while (next < pages.size() && batch.size() < batch_size)
+		{
+			const stbPage &page = pages[next++];
+			int64_t file_size, file_mtime;
+			if (!GetFileStamp(page.filename, &file_size, &file_mtime))
+			{
+				++p.failed;
+				continue;
+			}
+			// Checked before opening, which maps the file or inflates the member
+			if (CacheHas(CacheKey(page, p.options), file_size, file_mtime))
+			{
+				++cached;
+				continue;
+			}
+			stbPageFile file;
+			if (!OpenPageFile(page, &file))
+			{
+				++p.failed;
+				continue;
+			}
+
+			batch.push_back(&page);
+			file_sizes.push_back(file_size);
+			file_mtimes.push_back(file_mtime);
+			files.push_back(file);
+			if (file.data)
+				sources.push_back({ nullptr, file.data, file.size });
+			else
+				sources.push_back({ file.filename, nullptr, 0 });
+		}
+
+		// Handed over as they're decoded, so one slow page doesn't hold up the rest, and each page's
+		// file is closed then
+		p.pages = batch.data();
+		p.files = files.data();
+		p.file_sizes = file_sizes.data();
+		p.file_mtimes = file_mtimes.data();
+		if (!stbi_load_many(sources.data(), (int)sources.size(), 3, (int)max_in_flight, 0, PreloadDone, &p))
+		{
+			p.failed += (int)files.size();
+			for (stbPageFile &file : files)
+				ClosePageFile(&file);
+		}
+	}
+
+	for (stbPage &page : pages)
+	{
+		free(page.filename);
+		free(page.member);
+	}
+
+	vsapi->propSetInt(out, "decoded", p.decoded, paReplace);
+	vsapi->propSetInt(out, "cached", cached, paReplace);
+	vsapi->propSetInt(out, "failed", p.failed, paReplace);
+}
+
+////////////////
+// Cache control
+////////////////
+
+static void VS_CC setCacheSizeCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+	int64_t bytes = vsapi->propGetInt(in, "bytes", 0, nullptr);
+	if (bytes < 0)
+	{
+		vsapi->setError(out, "SetCacheSize: bytes can't be negative.");
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(g_cache.lock);
+	g_cache.budget = bytes;
+	CacheEvict(bytes);
+}
+
+static void VS_CC cacheStatsCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+	std::lock_guard<std::mutex> guard(g_cache.lock);
+	vsapi->propSetInt(out, "hits", g_cache.hits, paReplace);
+	vsapi->propSetInt(out, "misses", g_cache.misses, paReplace);
+	vsapi->propSetInt(out, "evictions", g_cache.evictions, paReplace);
+	vsapi->propSetInt(out, "entries", (int64_t)g_cache.lru.size(), paReplace);
+	vsapi->propSetInt(out, "bytes", g_cache.used, paReplace);
+	vsapi->propSetInt(out, "budget", g_cache.budget, paReplace);
+}
+
+/////////////////////////
+// Parallel page decoding
+/////////////////////////
+
+static void
+RunParallel(void *user, stbi_parallel_task *task, void *arg, int count)
+{
+	ThreadPoolRun((ThreadPool *)user, task, arg, count);
+}
+
+// Lets a single large page decode on every core (for now, JPEGs with restart markers). Shared by
+// every core in the process, and only set up once since stb_image's runner is process-wide.
+static ThreadPool *
+InstallThreadPool()
+{
+	ThreadPool *pool = ThreadPoolCreate();
+	stbi_set_parallel_runner(RunParallel, pool, pool->num_workers + 1);
+	return pool;
+}
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
 	configFunc("com.bocom.stb", "stb", "stb_image Image Loder", VAPOURSYNTH_API_VERSION, 1, plugin);
-	registerFunc("Image", "filename:data;", filterCreate, nullptr, plugin);
+	static ThreadPool *pool = InstallThreadPool();
+	(void)pool;
+	registerFunc("Image", "filename:data[];yuv:int:opt;scale:int:opt;left:int:opt;top:int:opt;width:int:opt;height:int:opt;animated:int:opt;", filterCreate, nullptr, plugin);
+	registerFunc("Archive", "filename:data;yuv:int:opt;scale:int:opt;left:int:opt;top:int:opt;width:int:opt;height:int:opt;animated:int:opt;", archiveCreate, nullptr, plugin);
+	registerFunc("Preload", "filename:data[];max_in_flight:int:opt;", preloadCreate, nullptr, plugin);
+	registerFunc("SetCacheSize", "bytes:int;", setCacheSizeCreate, nullptr, plugin);
+	registerFunc("CacheStats", "", cacheStatsCreate, nullptr, plugin);
 }
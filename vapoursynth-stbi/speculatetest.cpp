@@ -0,0 +1,258 @@
+// Test of stb_image's speculative split of JPEG scans without restart markers: every load is done
+// serially and again with a parallel runner, and the two have to come out byte for byte the same,
+// failures included.
+//
+// This isn't part of the plugin. Build it on its own next to stb_image.h and threadpool.h, and run
+// it from this directory so it finds testdata/; it exits with 1 if anything didn't match:
+//   cl /O2 /EHsc speculatetest.cpp
+//   g++ -O2 -pthread speculatetest.cpp -o speculatetest
+// The fixtures are a baseline 4:4:4, a 4:2:0 and a grayscale JPEG saved by Pillow at quality 90,
+// which writes no DRI marker. The minimum chunk size is shrunk so that files this small are split
+// at all, and they're split into more and more chunks, down to smaller than an MCU. Truncated and
+// bit-flipped files mostly still decode, so stretches of 0xff (which is never a valid code) are
+// written into the scan as well, to make the split give up and fall back on the serial decoder.
+// The test only passes if it reached both the speculative decode and the fallback.
+
+#define STBI__SPECULATE_MIN_CHUNK 16
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+typedef std::vector<stbi_uc> Bytes;
+
+static const char *Fixtures[] = { "testdata/baseline444.jpg", "testdata/baseline420.jpg", "testdata/gray.jpg" };
+static const int Splits[] = { 3, 4, 8, 32, 128, 512 }; // The runner's thread counts
+static const int Workers = 3; // Besides the calling thread, however many cores there are
+
+static ThreadPool *Pool;
+
+// Whether the current load skimmed chunks and went on to decode them
+static bool Skimmed, Speculated;
+static int SpeculativeLoads, FallbackLoads;
+
+static void
+RunParallel(void *user, stbi_parallel_task *task, void *arg, int count)
+{
+	if (task == stbi__jpeg_skim_task)
+		Skimmed = true;
+	if (task == stbi__jpeg_speculative_decode_task)
+		Speculated = true;
+	ThreadPoolRun((ThreadPool *)user, task, arg, count);
+}
+
+// One load's outcome, the pixels or the failure reason
+typedef struct {
+	bool ok;
+	int x, y, comp;
+	Bytes pixels;
+	std::string failure;
+} Result;
+
+static bool
+Same(const Result &a, const Result &b)
+{
+	if (a.ok != b.ok)
+		return false;
+	if (!a.ok)
+		return a.failure == b.failure;
+	return a.x == b.x && a.y == b.y && a.comp == b.comp && a.pixels == b.pixels;
+}
+
+static Result
+LoadFull(const Bytes &file)
+{
+	Result r = {};
+	stbi_uc *data = stbi_load_from_memory(file.data(), (int)file.size(), &r.x, &r.y, &r.comp, 0);
+	r.ok = data != nullptr;
+	if (data)
+		r.pixels.assign(data, data + (size_t)r.x * r.y * r.comp);
+	else
+		r.failure = stbi_failure_reason();
+	stbi_image_free(data);
+	return r;
+}
+
+// A rectangle of the image shrunk by `scale`, the whole of it if w is 0
+static Result
+LoadPlanar(const Bytes &file, int scale, int x, int y, int w, int h)
+{
+	Result r = {};
+	int full_w, full_h, comp;
+	if (!stbi_info_from_memory(file.data(), (int)file.size(), &full_w, &full_h, &comp))
+	{
+		r.failure = stbi_failure_reason();
+		return r;
+	}
+	if (!w)
+	{
+		w = (full_w + scale - 1) / scale;
+		h = (full_h + scale - 1) / scale;
+	}
+
+	int req_comp = comp == 1 ? 1 : 3;
+	r.x = w;
+	r.y = h;
+	r.pixels.resize((size_t)w * h * req_comp);
+	stbi_uc *planes[3];
+	int strides[3];
+	for (int i = 0; i < req_comp; ++i)
+	{
+		planes[i] = &r.pixels[(size_t)w * h * i];
+		strides[i] = w;
+	}
+	r.ok = stbi_load_planar_region_from_memory(file.data(), (int)file.size(), x, y, w, h, scale, &r.comp, req_comp, planes, strides) != 0;
+	if (!r.ok)
+	{
+		r.pixels.clear();
+		r.failure = stbi_failure_reason();
+	}
+	return r;
+}
+
+static int Failures;
+
+// Runs a load serially, then split `splits` ways, and compares them
+template <typename Load>
+static void
+Check(const char *fixture, const char *what, int splits, Load load)
+{
+	stbi_set_parallel_runner(nullptr, nullptr, 1);
+	Result serial = load();
+
+	stbi_set_parallel_runner(RunParallel, Pool, splits);
+	Skimmed = Speculated = false;
+	Result parallel = load();
+	if (Speculated)
+		++SpeculativeLoads;
+	else if (Skimmed)
+		++FallbackLoads;
+
+	if (!Same(serial, parallel))
+	{
+		if (++Failures <= 10)
+			printf("%s, %s, %d threads: differs from the serial decode (%s / %s)\n", fixture, what, splits,
+				serial.ok ? "ok" : serial.failure.c_str(), parallel.ok ? "ok" : parallel.failure.c_str());
+	}
+}
+
+static bool
+ReadFile(const char *filename, Bytes &out)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	out.resize((size_t)ftell(f));
+	fseek(f, 0, SEEK_SET);
+	bool ok = fread(out.data(), 1, out.size(), f) == out.size();
+	fclose(f);
+	return ok;
+}
+
+// Where the entropy-coded data of the (only) scan starts, or 0 if the file has restart markers,
+// which would take the restart-interval path instead
+static size_t
+ScanStart(const Bytes &file)
+{
+	for (size_t i = 2; i + 4 <= file.size(); i += 2 + (file[i + 2] << 8 | file[i + 3]))
+	{
+		if (file[i] != 0xff || file[i + 1] == 0xdd)
+			return 0;
+		if (file[i + 1] == 0xda)
+			return i + 2 + (file[i + 2] << 8 | file[i + 3]);
+	}
+	return 0;
+}
+
+int
+main()
+{
+	Pool = ThreadPoolCreate();
+	Pool->num_workers = Workers;
+
+	for (const char *fixture : Fixtures)
+	{
+		Bytes file;
+		if (!ReadFile(fixture, file))
+		{
+			printf("%s: can't read it\n", fixture);
+			return 1;
+		}
+		size_t scan = ScanStart(file);
+		if (!scan)
+		{
+			printf("%s: no scan, or it has restart markers\n", fixture);
+			return 1;
+		}
+
+		int w, h, comp;
+		stbi_info_from_memory(file.data(), (int)file.size(), &w, &h, &comp);
+
+		for (int splits : Splits)
+		{
+			Check(fixture, "full", splits, [&] { return LoadFull(file); });
+			for (int scale = 2; scale <= 8; scale *= 2)
+			{
+				char what[32];
+				snprintf(what, sizeof(what), "scale %d", scale);
+				Check(fixture, what, splits, [&] { return LoadPlanar(file, scale, 0, 0, 0, 0); });
+			}
+			Check(fixture, "region", splits, [&] { return LoadPlanar(file, 1, w / 5, h / 3, w / 2, h / 4); });
+			Check(fixture, "scaled region", splits, [&] { return LoadPlanar(file, 2, w / 7, 3, w / 4, h / 3); });
+
+			// Cut off at points through the scan, so the serial decoder runs into the end
+			for (int k = 1; k < 8; ++k)
+			{
+				Bytes cut(file.begin(), file.begin() + scan + (file.size() - scan) * k / 8);
+				char what[32];
+				snprintf(what, sizeof(what), "truncated %d/8", k);
+				Check(fixture, what, splits, [&] { return LoadFull(cut); });
+			}
+
+			// Single flipped bits throughout the scan, which throw the Huffman codes out of step
+			for (int k = 0; k < 24; ++k)
+			{
+				Bytes flipped = file;
+				size_t pos = scan + (file.size() - scan) * (2 * k + 1) / 50;
+				flipped[pos] ^= (stbi_uc)(1 << (k % 8));
+				char what[32];
+				snprintf(what, sizeof(what), "bit flip at %d", (int)pos);
+				Check(fixture, what, splits, [&] { return LoadFull(flipped); });
+			}
+
+			// Stuffed 0xff bytes, which read as a run of 1 bits, at a few places
+			for (int k = 0; k < 4; ++k)
+			{
+				Bytes corrupt = file;
+				size_t pos = scan + (file.size() - scan) * (2 * k + 1) / 8;
+				for (int i = 0; i < 8; ++i)
+				{
+					corrupt[pos + i * 2] = 0xff;
+					corrupt[pos + i * 2 + 1] = 0;
+				}
+				char what[32];
+				snprintf(what, sizeof(what), "0xff run at %d", (int)pos);
+				Check(fixture, what, splits, [&] { return LoadFull(corrupt); });
+			}
+		}
+	}
+
+	printf("%d loads split speculatively, %d fell back on the serial decoder\n", SpeculativeLoads, FallbackLoads);
+	if (!SpeculativeLoads || !FallbackLoads)
+	{
+		printf("didn't reach both the speculative decode and the fallback\n");
+		return 1;
+	}
+	if (Failures)
+	{
+		printf("%d loads differed from the serial decode\n", Failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -272,6 +272,14 @@ distribute, and modify this file as you see fit.
 //
 // Paletted PNG, BMP, GIF, and PIC images are automatically depalettized.
 //
+// Any number of images can be decoded at once on different threads. The
+// failure reason is kept per thread, and each setting below has a
+// process-wide value plus a per-thread override (the *_thread variants) that
+// takes precedence on the thread that set it. Define STBI_THREAD_LOCAL to the
+// compiler's thread-local storage keyword if it isn't detected; without it
+// the failure reason is shared and the *_thread setters change the
+// process-wide values.
+//
 // ===========================================================================
 //
 // Philosophy
@@ -318,8 +326,11 @@ distribute, and modify this file as you see fit.
 // (The old do-it-yourself SIMD API is no longer supported in the current
 // code.)
 //
-// On x86, SSE2 will automatically be used when available based on a run-time
-// test; if not, the generic C versions are used as a fall-back. On ARM targets,
+// On x86 and x64, SSE2 will automatically be used when available based on a
+// run-time test; if not, the generic C versions are used as a fall-back. The
+// JPEG decoder also has AVX2 versions of its IDCT, upsampling and color
+// conversion loops, likewise picked at run time; define STBI_NO_AVX2 to leave
+// them out. On ARM targets,
 // the typical path is to have separate builds for NEON and non-NEON devices
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
@@ -441,6 +452,213 @@ extern "C" {
 	// for stbi_load_from_file, file pointer is left pointing immediately after image
 #endif
 
+	//
+	// batch loading: decodes count images like stbi_load, several at once on the
+	// threads of the parallel runner (see stbi_set_parallel_runner; without one,
+	// they're decoded one after another on the calling thread). each source is
+	// a file if filename is set, otherwise len bytes at buffer, which have to
+	// stay valid until stbi_load_many returns.
+	//
+	// every image is handed to done() along with its index in sources, or NULL
+	// (with stbi_failure_reason() saying why) if it couldn't be decoded; done()
+	// owns it from then on and frees it with stbi_image_free. with in_order set,
+	// images are handed over one at a time in the order of sources, on
+	// whichever thread is decoding when an image's turn comes; otherwise each
+	// one is handed over as soon as it's decoded, on the thread that decoded
+	// it, so done() may be called from several threads at once.
+	//
+	// at most max_in_flight images are decoded or waiting to be handed over at
+	// any time, which bounds the memory used. a thread starts on the next image
+	// as soon as it's done with one; in order, it first waits for the image
+	// max_in_flight places back to be handed over, so a slow image holds up at
+	// most that many after it. a thread waiting like that stays with
+	// stbi_load_many, so the runner can't give it other work, but it sleeps a
+	// millisecond at a time rather than spinning. returns 0 (before decoding
+	// anything) if it runs out of memory, else 1.
+	//
+
+	typedef struct
+	{
+		char const *filename;  // not with STBI_NO_STDIO
+		stbi_uc const *buffer;
+		int len;
+	} stbi_load_source;
+
+	typedef void stbi_load_done(void *user, int index, stbi_uc *data, int x, int y, int comp);
+
+	STBIDEF int      stbi_load_many(stbi_load_source const *sources, int count, int req_comp, int max_in_flight, int in_order, stbi_load_done *done, void *user);
+
+	//
+	// planar output: decode straight into caller-provided planes, one per output
+	// channel, instead of returning one interleaved buffer. planes[i] must hold
+	// w x h bytes with rows strides[i] bytes apart; get w and h from stbi_info
+	// first. fails if the image isn't exactly w x h. req_comp works as for
+	// stbi_load (so 3 gives R,G,B planes) but must be 1..4. returns 1 on success;
+	// on failure the planes may have been partly written.
+	//
+	// scale is 1, 2, 4 or 8 and shrinks the image by that factor, in which case
+	// w x h is the image size divided by scale, rounded up. JPEG is decoded at
+	// that size directly with a reduced IDCT, which is much cheaper than a full
+	// decode; other formats are decoded at full size and box-filtered down.
+	//
+	// JPEG is decoded and color-converted straight into the planes; at full size
+	// other formats go through stbi_load_rows, and are split up a row at a time
+	// as each row comes out (scaled down, they're decoded whole). to do that split
+	// yourself (e.g. with SIMD), #define STBI_PLANAR_SPLIT_ROW(src,n,req_comp,dest,count)
+	// before including the implementation; it gets 'count' interleaved pixels of
+	// n channels and req_comp row pointers, and returns 0 to fall back to the
+	// built-in version.
+	//
+
+	STBIDEF int      stbi_load_planar(char              const *filename, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+	STBIDEF int      stbi_load_planar_from_memory(stbi_uc           const *buffer, int len, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+	STBIDEF int      stbi_load_planar_from_callbacks(stbi_io_callbacks const *clbk, void *user, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+
+#ifndef STBI_NO_STDIO
+	STBIDEF int      stbi_load_planar_from_file(FILE *f, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+#endif
+
+	//
+	// region of interest: like stbi_load_planar, but the planes only get the w x h
+	// rectangle at (x, y) of the scaled image (of the flipped one, with
+	// stbi_set_flip_vertically_on_load), which has to lie inside it. a JPEG still
+	// entropy-decodes everything, but only runs the IDCT on the blocks the
+	// rectangle needs and only resamples and converts its pixels; a
+	// non-interlaced PNG stops reading after the rectangle's last row.
+	//
+
+	STBIDEF int      stbi_load_planar_region(char              const *filename, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+	STBIDEF int      stbi_load_planar_region_from_memory(stbi_uc           const *buffer, int len, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+	STBIDEF int      stbi_load_planar_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+
+#ifndef STBI_NO_STDIO
+	STBIDEF int      stbi_load_planar_region_from_file(FILE *f, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides);
+#endif
+
+	// splits pixels that are already decoded (img_x by img_y of img_n
+	// interleaved channels, such as a GIF reader's canvas) into planes, as
+	// stbi_load_planar_region would have decoded them into the planes
+	STBIDEF int      stbi_split_planar(stbi_uc const *pixels, int img_x, int img_y, int img_n, int x, int y, int w, int h, int scale, int req_comp, stbi_uc * const *planes, int const *strides);
+
+	//
+	// row-at-a-time output: row() is called for each row of the image in turn,
+	// with its index y (counting from the top, so rows come bottom-up with
+	// stbi_set_flip_vertically_on_load) and its w pixels of n interleaved
+	// channels, n being what stbi_load would report in *comp. it returns 0 to
+	// stop decoding. x, y and comp are set before the first call. returns 1 once
+	// every row has been handed over.
+	//
+	// a non-interlaced PNG is inflated and unfiltered a row at a time as its
+	// IDAT chunks are read, so whatever its height only about 150k plus a few
+	// rows is held; other images are decoded whole first.
+	//
+
+	typedef int stbi_row_callback(void *user, int y, stbi_uc const *row, int w, int n);
+
+	STBIDEF int      stbi_load_rows(char              const *filename, int *x, int *y, int *comp, stbi_row_callback *row, void *user);
+	STBIDEF int      stbi_load_rows_from_memory(stbi_uc           const *buffer, int len, int *x, int *y, int *comp, stbi_row_callback *row, void *user);
+	STBIDEF int      stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *clbk_user, int *x, int *y, int *comp, stbi_row_callback *row, void *user);
+
+#ifndef STBI_NO_STDIO
+	STBIDEF int      stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, stbi_row_callback *row, void *user);
+#endif
+
+	//
+	// progressive previews: loads like stbi_load, but while a progressive JPEG
+	// is decoded, preview() is shown the image as it stands between scans: a
+	// coarse one once every component has its DC coefficients, then a sharper
+	// one after each later scan that refines the first (luma) component. scans
+	// of chroma alone barely show, so they get none, and neither does the last
+	// scan, whose image is what's returned. 'scan' counts the scans read so far.
+	// every preview is the buffer that's finally returned, refined in place: x
+	// by y pixels of n interleaved channels (req_comp, or the image's own
+	// count), always top down, as stbi_set_flip_vertically_on_load only flips
+	// the result. preview() returns 0 to stop decoding, and NULL is returned.
+	// interlaced PNGs get one after each of the first six Adam7 passes, with
+	// every pixel known so far blown up over the ones still to come ('scan' is
+	// the pass, 1 to 6). other images, baseline JPEGs and non-interlaced PNGs
+	// included, load as with stbi_load.
+	//
+
+	typedef int stbi_preview_callback(void *user, int scan, stbi_uc const *image, int x, int y, int n);
+
+	STBIDEF stbi_uc *stbi_load_progressive(char              const *filename, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user);
+	STBIDEF stbi_uc *stbi_load_progressive_from_memory(stbi_uc           const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user);
+	STBIDEF stbi_uc *stbi_load_progressive_from_callbacks(stbi_io_callbacks const *clbk, void *clbk_user, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user);
+
+#ifndef STBI_NO_STDIO
+	STBIDEF stbi_uc *stbi_load_progressive_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user);
+#endif
+
+#ifndef STBI_NO_JPEG
+	//
+	// native JPEG components: the Y, Cb and Cr planes as stored in the file,
+	// without chroma upsampling or color conversion.
+	//
+	// stbi_jpeg_components_info gives the image size, the number of components
+	// (1 or 3) and each one's sampling factors; h_samp and v_samp need room for
+	// 4 entries. component k is ceil(x * h_samp[k] / max(h_samp)) by
+	// ceil(y * v_samp[k] / max(v_samp)) samples.
+	//
+	// stbi_load_jpeg_components writes component k into planes[k], widths[k] by
+	// heights[k] samples with rows strides[k] bytes apart, decoded at 1/scale of
+	// its size (scale is 1, 2, 4 or 8, as for stbi_load_planar). the sizes may
+	// exceed the component's own size: up to the next whole block that returns
+	// the padding the encoder put in the edge blocks (handy for rounding an
+	// odd-sized image up to whole chroma samples), past that the last column and
+	// row are repeated. returns 1 on success.
+	//
+
+	STBIDEF int      stbi_jpeg_components_info(char const *filename, int *x, int *y, int *comp, int *h_samp, int *v_samp);
+	STBIDEF int      stbi_jpeg_components_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *h_samp, int *v_samp);
+	STBIDEF int      stbi_jpeg_components_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int *h_samp, int *v_samp);
+
+	STBIDEF int      stbi_load_jpeg_components(char const *filename, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights);
+	STBIDEF int      stbi_load_jpeg_components_from_memory(stbi_uc const *buffer, int len, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights);
+	STBIDEF int      stbi_load_jpeg_components_from_callbacks(stbi_io_callbacks const *clbk, void *user, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights);
+
+#ifndef STBI_NO_STDIO
+	STBIDEF int      stbi_jpeg_components_info_from_file(FILE *f, int *x, int *y, int *comp, int *h_samp, int *v_samp);
+	STBIDEF int      stbi_load_jpeg_components_from_file(FILE *f, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights);
+#endif
+#endif
+
+#ifndef STBI_NO_GIF
+	//
+	// animated GIFs, a frame at a time: stbi_gif_open reads the header and
+	// gives the size of the canvas, then each stbi_gif_next composites the next
+	// frame onto the canvas as the frames before it left it (after disposing of
+	// the last one), so reading N frames decodes each of them once. it points
+	// *canvas at x by y RGBA pixels, top down whatever
+	// stbi_set_flip_vertically_on_load says, which belong to the reader and
+	// change with the next call; *delay gets the frame's delay in hundredths
+	// of a second, as stored (often 0, which viewers tend to show as 10).
+	// returns 1 for a frame, 0 after the last one (or where a truncated file
+	// stops) and -1 if the data is corrupt.
+	//
+	// stbi_gif_count_frames reads through the rest of the stream without
+	// decoding it and returns the number of frames left, or -1 when out of
+	// memory. if delays isn't NULL it gets their delays, in an array to free
+	// with stbi_image_free. the reader is at the end afterwards.
+	//
+	// whatever the reader reads from has to last until stbi_gif_close; a file
+	// stbi_gif_open opened is closed then.
+	//
+
+	typedef struct stbi_gif_reader stbi_gif_reader;
+
+	STBIDEF stbi_gif_reader *stbi_gif_open(char const *filename, int *x, int *y);
+	STBIDEF stbi_gif_reader *stbi_gif_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y);
+	STBIDEF stbi_gif_reader *stbi_gif_open_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y);
+	STBIDEF int      stbi_gif_next(stbi_gif_reader *g, stbi_uc const **canvas, int *delay);
+	STBIDEF int      stbi_gif_count_frames(stbi_gif_reader *g, int **delays);
+	STBIDEF void     stbi_gif_close(stbi_gif_reader *g);
+
+#ifndef STBI_NO_STDIO
+	STBIDEF stbi_gif_reader *stbi_gif_open_from_file(FILE *f, int *x, int *y);
+#endif
+#endif
+
 #ifndef STBI_NO_LINEAR
 	STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp);
 	STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
@@ -454,11 +672,15 @@ extern "C" {
 #ifndef STBI_NO_HDR
 	STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma);
 	STBIDEF void   stbi_hdr_to_ldr_scale(float scale);
+	STBIDEF void   stbi_hdr_to_ldr_gamma_thread(float gamma);
+	STBIDEF void   stbi_hdr_to_ldr_scale_thread(float scale);
 #endif // STBI_NO_HDR
 
 #ifndef STBI_NO_LINEAR
 	STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma);
 	STBIDEF void   stbi_ldr_to_hdr_scale(float scale);
+	STBIDEF void   stbi_ldr_to_hdr_gamma_thread(float gamma);
+	STBIDEF void   stbi_ldr_to_hdr_scale_thread(float scale);
 #endif // STBI_NO_LINEAR
 
 	// stbi_is_hdr is always defined, but always returns false if STBI_NO_HDR
@@ -470,8 +692,8 @@ extern "C" {
 #endif // STBI_NO_STDIO
 
 
-	// get a VERY brief reason for failure
-	// NOT THREADSAFE
+	// get a VERY brief reason for failure on this thread
+	// (threadsafe only if STBI_THREAD_LOCAL is available)
 	STBIDEF const char *stbi_failure_reason(void);
 
 	// free the loaded image -- this is just free()
@@ -501,6 +723,35 @@ extern "C" {
 	// flip the image vertically, so the first pixel in the output array is the bottom left
 	STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+	// as above, but only for images decoded on the calling thread
+	STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
+	STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
+	STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+
+	// lets a single image be decoded on several threads. the runner must call
+	// task(arg, i) once for every i in [0, count), on whichever threads it
+	// likes, and only return once they've all returned; the decoder splits its
+	// work into at most num_threads tasks. it's used for
+	//  - baseline JPEGs with restart intervals, decoded from memory: the
+	//    segments between restart markers are decoded at once
+	//  - baseline JPEGs without them, decoded from memory, with num_threads of
+	//    3 or more: the scan is split up speculatively where the Huffman codes
+	//    are guessed to fall into step
+	//  - other baseline scans with every component in them: the inverse DCT
+	//    and color conversion run alongside the entropy decode
+	//  - progressive JPEGs: the inverse DCT and color conversion once the last
+	//    scan is in
+	//  - stbi_load_many, which runs whole images as tasks
+	// while stbi_load_many has the runner's threads, the images it decodes
+	// don't split up any further. that takes thread-local storage (see
+	// STBI_THREAD_LOCAL): without it they do, so the runner gets called from
+	// inside its own tasks and has to cope with that.
+	// set it before decoding anything; NULL (the default) decodes everything
+	// on the calling thread.
+	typedef void stbi_parallel_task(void *arg, int index);
+	typedef void stbi_parallel_runner(void *user, stbi_parallel_task *task, void *arg, int count);
+	STBIDEF void stbi_set_parallel_runner(stbi_parallel_runner *runner, void *user, int num_threads);
+
 	// ZLIB client - used by PNG, available for other purposes
 
 	STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -511,6 +762,14 @@ extern "C" {
 	STBIDEF char *stbi_zlib_decode_noheader_malloc(const char *buffer, int len, int *outlen);
 	STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen);
 
+	// decodes only the start of a raw deflate stream: stops without error once
+	// obuffer is full, and returns exactly olen bytes whenever the stream has
+	// that many, cutting short the match or stored block that fills it.
+	// ibuffer may also be just the start of the stream. returns the number of
+	// bytes decoded, which is less than olen only if the stream ends first, or
+	// -1 if the data is corrupt or the input ran out first (so pass more of it).
+	STBIDEF int   stbi_zlib_decode_noheader_prefix(char *obuffer, int olen, const char *ibuffer, int ilen);
+
 
 #ifdef __cplusplus
 }
@@ -579,6 +838,65 @@ extern "C" {
 #define STBI_ASSERT(x) assert(x)
 #endif
 
+#if !defined(STBI_THREAD_LOCAL) && !defined(STBI_NO_THREAD_LOCALS)
+#if defined(__cplusplus) && __cplusplus >= 201103L
+#define STBI_THREAD_LOCAL       thread_local
+#elif defined(_MSC_VER)
+#define STBI_THREAD_LOCAL       __declspec(thread)
+#elif defined(__GNUC__)
+#define STBI_THREAD_LOCAL       __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define STBI_THREAD_LOCAL       _Thread_local
+#endif
+#endif
+
+// a setting with a process-wide value and an optional per-thread override
+#ifdef STBI_THREAD_LOCAL
+#define stbi__setting(name)     (name##_set ? name##_local : name##_global)
+#define stbi__set_thread(name, value)  (name##_local = (value), name##_set = 1)
+#else
+#define stbi__setting(name)     name##_global
+#define stbi__set_thread(name, value)  (name##_global = (value))
+#endif
+
+// atomic add (returning the old value) and compare-and-swap on a long, and
+// ways to give up the rest of a time slice or to sleep for a millisecond, for
+// stbi_load_many's threads to share out the images and wait their turn.
+// without them, it decodes the images one after another
+#ifdef _MSC_VER
+#include <intrin.h>
+#define STBI__ATOMICS
+#define stbi__atomic_add(p, v)         _InterlockedExchangeAdd((p), (v))
+#define stbi__atomic_cas(p, from, to)  (_InterlockedCompareExchange((p), (to), (from)) == (from))
+#elif defined(__GNUC__) && (defined(_WIN32) || defined(__unix__) || defined(__APPLE__))
+#define STBI__ATOMICS
+#define stbi__atomic_add(p, v)         __sync_fetch_and_add((p), (v))
+#define stbi__atomic_cas(p, from, to)  __sync_bool_compare_and_swap((p), (from), (to))
+#else
+#define stbi__atomic_add(p, v)         ((*(p) += (v)) - (v))
+#define stbi__atomic_cas(p, from, to)  (*(p) == (from) ? (*(p) = (to), 1) : 0)
+#endif
+
+#ifdef STBI__ATOMICS
+#ifdef _WIN32
+#ifdef __cplusplus
+extern "C"
+#endif
+__declspec(dllimport) int __stdcall SwitchToThread(void);
+#ifdef __cplusplus
+extern "C"
+#endif
+__declspec(dllimport) void __stdcall Sleep(unsigned long milliseconds);
+#define stbi__yield()  SwitchToThread()
+#define stbi__nap()    Sleep(1)
+#else
+#include <poll.h>
+#include <sched.h>
+#define stbi__yield()  sched_yield()
+#define stbi__nap()    poll(NULL, 0, 1)
+#endif
+#endif
+
 
 #ifndef _MSC_VER
 #ifdef __cplusplus
@@ -613,16 +931,6 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32) == 4 ? 1 : -1];
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 #endif
 
-#ifdef _MSC_VER
-#define STBI_HAS_LROTL
-#endif
-
-#ifdef STBI_HAS_LROTL
-#define stbi_lrot(x,y)  _lrotl(x,y)
-#else
-#define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
-#endif
-
 #if defined(STBI_MALLOC) && defined(STBI_FREE) && (defined(STBI_REALLOC) || defined(STBI_REALLOC_SIZED))
 // ok
 #elif !defined(STBI_MALLOC) && !defined(STBI_FREE) && !defined(STBI_REALLOC) && !defined(STBI_REALLOC_SIZED)
@@ -672,7 +980,7 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32) == 4 ? 1 : -1];
 #define STBI_NO_SIMD
 #endif
 
-#if !defined(STBI_NO_SIMD) && defined(STBI__X86_TARGET)
+#if !defined(STBI_NO_SIMD) && (defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET))
 #define STBI_SSE2
 #include <emmintrin.h>
 
@@ -723,6 +1031,42 @@ static int stbi__sse2_available()
 #endif
 #endif
 
+// AVX2 versions of the JPEG kernels are compiled alongside the SSE2 ones and
+// picked at run time, so the build itself doesn't need /arch:AVX2 or -mavx2.
+// gcc and clang only allow the intrinsics in functions marked for AVX2. VC++
+// allows them anywhere, but without /arch:AVX it encodes 128-bit intrinsics
+// as legacy SSE, which stalls while the upper halves of the registers are in
+// use; so the kernels stick to 256-bit operations and clear the upper halves
+// before any 128-bit stores.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2)
+#if defined(_MSC_VER) && _MSC_VER >= 1700
+#define STBI_AVX2
+#define STBI__AVX2_TARGET
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409)
+#define STBI_AVX2
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef STBI_AVX2
+#include <immintrin.h>
+
+static int stbi__avx2_available(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	// the OS has to save the upper halves too: OSXSAVE and AVX, then XCR0
+	if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
 // ARM NEON
 #if defined(STBI_NO_SIMD) && defined(STBI_NEON)
 #undef STBI_NEON
@@ -826,9 +1170,33 @@ static void stbi__rewind(stbi__context *s)
 	s->img_buffer_end = s->img_buffer_original_end;
 }
 
+// destination of the stbi_load_planar family; one plane per output channel
+typedef struct
+{
+	stbi_uc *plane[4];
+	int stride[4];
+	int x, y, w, h;  // the part of the image the planes hold
+	int region;      // if not, they hold the whole image, which has to be w x h
+} stbi__planar;
+
+// destination of the stbi_load_rows family, which the planar loader also
+// goes through at full size
+typedef struct
+{
+	stbi_row_callback *row;
+	void *user;
+	int *x, *y, *comp;
+	int flip;
+	int limit;  // rows from the top that are wanted; decoding may stop after them
+} stbi__rows;
+
+static stbi_uc stbi__compute_y(int r, int g, int b);
+
 #ifndef STBI_NO_JPEG
 static int      stbi__jpeg_test(stbi__context *s);
 static stbi_uc *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
+static int      stbi__jpeg_load_planar(stbi__context *s, int scale_shift, int *comp, int req_comp, stbi__planar *p);
+static stbi_uc *stbi__jpeg_load_progressive(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user);
 static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
@@ -836,6 +1204,8 @@ static int      stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp);
 static int      stbi__png_test(stbi__context *s);
 static stbi_uc *stbi__png_load(stbi__context *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi__png_info(stbi__context *s, int *x, int *y, int *comp);
+static int      stbi__png_load_rows(stbi__context *s, stbi__rows *r);
+static stbi_uc *stbi__png_load_progressive(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user);
 #endif
 
 #ifndef STBI_NO_BMP
@@ -880,8 +1250,12 @@ static stbi_uc *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL
+#else
+static
+#endif
+const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -927,11 +1301,114 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
+static int stbi__vertically_flip_on_load_global = 0;
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__vertically_flip_on_load_local, stbi__vertically_flip_on_load_set;
+#endif
+#define stbi__vertically_flip_on_load  stbi__setting(stbi__vertically_flip_on_load)
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
-	stbi__vertically_flip_on_load = flag_true_if_should_flip;
+	stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
+}
+
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
+{
+	stbi__set_thread(stbi__vertically_flip_on_load, flag_true_if_should_flip);
+}
+
+// the other settings a load reads; they're set with the formats they're for
+#ifndef STBI_NO_PNG
+static int stbi__unpremultiply_on_load_global = 0;
+static int stbi__de_iphone_flag_global = 0;
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
+static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
+#endif
+#define stbi__unpremultiply_on_load  stbi__setting(stbi__unpremultiply_on_load)
+#define stbi__de_iphone_flag         stbi__setting(stbi__de_iphone_flag)
+#endif
+
+static float stbi__h2l_gamma_i_global = 1.0f / 2.2f, stbi__h2l_scale_i_global = 1.0f;
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL float stbi__h2l_gamma_i_local, stbi__h2l_scale_i_local;
+static STBI_THREAD_LOCAL int stbi__h2l_gamma_i_set, stbi__h2l_scale_i_set;
+#endif
+#define stbi__h2l_gamma_i  stbi__setting(stbi__h2l_gamma_i)
+#define stbi__h2l_scale_i  stbi__setting(stbi__h2l_scale_i)
+
+#ifdef STBI_THREAD_LOCAL
+// a thread's own values of the settings a load reads, and which of them it has
+typedef struct
+{
+	int flip, flip_set;
+#ifndef STBI_NO_PNG
+	int unpremultiply, unpremultiply_set;
+	int de_iphone, de_iphone_set;
+#endif
+	float h2l_gamma_i, h2l_scale_i;
+	int h2l_gamma_i_set, h2l_scale_i_set;
+} stbi__load_settings;
+
+// the settings as this thread sees them, process-wide ones included
+static void stbi__get_load_settings(stbi__load_settings *settings)
+{
+	settings->flip = stbi__vertically_flip_on_load;
+	settings->flip_set = 1;
+#ifndef STBI_NO_PNG
+	settings->unpremultiply = stbi__unpremultiply_on_load;
+	settings->unpremultiply_set = 1;
+	settings->de_iphone = stbi__de_iphone_flag;
+	settings->de_iphone_set = 1;
+#endif
+	settings->h2l_gamma_i = stbi__h2l_gamma_i;
+	settings->h2l_gamma_i_set = 1;
+	settings->h2l_scale_i = stbi__h2l_scale_i;
+	settings->h2l_scale_i_set = 1;
+}
+
+// makes settings this thread's own, keeping the ones it had in old
+static void stbi__set_load_settings(stbi__load_settings const *settings, stbi__load_settings *old)
+{
+#define stbi__swap_setting(field, name) \
+	(old->field = name##_local, old->field##_set = name##_set, \
+	 name##_local = settings->field, name##_set = settings->field##_set)
+	stbi__swap_setting(flip, stbi__vertically_flip_on_load);
+#ifndef STBI_NO_PNG
+	stbi__swap_setting(unpremultiply, stbi__unpremultiply_on_load);
+	stbi__swap_setting(de_iphone, stbi__de_iphone_flag);
+#endif
+	stbi__swap_setting(h2l_gamma_i, stbi__h2l_gamma_i);
+	stbi__swap_setting(h2l_scale_i, stbi__h2l_scale_i);
+#undef stbi__swap_setting
+}
+#endif
+
+static stbi_parallel_runner *stbi__parallel_runner = NULL;
+static void *stbi__parallel_user = NULL;
+static int stbi__parallel_threads = 1;
+
+STBIDEF void stbi_set_parallel_runner(stbi_parallel_runner *runner, void *user, int num_threads)
+{
+	stbi__parallel_runner = runner;
+	stbi__parallel_user = user;
+	stbi__parallel_threads = num_threads < 1 ? 1 : num_threads;
+}
+
+// set on the threads of a stbi_load_many that's running on the runner, whose
+// images are already spread across its threads
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL int stbi__parallel_busy;
+#endif
+
+// how many threads the image being decoded can be split across, 1 if it can't
+static int stbi__parallel_width(void)
+{
+	if (!stbi__parallel_runner) return 1;
+#ifdef STBI_THREAD_LOCAL
+	if (stbi__parallel_busy) return 1;
+#endif
+	return stbi__parallel_threads;
 }
 
 static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
@@ -974,10 +1451,8 @@ static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *com
 	return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
-static unsigned char *stbi__load_flip(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+static void stbi__flip_loaded(stbi_uc *result, int *x, int *y, int *comp, int req_comp)
 {
-	unsigned char *result = stbi__load_main(s, x, y, comp, req_comp);
-
 	if (stbi__vertically_flip_on_load && result != NULL) {
 		int w = *x, h = *y;
 		int depth = req_comp ? req_comp : *comp;
@@ -995,310 +1470,984 @@ static unsigned char *stbi__load_flip(stbi__context *s, int *x, int *y, int *com
 			}
 		}
 	}
+}
 
+static unsigned char *stbi__load_flip(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+	unsigned char *result = stbi__load_main(s, x, y, comp, req_comp);
+	stbi__flip_loaded(result, x, y, comp, req_comp);
 	return result;
 }
 
-#ifndef STBI_NO_HDR
-static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+static unsigned char *stbi__load_progressive_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
 {
-	if (stbi__vertically_flip_on_load && result != NULL) {
-		int w = *x, h = *y;
-		int depth = req_comp ? req_comp : *comp;
-		int row, col, z;
-		float temp;
-
-		// @OPTIMIZE: use a bigger temp buffer and memcpy multiple pixels at once
-		for (row = 0; row < (h >> 1); row++) {
-			for (col = 0; col < w; col++) {
-				for (z = 0; z < depth; z++) {
-					temp = result[(row * w + col) * depth + z];
-					result[(row * w + col) * depth + z] = result[((h - row - 1) * w + col) * depth + z];
-					result[((h - row - 1) * w + col) * depth + z] = temp;
-				}
-			}
-		}
+#ifndef STBI_NO_JPEG
+	if (stbi__jpeg_test(s)) {
+		unsigned char *result = stbi__jpeg_load_progressive(s, x, y, comp, req_comp, preview, user);
+		stbi__flip_loaded(result, x, y, comp, req_comp);
+		return result;
 	}
-}
 #endif
-
-#ifndef STBI_NO_STDIO
-
-static FILE *stbi__fopen(char const *filename, char const *mode)
-{
-	FILE *f;
-#if defined(_MSC_VER) && _MSC_VER >= 1400
-	if (0 != fopen_s(&f, filename, mode))
-		f = 0;
-#else
-	f = fopen(filename, mode);
+#ifndef STBI_NO_PNG
+	if (stbi__png_test(s)) {
+		unsigned char *result = stbi__png_load_progressive(s, x, y, comp, req_comp, preview, user);
+		stbi__flip_loaded(result, x, y, comp, req_comp);
+		return result;
+	}
 #endif
-	return f;
+	return stbi__load_flip(s, x, y, comp, req_comp);
 }
 
+// checks the planes against the image size once it's known. a region's y is
+// counted from the top of the flipped image, so it's turned around here
+static int stbi__planar_fits(stbi__planar *p, int img_w, int img_h)
+{
+	if (!p->region)
+		return img_w == p->w && img_h == p->h;
+	if (p->w > img_w || p->x > img_w - p->w || p->h > img_h || p->y > img_h - p->h)
+		return 0;
+	if (stbi__vertically_flip_on_load)
+		p->y = img_h - p->y - p->h;
+	return 1;
+}
 
-STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
+static int stbi__planar_misfit(stbi__planar *p)
 {
-	FILE *f = stbi__fopen(filename, "rb");
-	unsigned char *result;
-	if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
-	result = stbi_load_from_file(f, x, y, comp, req_comp);
-	fclose(f);
-	return result;
+	if (p->region)
+		return stbi__err("bad region", "Region isn't inside the image");
+	return stbi__err("wrong size", "Image isn't the size of the planes");
 }
 
-STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+// hands row j (counting from the top) of a w x h image of n channels over
+static int stbi__rows_emit(stbi__rows *r, int j, stbi_uc const *pixels, int w, int h, int n)
 {
-	unsigned char *result;
-	stbi__context s;
-	stbi__start_file(&s, f);
-	result = stbi__load_flip(&s, x, y, comp, req_comp);
-	if (result) {
-		// need to 'unget' all the characters in the IO buffer
-		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	if (j == 0) {
+		*r->x = w;
+		*r->y = h;
+		if (r->comp) *r->comp = n;
 	}
-	return result;
+	if (!r->row(r->user, r->flip ? h - 1 - j : j, pixels, w, n))
+		return stbi__err("stopped", "Row callback stopped decoding");
+	return 1;
 }
-#endif //!STBI_NO_STDIO
 
-STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+// splits one row of 'count' interleaved img_n-channel pixels into req_comp planes,
+// converting channels the same way stbi__convert_format does
+static void stbi__planar_split_row(stbi_uc const *src, int img_n, int req_comp, stbi_uc **dest, int count)
 {
-	stbi__context s;
-	stbi__start_mem(&s, buffer, len);
-	return stbi__load_flip(&s, x, y, comp, req_comp);
+	int i;
+	stbi_uc *d0 = dest[0], *d1 = dest[1], *d2 = dest[2], *d3 = dest[3];
+
+#define COMBO(a,b)  ((a)*8+(b))
+// each case body goes in braces, since the loop is hidden in the macro
+#define CASE(a,b,body)   case COMBO(a,b): for(i=0; i < count; ++i, src += a) { body; } break
+	switch (COMBO(img_n, req_comp)) {
+		CASE(1, 1, d0[i] = src[0]);
+		CASE(1, 2, d0[i] = src[0]; d1[i] = 255);
+		CASE(1, 3, d0[i] = d1[i] = d2[i] = src[0]);
+		CASE(1, 4, d0[i] = d1[i] = d2[i] = src[0]; d3[i] = 255);
+		CASE(2, 1, d0[i] = src[0]);
+		CASE(2, 2, d0[i] = src[0]; d1[i] = src[1]);
+		CASE(2, 3, d0[i] = d1[i] = d2[i] = src[0]);
+		CASE(2, 4, d0[i] = d1[i] = d2[i] = src[0]; d3[i] = src[1]);
+		CASE(3, 1, d0[i] = stbi__compute_y(src[0], src[1], src[2]));
+		CASE(3, 2, d0[i] = stbi__compute_y(src[0], src[1], src[2]); d1[i] = 255);
+		CASE(3, 3, d0[i] = src[0]; d1[i] = src[1]; d2[i] = src[2]);
+		CASE(3, 4, d0[i] = src[0]; d1[i] = src[1]; d2[i] = src[2]; d3[i] = 255);
+		CASE(4, 1, d0[i] = stbi__compute_y(src[0], src[1], src[2]));
+		CASE(4, 2, d0[i] = stbi__compute_y(src[0], src[1], src[2]); d1[i] = src[3]);
+		CASE(4, 3, d0[i] = src[0]; d1[i] = src[1]; d2[i] = src[2]);
+		CASE(4, 4, d0[i] = src[0]; d1[i] = src[1]; d2[i] = src[2]; d3[i] = src[3]);
+	default: STBI_ASSERT(0);
+	}
+#undef CASE
+#undef COMBO
+}
+
+// shrinks an interleaved x by y image of n channels by 'scale' in place, averaging
+// each scale x scale box (clipped at the right and bottom edges); writing the
+// output from the top left never overtakes the boxes still to be read
+static void stbi__box_reduce(stbi_uc *data, int x, int y, int n, int scale)
+{
+	int w = (x + scale - 1) / scale, h = (y + scale - 1) / scale;
+	int i, j, k, bx, by;
+	stbi_uc *out = data;
+	for (j = 0; j < h; ++j) {
+		int y0 = j * scale, y1 = y0 + scale < y ? y0 + scale : y;
+		for (i = 0; i < w; ++i) {
+			int x0 = i * scale, x1 = x0 + scale < x ? x0 + scale : x;
+			int count = (x1 - x0) * (y1 - y0);
+			for (k = 0; k < n; ++k) {
+				int sum = count >> 1;
+				for (by = y0; by < y1; ++by)
+					for (bx = x0; bx < x1; ++bx)
+						sum += data[(by * x + bx) * n + k];
+				*out++ = (stbi_uc)(sum / count);
+			}
+		}
+	}
 }
 
-STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+// log2 of a stbi_load_planar scale factor, or -1 if it isn't 1, 2, 4 or 8
+static int stbi__scale_shift(int scale)
 {
-	stbi__context s;
-	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
-	return stbi__load_flip(&s, x, y, comp, req_comp);
+	switch (scale) {
+	case 1: return 0;
+	case 2: return 1;
+	case 4: return 2;
+	case 8: return 3;
+	default: return -1;
+	}
 }
 
-#ifndef STBI_NO_LINEAR
-static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+static int stbi__load_rows_main(stbi__context *s, stbi__rows *r)
 {
-	unsigned char *data;
-#ifndef STBI_NO_HDR
-	if (stbi__hdr_test(s)) {
-		float *hdr_data = stbi__hdr_load(s, x, y, comp, req_comp);
-		if (hdr_data)
-			stbi__float_postprocess(hdr_data, x, y, comp, req_comp);
-		return hdr_data;
-	}
+	stbi_uc *data;
+	int x, y, n, j;
+
+#ifndef STBI_NO_PNG
+	if (stbi__png_test(s)) return stbi__png_load_rows(s, r);
 #endif
-	data = stbi__load_flip(s, x, y, comp, req_comp);
-	if (data)
-		return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-	return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+
+	data = stbi__load_main(s, &x, &y, &n, 0);
+	if (!data) return 0;
+	for (j = 0; j < y && j < r->limit; ++j)
+		if (!stbi__rows_emit(r, j, data + (size_t)j * x * n, x, y, n)) break;
+	STBI_FREE(data);
+	return j == y || j == r->limit;
 }
 
-STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+static int stbi__load_rows_setup(stbi__context *s, int *x, int *y, int *comp, stbi_row_callback *row, void *user)
 {
-	stbi__context s;
-	stbi__start_mem(&s, buffer, len);
-	return stbi__loadf_main(&s, x, y, comp, req_comp);
+	stbi__rows r;
+	r.row = row;
+	r.user = user;
+	r.x = x;
+	r.y = y;
+	r.comp = comp;
+	r.flip = stbi__vertically_flip_on_load;
+	r.limit = 0x7fffffff;
+	return stbi__load_rows_main(s, &r);
 }
 
-STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+typedef struct
 {
-	stbi__context s;
-	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
-	return stbi__loadf_main(&s, x, y, comp, req_comp);
+	stbi__planar *p;
+	stbi__rows *rows;
+	int req_comp;
+	int x, y, n;      // the image's, set before the first row
+	int misfit;
+} stbi__planar_rows;
+
+static int stbi__planar_row(void *user, int y, stbi_uc const *src, int w, int n)
+{
+	stbi__planar_rows *r = (stbi__planar_rows *)user;
+	stbi__planar *p = r->p;
+	stbi_uc *dest[4];
+	int k;
+	if (y == 0) {
+		if (!stbi__planar_fits(p, r->x, r->y)) {
+			r->misfit = 1;
+			return 0;
+		}
+		r->rows->limit = p->y + p->h;
+	}
+	if (y < p->y)
+		return 1;
+	for (k = 0; k < 4; ++k)
+		dest[k] = k < r->req_comp ? p->plane[k] + (y - p->y) * p->stride[k] : NULL;
+	src += p->x * n;
+#ifdef STBI_PLANAR_SPLIT_ROW
+	if (!STBI_PLANAR_SPLIT_ROW(src, n, r->req_comp, dest, p->w))
+#endif
+		stbi__planar_split_row(src, n, r->req_comp, dest, p->w);
+	STBI_NOTUSED(w);
+	return 1;
 }
 
-#ifndef STBI_NO_STDIO
-STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+// checks the arguments, gets the scale's log2 and flips the planes if need be
+static int stbi__planar_begin(int scale, int req_comp, stbi__planar *p, int *shift)
 {
-	float *result;
-	FILE *f = stbi__fopen(filename, "rb");
-	if (!f) return stbi__errpf("can't fopen", "Unable to open file");
-	result = stbi_loadf_from_file(f, x, y, comp, req_comp);
-	fclose(f);
-	return result;
+	int k;
+	*shift = stbi__scale_shift(scale);
+
+	if (req_comp < 1 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+	if (*shift < 0) return stbi__err("bad scale", "Scale must be 1, 2, 4 or 8");
+	if (p->x < 0 || p->y < 0 || p->w < 1 || p->h < 1) return stbi__err("bad region", "Empty or negative region");
+
+	// flipping is just walking the planes bottom-up
+	if (stbi__vertically_flip_on_load) {
+		for (k = 0; k < req_comp; ++k) {
+			p->plane[k] += (p->h - 1) * p->stride[k];
+			p->stride[k] = -p->stride[k];
+		}
+	}
+	return 1;
 }
 
-STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+// splits the planes' rectangle out of an already scaled, interleaved image
+// x pixels wide
+static void stbi__planar_split(stbi__planar *p, stbi_uc const *data, int x, int n, int req_comp)
 {
-	stbi__context s;
-	stbi__start_file(&s, f);
-	return stbi__loadf_main(&s, x, y, comp, req_comp);
+	int j, k;
+	for (j = 0; j < p->h; ++j) {
+		stbi_uc const *src = data + ((size_t)(p->y + j) * x + p->x) * n;
+		stbi_uc *dest[4];
+		for (k = 0; k < 4; ++k)
+			dest[k] = k < req_comp ? p->plane[k] + j * p->stride[k] : NULL;
+#ifdef STBI_PLANAR_SPLIT_ROW
+		if (!STBI_PLANAR_SPLIT_ROW(src, n, req_comp, dest, p->w))
+#endif
+			stbi__planar_split_row(src, n, req_comp, dest, p->w);
+	}
 }
-#endif // !STBI_NO_STDIO
 
-#endif // !STBI_NO_LINEAR
+static int stbi__load_planar_main(stbi__context *s, int scale, int *comp, int req_comp, stbi__planar *p)
+{
+	stbi_uc *data;
+	int x, y, n, shift;
 
-// these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
-// defined, for API simplicity; if STBI_NO_LINEAR is defined, it always
-// reports false!
+	if (!stbi__planar_begin(scale, req_comp, p, &shift)) return 0;
 
-STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
+#ifndef STBI_NO_JPEG
+	if (stbi__jpeg_test(s)) return stbi__jpeg_load_planar(s, shift, comp, req_comp, p);
+#endif
+
+	// everything else comes out interleaved at its own channel count, and is
+	// converted to req_comp while being split up. at full size that's done a
+	// row at a time as the rows are decoded, which for PNG means the whole
+	// image is never held
+	if (!shift) {
+		stbi__planar_rows pr;
+		stbi__rows r;
+		pr.p = p;
+		pr.rows = &r;
+		pr.req_comp = req_comp;
+		pr.misfit = 0;
+		r.row = stbi__planar_row;
+		r.user = &pr;
+		r.x = &pr.x;
+		r.y = &pr.y;
+		r.comp = &pr.n;
+		r.flip = 0; // the planes were flipped already
+		r.limit = 0x7fffffff;
+		if (!stbi__load_rows_main(s, &r))
+			return pr.misfit ? stbi__planar_misfit(p) : 0;
+		if (comp) *comp = pr.n;
+		return 1;
+	}
+
+	data = stbi__load_main(s, &x, &y, &n, 0);
+	if (!data) return 0;
+	if (!stbi__planar_fits(p, (x + scale - 1) >> shift, (y + scale - 1) >> shift)) {
+		STBI_FREE(data);
+		return stbi__planar_misfit(p);
+	}
+	if (shift)
+		stbi__box_reduce(data, x, y, n, scale);
+	stbi__planar_split(p, data, (x + scale - 1) >> shift, n, req_comp);
+
+	STBI_FREE(data);
+	if (comp) *comp = n;
+	return 1;
+}
+
+static int stbi__load_planar_setup(stbi__context *s, int region, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
 {
+	stbi__planar p;
+	int k;
+	for (k = 0; k < 4; ++k) {
+		p.plane[k] = k < req_comp ? planes[k] : NULL;
+		p.stride[k] = k < req_comp ? strides[k] : 0;
+	}
+	p.x = x;
+	p.y = y;
+	p.w = w;
+	p.h = h;
+	p.region = region;
+	return stbi__load_planar_main(s, scale, comp, req_comp, &p);
+}
+
+STBIDEF int stbi_split_planar(stbi_uc const *pixels, int img_x, int img_y, int img_n, int x, int y, int w, int h, int scale, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	stbi__planar p;
+	stbi_uc *data = NULL;
+	int k, shift;
+	for (k = 0; k < 4; ++k) {
+		p.plane[k] = k < req_comp ? planes[k] : NULL;
+		p.stride[k] = k < req_comp ? strides[k] : 0;
+	}
+	p.x = x;
+	p.y = y;
+	p.w = w;
+	p.h = h;
+	p.region = 1;
+	if (!stbi__planar_begin(scale, req_comp, &p, &shift)) return 0;
+	if (img_n < 1 || img_n > 4) return stbi__err("bad img_n", "Internal error");
+	if (!stbi__planar_fits(&p, (img_x + scale - 1) >> shift, (img_y + scale - 1) >> shift))
+		return stbi__planar_misfit(&p);
+
+	// the pixels aren't ours to shrink in place
+	if (shift) {
+		data = (stbi_uc *)stbi__malloc((size_t)img_x * img_y * img_n);
+		if (!data) return stbi__err("outofmem", "Out of memory");
+		memcpy(data, pixels, (size_t)img_x * img_y * img_n);
+		stbi__box_reduce(data, img_x, img_y, img_n, scale);
+		pixels = data;
+	}
+	stbi__planar_split(&p, pixels, (img_x + scale - 1) >> shift, img_n, req_comp);
+	STBI_FREE(data);
+	return 1;
+}
+
 #ifndef STBI_NO_HDR
-	stbi__context s;
-	stbi__start_mem(&s, buffer, len);
-	return stbi__hdr_test(&s);
+static void stbi__float_postprocess(float *result, int *x, int *y, int *comp, int req_comp)
+{
+	if (stbi__vertically_flip_on_load && result != NULL) {
+		int w = *x, h = *y;
+		int depth = req_comp ? req_comp : *comp;
+		int row, col, z;
+		float temp;
+
+		// @OPTIMIZE: use a bigger temp buffer and memcpy multiple pixels at once
+		for (row = 0; row < (h >> 1); row++) {
+			for (col = 0; col < w; col++) {
+				for (z = 0; z < depth; z++) {
+					temp = result[(row * w + col) * depth + z];
+					result[(row * w + col) * depth + z] = result[((h - row - 1) * w + col) * depth + z];
+					result[((h - row - 1) * w + col) * depth + z] = temp;
+				}
+			}
+		}
+	}
+}
+#endif
+
+#ifndef STBI_NO_STDIO
+
+static FILE *stbi__fopen(char const *filename, char const *mode)
+{
+	FILE *f;
+#if defined(_MSC_VER) && _MSC_VER >= 1400
+	if (0 != fopen_s(&f, filename, mode))
+		f = 0;
 #else
-	STBI_NOTUSED(buffer);
-	STBI_NOTUSED(len);
-	return 0;
+	f = fopen(filename, mode);
 #endif
+	return f;
 }
 
-#ifndef STBI_NO_STDIO
-STBIDEF int      stbi_is_hdr(char const *filename)
+
+STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
 	FILE *f = stbi__fopen(filename, "rb");
-	int result = 0;
-	if (f) {
-		result = stbi_is_hdr_from_file(f);
-		fclose(f);
-	}
+	unsigned char *result;
+	if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+	result = stbi_load_from_file(f, x, y, comp, req_comp);
+	fclose(f);
 	return result;
 }
 
-STBIDEF int      stbi_is_hdr_from_file(FILE *f)
+STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
-#ifndef STBI_NO_HDR
+	unsigned char *result;
 	stbi__context s;
 	stbi__start_file(&s, f);
-	return stbi__hdr_test(&s);
-#else
-	STBI_NOTUSED(f);
-	return 0;
-#endif
+	result = stbi__load_flip(&s, x, y, comp, req_comp);
+	if (result) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	}
+	return result;
 }
-#endif // !STBI_NO_STDIO
+#endif //!STBI_NO_STDIO
 
-STBIDEF int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void *user)
+STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__load_flip(&s, x, y, comp, req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
-#ifndef STBI_NO_HDR
 	stbi__context s;
 	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
-	return stbi__hdr_test(&s);
-#else
-	STBI_NOTUSED(clbk);
-	STBI_NOTUSED(user);
-	return 0;
-#endif
+	return stbi__load_flip(&s, x, y, comp, req_comp);
 }
 
-#ifndef STBI_NO_LINEAR
-static float stbi__l2h_gamma = 2.2f, stbi__l2h_scale = 1.0f;
+typedef struct
+{
+	stbi_uc *data;
+	int x, y, comp;
+	// a copy of the failure reason (if any), which can be in storage of the
+	// decoding thread that's gone or reused by the time the image is handed over
+	char failure[64];
+} stbi__load_result;
 
-STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma = gamma; }
-STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale = scale; }
+// the failure reasons of images handed over on this thread
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL
+#else
+static
 #endif
+char stbi__load_many_failure[64];
 
-static float stbi__h2l_gamma_i = 1.0f / 2.2f, stbi__h2l_scale_i = 1.0f;
-
-STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i = 1 / gamma; }
-STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i = 1 / scale; }
-
-
-//////////////////////////////////////////////////////////////////////////////
-//
-// Common code used by all image loaders
-//
-
-enum
+typedef struct
 {
-	STBI__SCAN_load = 0,
-	STBI__SCAN_type,
-	STBI__SCAN_header
-};
+	stbi__load_result r;
+	volatile long ready;        // r is decoded and waiting to be handed over
+} stbi__load_slot;
 
-static void stbi__refill_buffer(stbi__context *s)
+// stbi_load_many's shared state. each task claims images one at a time until
+// they run out, so a thread starts on another as soon as it's done with one
+typedef struct
 {
-	int n = (s->io.read)(s->io_user_data, (char*)s->buffer_start, s->buflen);
-	if (n == 0) {
-		// at end of file, treat same as if from memory, but need to handle case
-		// where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
-		s->read_from_callbacks = 0;
-		s->img_buffer = s->buffer_start;
-		s->img_buffer_end = s->buffer_start + 1;
-		*s->img_buffer = 0;
-	}
-	else {
-		s->img_buffer = s->buffer_start;
-		s->img_buffer_end = s->buffer_start + n;
-	}
-}
+	stbi_load_source const *sources;
+	int count;
+	int req_comp;
+	int window;                 // max_in_flight
+	stbi_load_done *done;
+	void *user;
+	stbi__load_slot *slots;     // in order, one per image in the window; NULL otherwise
+	int parallel;               // running on the parallel runner
+#ifdef STBI_THREAD_LOCAL
+	stbi__load_settings settings; // those of the thread that called stbi_load_many
+#endif
+	volatile long next;         // the next image to claim
+	volatile long delivered;    // in order, the images handed over so far
+	volatile long delivering;   // in order, 1 while a thread is handing them over
+} stbi__load_many;
 
-stbi_inline static stbi_uc stbi__get8(stbi__context *s)
+// hands over the images that are next in order and ready, on whichever thread
+// gets here first; the others leave them to it. the check is repeated once it
+// lets go, for an image that became ready while it was at it
+static void stbi__load_many_deliver(stbi__load_many *b)
 {
-	if (s->img_buffer < s->img_buffer_end)
-		return *s->img_buffer++;
-	if (s->read_from_callbacks) {
-		stbi__refill_buffer(s);
-		return *s->img_buffer++;
+	for (;;) {
+		long head = stbi__atomic_add(&b->delivered, 0);
+		stbi__load_slot *slot = &b->slots[head % b->window];
+		if (head >= b->count || !stbi__atomic_add(&slot->ready, 0)) return;
+		if (!stbi__atomic_cas(&b->delivering, 0, 1)) return;
+		for (; head < b->count && stbi__atomic_add(&slot->ready, 0); slot = &b->slots[head % b->window]) {
+			stbi__load_result *r = &slot->r;
+			if (!r->data) {
+				memcpy(stbi__load_many_failure, r->failure, sizeof(r->failure));
+				stbi__g_failure_reason = r->failure[0] ? stbi__load_many_failure : NULL;
+			}
+			b->done(b->user, (int)head, r->data, r->x, r->y, r->comp);
+			// the slot is free once the window moves past it
+			stbi__atomic_add(&slot->ready, -1);
+			head = stbi__atomic_add(&b->delivered, 1) + 1;
+		}
+		stbi__atomic_add(&b->delivering, -1);
 	}
-	return 0;
 }
 
-stbi_inline static int stbi__at_eof(stbi__context *s)
+// how many times a thread that's a window ahead yields before it sleeps
+#define STBI__LOAD_MANY_YIELDS  16
+
+static void stbi__load_many_task(void *arg, int task)
 {
-	if (s->io.read) {
-		if (!(s->io.eof)(s->io_user_data)) return 0;
-		// if feof() is true, check if buffer = end
-		// special case: we've only got the special 0 character at the end
-		if (s->read_from_callbacks == 0) return 1;
-	}
+	stbi__load_many *b = (stbi__load_many *)arg;
+	STBI_NOTUSED(task);
 
-	return s->img_buffer >= s->img_buffer_end;
-}
+	for (;;) {
+		long i = stbi__atomic_add(&b->next, 1);
+		stbi_load_source const *source;
+		stbi__load_result r;
+#ifdef STBI_THREAD_LOCAL
+		stbi__load_settings own, theirs;
+		int busy;
+#endif
+		if (i >= b->count) return;
+		source = &b->sources[i];
+
+#ifdef STBI__ATOMICS
+		// in order, wait for the image a window back to be handed over. the
+		// first image not handed over never waits, so this can't deadlock.
+		// that's usually soon, but behind a slow image it can take a while,
+		// so the thread soon goes from yielding to sleeping, to leave its core
+		// to others
+		if (b->slots) {
+			int waits = 0;
+			while (i >= stbi__atomic_add(&b->delivered, 0) + b->window) {
+				if (++waits <= STBI__LOAD_MANY_YIELDS)
+					stbi__yield();
+				else
+					stbi__nap();
+			}
+		}
+#endif
 
-static void stbi__skip(stbi__context *s, int n)
-{
-	if (n < 0) {
-		s->img_buffer = s->img_buffer_end;
-		return;
-	}
-	if (s->io.read) {
-		int blen = (int)(s->img_buffer_end - s->img_buffer);
-		if (blen < n) {
-			s->img_buffer = s->img_buffer_end;
-			(s->io.skip)(s->io_user_data, n - blen);
-			return;
+		r.x = r.y = r.comp = 0;
+#ifdef STBI_THREAD_LOCAL
+		stbi__set_load_settings(&b->settings, &own);
+		busy = stbi__parallel_busy;
+		stbi__parallel_busy = busy || b->parallel;
+#endif
+		if (source->filename) {
+#ifndef STBI_NO_STDIO
+			r.data = stbi_load(source->filename, &r.x, &r.y, &r.comp, b->req_comp);
+#else
+			r.data = stbi__errpuc("can't fopen", "Unable to open file");
+#endif
+		} else
+			r.data = stbi_load_from_memory(source->buffer, source->len, &r.x, &r.y, &r.comp, b->req_comp);
+#ifdef STBI_THREAD_LOCAL
+		stbi__parallel_busy = busy;
+		stbi__set_load_settings(&own, &theirs);
+#endif
+
+		if (!b->slots) {
+			b->done(b->user, (int)i, r.data, r.x, r.y, r.comp);
+			continue;
 		}
+		// the reason was recorded on this thread; it's restored on the one
+		// that hands the image over
+		r.failure[0] = 0;
+		if (!r.data && stbi__g_failure_reason) {
+			size_t n = strlen(stbi__g_failure_reason);
+			if (n >= sizeof(r.failure)) n = sizeof(r.failure) - 1;
+			memcpy(r.failure, stbi__g_failure_reason, n);
+			r.failure[n] = 0;
+		}
+		b->slots[i % b->window].r = r;
+		stbi__atomic_add(&b->slots[i % b->window].ready, 1);
+		stbi__load_many_deliver(b);
 	}
-	s->img_buffer += n;
 }
 
-static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
+STBIDEF int stbi_load_many(stbi_load_source const *sources, int count, int req_comp, int max_in_flight, int in_order, stbi_load_done *done, void *user)
 {
-	if (s->io.read) {
-		int blen = (int)(s->img_buffer_end - s->img_buffer);
-		if (blen < n) {
-			int res, count;
-
-			memcpy(buffer, s->img_buffer, blen);
-
-			count = (s->io.read)(s->io_user_data, (char*)buffer + blen, n - blen);
-			res = (count == (n - blen));
-			s->img_buffer = s->img_buffer_end;
-			return res;
-		}
-	}
+	stbi__load_many b;
+	int tasks;
 
-	if (s->img_buffer + n <= s->img_buffer_end) {
-		memcpy(buffer, s->img_buffer, n);
-		s->img_buffer += n;
+	memset(&b, 0, sizeof(b));
+	b.sources = sources;
+	b.count = count;
+	b.req_comp = req_comp;
+	b.window = max_in_flight < 1 ? 1 : max_in_flight;
+	b.done = done;
+	b.user = user;
+#ifdef STBI_THREAD_LOCAL
+	// the images are decoded as this thread would, whichever thread they're on
+	stbi__get_load_settings(&b.settings);
+#endif
+	if (count <= 0)
 		return 1;
-	}
+	if (b.window > count) b.window = count;
+	if (in_order) {
+		b.slots = (stbi__load_slot *)stbi__malloc(sizeof(stbi__load_slot) * (size_t)b.window);
+		if (!b.slots) return stbi__err("outofmem", "Out of memory");
+		memset(b.slots, 0, sizeof(stbi__load_slot) * (size_t)b.window);
+	}
+
+	// a task per image that can be in flight, as many as run at once. each
+	// holds one image at a time, so handed over as soon as they're decoded
+	// that's all the window needs
+	tasks = b.window < stbi__parallel_threads ? b.window : stbi__parallel_threads;
+#ifndef STBI__ATOMICS
+	tasks = 1;
+#endif
+	b.parallel = stbi__parallel_width() > 1 && tasks > 1;
+	if (b.parallel)
+		stbi__parallel_runner(stbi__parallel_user, stbi__load_many_task, &b, tasks);
 	else
-		return 0;
-}
+		stbi__load_many_task(&b, 0);
 
-static int stbi__get16be(stbi__context *s)
-{
-	int z = stbi__get8(s);
-	return (z << 8) + stbi__get8(s);
+	STBI_FREE(b.slots);
+	return 1;
 }
 
-static stbi__uint32 stbi__get32be(stbi__context *s)
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_planar(char const *filename, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
 {
-	stbi__uint32 z = stbi__get16be(s);
+	FILE *f = stbi__fopen(filename, "rb");
+	int result;
+	if (!f) return stbi__err("can't fopen", "Unable to open file");
+	result = stbi_load_planar_from_file(f, w, h, scale, comp, req_comp, planes, strides);
+	fclose(f);
+	return result;
+}
+
+STBIDEF int stbi_load_planar_from_file(FILE *f, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	int result;
+	stbi__context s;
+	stbi__start_file(&s, f);
+	result = stbi__load_planar_setup(&s, 0, 0, 0, w, h, scale, comp, req_comp, planes, strides);
+	if (result) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	}
+	return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_planar_from_memory(stbi_uc const *buffer, int len, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__load_planar_setup(&s, 0, 0, 0, w, h, scale, comp, req_comp, planes, strides);
+}
+
+STBIDEF int stbi_load_planar_from_callbacks(stbi_io_callbacks const *clbk, void *user, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+	return stbi__load_planar_setup(&s, 0, 0, 0, w, h, scale, comp, req_comp, planes, strides);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_planar_region(char const *filename, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	int result;
+	if (!f) return stbi__err("can't fopen", "Unable to open file");
+	result = stbi_load_planar_region_from_file(f, x, y, w, h, scale, comp, req_comp, planes, strides);
+	fclose(f);
+	return result;
+}
+
+STBIDEF int stbi_load_planar_region_from_file(FILE *f, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	int result;
+	stbi__context s;
+	stbi__start_file(&s, f);
+	result = stbi__load_planar_setup(&s, 1, x, y, w, h, scale, comp, req_comp, planes, strides);
+	if (result) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	}
+	return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_planar_region_from_memory(stbi_uc const *buffer, int len, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__load_planar_setup(&s, 1, x, y, w, h, scale, comp, req_comp, planes, strides);
+}
+
+STBIDEF int stbi_load_planar_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int x, int y, int w, int h, int scale, int *comp, int req_comp, stbi_uc * const *planes, int const *strides)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+	return stbi__load_planar_setup(&s, 1, x, y, w, h, scale, comp, req_comp, planes, strides);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows(char const *filename, int *x, int *y, int *comp, stbi_row_callback *row, void *user)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	int result;
+	if (!f) return stbi__err("can't fopen", "Unable to open file");
+	result = stbi_load_rows_from_file(f, x, y, comp, row, user);
+	fclose(f);
+	return result;
+}
+
+STBIDEF int stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, stbi_row_callback *row, void *user)
+{
+	int result;
+	stbi__context s;
+	stbi__start_file(&s, f);
+	result = stbi__load_rows_setup(&s, x, y, comp, row, user);
+	if (result) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	}
+	return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, stbi_row_callback *row, void *user)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__load_rows_setup(&s, x, y, comp, row, user);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *clbk_user, int *x, int *y, int *comp, stbi_row_callback *row, void *user)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, clbk_user);
+	return stbi__load_rows_setup(&s, x, y, comp, row, user);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_progressive(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	stbi_uc *result;
+	if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+	result = stbi_load_progressive_from_file(f, x, y, comp, req_comp, preview, user);
+	fclose(f);
+	return result;
+}
+
+STBIDEF stbi_uc *stbi_load_progressive_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
+{
+	stbi_uc *result;
+	stbi__context s;
+	stbi__start_file(&s, f);
+	result = stbi__load_progressive_main(&s, x, y, comp, req_comp, preview, user);
+	if (result) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	}
+	return result;
+}
+#endif //!STBI_NO_STDIO
+
+STBIDEF stbi_uc *stbi_load_progressive_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__load_progressive_main(&s, x, y, comp, req_comp, preview, user);
+}
+
+STBIDEF stbi_uc *stbi_load_progressive_from_callbacks(stbi_io_callbacks const *clbk, void *clbk_user, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, clbk_user);
+	return stbi__load_progressive_main(&s, x, y, comp, req_comp, preview, user);
+}
+
+#ifndef STBI_NO_LINEAR
+static float *stbi__loadf_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
+{
+	unsigned char *data;
+#ifndef STBI_NO_HDR
+	if (stbi__hdr_test(s)) {
+		float *hdr_data = stbi__hdr_load(s, x, y, comp, req_comp);
+		if (hdr_data)
+			stbi__float_postprocess(hdr_data, x, y, comp, req_comp);
+		return hdr_data;
+	}
+#endif
+	data = stbi__load_flip(s, x, y, comp, req_comp);
+	if (data)
+		return stbi__ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
+	return stbi__errpf("unknown image type", "Image not of any known type, or corrupt");
+}
+
+STBIDEF float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__loadf_main(&s, x, y, comp, req_comp);
+}
+
+STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+	return stbi__loadf_main(&s, x, y, comp, req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+	float *result;
+	FILE *f = stbi__fopen(filename, "rb");
+	if (!f) return stbi__errpf("can't fopen", "Unable to open file");
+	result = stbi_loadf_from_file(f, x, y, comp, req_comp);
+	fclose(f);
+	return result;
+}
+
+STBIDEF float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+	stbi__context s;
+	stbi__start_file(&s, f);
+	return stbi__loadf_main(&s, x, y, comp, req_comp);
+}
+#endif // !STBI_NO_STDIO
+
+#endif // !STBI_NO_LINEAR
+
+// these is-hdr-or-not is defined independent of whether STBI_NO_LINEAR is
+// defined, for API simplicity; if STBI_NO_LINEAR is defined, it always
+// reports false!
+
+STBIDEF int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
+{
+#ifndef STBI_NO_HDR
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__hdr_test(&s);
+#else
+	STBI_NOTUSED(buffer);
+	STBI_NOTUSED(len);
+	return 0;
+#endif
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF int      stbi_is_hdr(char const *filename)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	int result = 0;
+	if (f) {
+		result = stbi_is_hdr_from_file(f);
+		fclose(f);
+	}
+	return result;
+}
+
+STBIDEF int      stbi_is_hdr_from_file(FILE *f)
+{
+#ifndef STBI_NO_HDR
+	stbi__context s;
+	stbi__start_file(&s, f);
+	return stbi__hdr_test(&s);
+#else
+	STBI_NOTUSED(f);
+	return 0;
+#endif
+}
+#endif // !STBI_NO_STDIO
+
+STBIDEF int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void *user)
+{
+#ifndef STBI_NO_HDR
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)clbk, user);
+	return stbi__hdr_test(&s);
+#else
+	STBI_NOTUSED(clbk);
+	STBI_NOTUSED(user);
+	return 0;
+#endif
+}
+
+#ifndef STBI_NO_LINEAR
+static float stbi__l2h_gamma_global = 2.2f, stbi__l2h_scale_global = 1.0f;
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL float stbi__l2h_gamma_local, stbi__l2h_scale_local;
+static STBI_THREAD_LOCAL int stbi__l2h_gamma_set, stbi__l2h_scale_set;
+#endif
+#define stbi__l2h_gamma  stbi__setting(stbi__l2h_gamma)
+#define stbi__l2h_scale  stbi__setting(stbi__l2h_scale)
+
+STBIDEF void   stbi_ldr_to_hdr_gamma(float gamma) { stbi__l2h_gamma_global = gamma; }
+STBIDEF void   stbi_ldr_to_hdr_scale(float scale) { stbi__l2h_scale_global = scale; }
+STBIDEF void   stbi_ldr_to_hdr_gamma_thread(float gamma) { stbi__set_thread(stbi__l2h_gamma, gamma); }
+STBIDEF void   stbi_ldr_to_hdr_scale_thread(float scale) { stbi__set_thread(stbi__l2h_scale, scale); }
+#endif
+
+STBIDEF void   stbi_hdr_to_ldr_gamma(float gamma) { stbi__h2l_gamma_i_global = 1 / gamma; }
+STBIDEF void   stbi_hdr_to_ldr_scale(float scale) { stbi__h2l_scale_i_global = 1 / scale; }
+STBIDEF void   stbi_hdr_to_ldr_gamma_thread(float gamma) { stbi__set_thread(stbi__h2l_gamma_i, 1 / gamma); }
+STBIDEF void   stbi_hdr_to_ldr_scale_thread(float scale) { stbi__set_thread(stbi__h2l_scale_i, 1 / scale); }
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Common code used by all image loaders
+//
+
+enum
+{
+	STBI__SCAN_load = 0,
+	STBI__SCAN_type,
+	STBI__SCAN_header
+};
+
+static void stbi__refill_buffer(stbi__context *s)
+{
+	int n = (s->io.read)(s->io_user_data, (char*)s->buffer_start, s->buflen);
+	if (n == 0) {
+		// at end of file, treat same as if from memory, but need to handle case
+		// where s->img_buffer isn't pointing to safe memory, e.g. 0-byte file
+		s->read_from_callbacks = 0;
+		s->img_buffer = s->buffer_start;
+		s->img_buffer_end = s->buffer_start + 1;
+		*s->img_buffer = 0;
+	}
+	else {
+		s->img_buffer = s->buffer_start;
+		s->img_buffer_end = s->buffer_start + n;
+	}
+}
+
+stbi_inline static stbi_uc stbi__get8(stbi__context *s)
+{
+	if (s->img_buffer < s->img_buffer_end)
+		return *s->img_buffer++;
+	if (s->read_from_callbacks) {
+		stbi__refill_buffer(s);
+		return *s->img_buffer++;
+	}
+	return 0;
+}
+
+stbi_inline static int stbi__at_eof(stbi__context *s)
+{
+	if (s->io.read) {
+		if (!(s->io.eof)(s->io_user_data)) return 0;
+		// if feof() is true, check if buffer = end
+		// special case: we've only got the special 0 character at the end
+		if (s->read_from_callbacks == 0) return 1;
+	}
+
+	return s->img_buffer >= s->img_buffer_end;
+}
+
+static void stbi__skip(stbi__context *s, int n)
+{
+	if (n < 0) {
+		s->img_buffer = s->img_buffer_end;
+		return;
+	}
+	if (s->io.read) {
+		int blen = (int)(s->img_buffer_end - s->img_buffer);
+		if (blen < n) {
+			s->img_buffer = s->img_buffer_end;
+			(s->io.skip)(s->io_user_data, n - blen);
+			return;
+		}
+	}
+	s->img_buffer += n;
+}
+
+static int stbi__getn(stbi__context *s, stbi_uc *buffer, int n)
+{
+	if (s->io.read) {
+		int blen = (int)(s->img_buffer_end - s->img_buffer);
+		if (blen < n) {
+			int res, count;
+
+			memcpy(buffer, s->img_buffer, blen);
+
+			count = (s->io.read)(s->io_user_data, (char*)buffer + blen, n - blen);
+			res = (count == (n - blen));
+			s->img_buffer = s->img_buffer_end;
+			return res;
+		}
+	}
+
+	if (s->img_buffer + n <= s->img_buffer_end) {
+		memcpy(buffer, s->img_buffer, n);
+		s->img_buffer += n;
+		return 1;
+	}
+	else
+		return 0;
+}
+
+static int stbi__get16be(stbi__context *s)
+{
+	int z = stbi__get8(s);
+	return (z << 8) + stbi__get8(s);
+}
+
+static stbi__uint32 stbi__get32be(stbi__context *s)
+{
+	stbi__uint32 z = stbi__get16be(s);
 	return (z << 16) + stbi__get16be(s);
 }
 
@@ -1453,8 +2602,34 @@ static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp)
 
 #ifndef STBI_NO_JPEG
 
-// huffman decoding acceleration
-#define FAST_BITS   9  // larger handles more cases; smaller stomps less cache
+// huffman decoding acceleration: codes of up to FAST_BITS bits, and AC codes
+// together with their magnitude bits when both fit, decode in one lookup.
+// larger handles more cases; smaller stomps less cache. 10 bits catches
+// most of the longer codes and larger magnitudes of high-quality scans
+#ifndef STBI_JPEG_FAST_BITS
+#define STBI_JPEG_FAST_BITS  10
+#endif
+#if STBI_JPEG_FAST_BITS < 1 || STBI_JPEG_FAST_BITS > 15
+#error "STBI_JPEG_FAST_BITS must be between 1 and 15"
+#endif
+#define FAST_BITS   STBI_JPEG_FAST_BITS
+
+// the entropy-coded bits are buffered in a register-sized word, so 64-bit
+// targets refill half as often and can take several bytes per refill
+#if defined(STBI__X64_TARGET) || defined(__aarch64__) || defined(_M_ARM64)
+#define STBI__JBUF_BITS  64
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__jbuf;
+#else
+typedef uint64_t stbi__jbuf;
+#endif
+#else
+#define STBI__JBUF_BITS  32
+typedef stbi__uint32 stbi__jbuf;
+#endif
+
+// the next n (1..16) bits of the entropy-coded buffer
+#define stbi__jpeg_peek(j, n)  ((unsigned int)((j)->code_buffer >> (STBI__JBUF_BITS - (n))))
 
 typedef struct
 {
@@ -1495,9 +2670,10 @@ typedef struct
 		stbi_uc *linebuf;
 		short   *coeff;   // progressive only
 		int      coeff_w, coeff_h; // number of 8x8 coefficient blocks
+		int      bx0, bx1, by0, by1; // the blocks the output needs
 	} img_comp[4];
 
-	stbi__uint32   code_buffer; // jpeg entropy-coded buffer
+	stbi__jbuf     code_buffer; // jpeg entropy-coded buffer, msb first
 	int            code_bits;   // number of valid bits
 	unsigned char  marker;      // marker seen while filling entropy buffer
 	int            nomore;      // flag if we saw a marker so must stop
@@ -1512,10 +2688,29 @@ typedef struct
 	int scan_n, order[4];
 	int restart_interval, todo;
 
+	// decoding at 1/(1<<scale_shift) size: each 8x8 block becomes block_size square
+	int scale_shift, block_size;
+
+	// where load_jpeg_image wants the pixels, so a pipelined decode can
+	// colour-convert rows as they're finished; NULL when nobody converts
+	struct stbi__jpeg_output_s *output;
+	stbi__uint32 rows_converted;
+
+	// stbi_load_progressive's callback, and what's been decoded for it
+	stbi_preview_callback *preview;
+	void *preview_user;
+	int scans;
+	int dc_comps;     // bit k: component k has its DC coefficients
+	int ac_scans;
+	int preview_due;  // once another scan turns out to follow
+
 	// kernels
 	void(*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
 	void(*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+	void(*YCbCr_to_RGB_planar_kernel)(stbi_uc *r, stbi_uc *g, stbi_uc *b, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count);
 	stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+	// upsamples 4:2:0/4:2:2 chroma while converting; NULL without SIMD
+	void(*YCbCr_upsample_to_RGB_kernel)(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc *pa, int step, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count);
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -1588,6 +2783,31 @@ static void stbi__build_fast_ac(stbi__int16 *fast_ac, stbi__huffman *h)
 
 static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 {
+#if STBI__JBUF_BITS == 64
+	// if the next 8 bytes are in memory and none of them is 0xff, there's
+	// no marker or stuffing to deal with, so take all the whole bytes that
+	// fit in one go
+	stbi__context *s = j->s;
+	if (!j->nomore && s->img_buffer_end - s->img_buffer >= 8) {
+		stbi_uc *p = s->img_buffer;
+		stbi__jbuf w, ff;
+#ifdef _MSC_VER
+		memcpy(&w, p, 8);
+		w = _byteswap_uint64(w);
+#else
+		w = ((stbi__jbuf)p[0] << 56) | ((stbi__jbuf)p[1] << 48) | ((stbi__jbuf)p[2] << 40) | ((stbi__jbuf)p[3] << 32) |
+			((stbi__jbuf)p[4] << 24) | ((stbi__jbuf)p[5] << 16) | ((stbi__jbuf)p[6] << 8) | p[7];
+#endif
+		ff = ~w; // 0xff bytes are now zero bytes
+		if (!((ff - 0x0101010101010101ULL) & ~ff & 0x8080808080808080ULL)) {
+			int n = (64 - j->code_bits) >> 3;
+			j->code_buffer |= (w >> (64 - 8 * n)) << (64 - 8 * n - j->code_bits);
+			j->code_bits += 8 * n;
+			s->img_buffer += n;
+			return;
+		}
+	}
+#endif
 	do {
 		int b = j->nomore ? 0 : stbi__get8(j->s);
 		if (b == 0xff) {
@@ -1598,14 +2818,11 @@ static void stbi__grow_buffer_unsafe(stbi__jpeg *j)
 				return;
 			}
 		}
-		j->code_buffer |= b << (24 - j->code_bits);
+		j->code_buffer |= (stbi__jbuf)b << (STBI__JBUF_BITS - 8 - j->code_bits);
 		j->code_bits += 8;
-	} while (j->code_bits <= 24);
+	} while (j->code_bits <= STBI__JBUF_BITS - 8);
 }
 
-// (1 << n) - 1
-static stbi__uint32 stbi__bmask[17] = { 0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535 };
-
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 {
@@ -1616,7 +2833,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 
 	// look at the top FAST_BITS and determine what symbol ID it is,
 	// if the code is <= FAST_BITS
-	c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+	c = stbi__jpeg_peek(j, FAST_BITS);
 	k = h->fast[c];
 	if (k < 255) {
 		int s = h->size[k];
@@ -1633,7 +2850,7 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 	// end; in other words, regardless of the number of bits, it
 	// wants to be compared against something shifted to have 16;
 	// that way we don't need to shift inside the loop.
-	temp = j->code_buffer >> 16;
+	temp = stbi__jpeg_peek(j, 16);
 	for (k = FAST_BITS + 1; ; ++k)
 		if (temp < h->maxcode[k])
 			break;
@@ -1647,8 +2864,8 @@ stbi_inline static int stbi__jpeg_huff_decode(stbi__jpeg *j, stbi__huffman *h)
 		return -1;
 
 	// convert the huffman code to the symbol id
-	c = ((j->code_buffer >> (32 - k)) & stbi__bmask[k]) + h->delta[k];
-	STBI_ASSERT((((j->code_buffer) >> (32 - h->size[c])) & stbi__bmask[h->size[c]]) == h->code[c]);
+	c = stbi__jpeg_peek(j, k) + h->delta[k];
+	STBI_ASSERT(stbi__jpeg_peek(j, h->size[c]) == h->code[c]);
 
 	// convert the id to a symbol
 	j->code_bits -= k;
@@ -1665,25 +2882,24 @@ stbi_inline static int stbi__extend_receive(stbi__jpeg *j, int n)
 {
 	unsigned int k;
 	int sgn;
+	STBI_ASSERT(n >= 1 && n <= 15);
 	if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
 
-	sgn = (stbi__int32)j->code_buffer >> 31; // sign bit is always in MSB
-	k = stbi_lrot(j->code_buffer, n);
-	STBI_ASSERT(n >= 0 && n < (int)(sizeof(stbi__bmask) / sizeof(*stbi__bmask)));
-	j->code_buffer = k & ~stbi__bmask[n];
-	k &= stbi__bmask[n];
+	sgn = (int)stbi__jpeg_peek(j, 1) - 1; // sign bit is always in MSB; 0 if set
+	k = stbi__jpeg_peek(j, n);
+	j->code_buffer <<= n;
 	j->code_bits -= n;
-	return k + (stbi__jbias[n] & ~sgn);
+	return k + (stbi__jbias[n] & sgn);
 }
 
 // get some unsigned bits
 stbi_inline static int stbi__jpeg_get_bits(stbi__jpeg *j, int n)
 {
 	unsigned int k;
+	STBI_ASSERT(n >= 1 && n <= 16);
 	if (j->code_bits < n) stbi__grow_buffer_unsafe(j);
-	k = stbi_lrot(j->code_buffer, n);
-	j->code_buffer = k & ~stbi__bmask[n];
-	k &= stbi__bmask[n];
+	k = stbi__jpeg_peek(j, n);
+	j->code_buffer <<= n;
 	j->code_bits -= n;
 	return k;
 }
@@ -1692,10 +2908,10 @@ stbi_inline static int stbi__jpeg_get_bit(stbi__jpeg *j)
 {
 	unsigned int k;
 	if (j->code_bits < 1) stbi__grow_buffer_unsafe(j);
-	k = j->code_buffer;
+	k = stbi__jpeg_peek(j, 1);
 	j->code_buffer <<= 1;
 	--j->code_bits;
-	return k & 0x80000000;
+	return k;
 }
 
 // given a value that's at position X in the zigzag stream,
@@ -1723,7 +2939,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
 
 	if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
 	t = stbi__jpeg_huff_decode(j, hdc);
-	if (t < 0) return stbi__err("bad huffman code", "Corrupt JPEG");
+	if (t < 0 || t > 15) return stbi__err("bad huffman code", "Corrupt JPEG");
 
 	// 0 all the ac values now so we can do it 32-bits at a time
 	memset(data, 0, 64 * sizeof(data[0]));
@@ -1739,7 +2955,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
 		unsigned int zig;
 		int c, r, s;
 		if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-		c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+		c = stbi__jpeg_peek(j, FAST_BITS);
 		r = fac[c];
 		if (r) { // fast-AC path
 			k += (r >> 4) & 15; // run
@@ -1782,6 +2998,7 @@ static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__
 		// first scan for DC coefficient, must be first
 		memset(data, 0, 64 * sizeof(data[0])); // 0 all the ac values now
 		t = stbi__jpeg_huff_decode(j, hdc);
+		if (t < 0 || t > 15) return stbi__err("bad huffman code", "Corrupt JPEG");
 		diff = t ? stbi__extend_receive(j, t) : 0;
 
 		dc = j->img_comp[b].dc_pred + diff;
@@ -1816,7 +3033,7 @@ static int stbi__jpeg_decode_block_prog_ac(stbi__jpeg *j, short data[64], stbi__
 			unsigned int zig;
 			int c, r, s;
 			if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
-			c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+			c = stbi__jpeg_peek(j, FAST_BITS);
 			r = fac[c];
 			if (r) { // fast-AC path
 				k += (r >> 4) & 15; // run
@@ -2036,6 +3253,60 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
 	}
 }
 
+// reduced IDCTs for scaled decoding, derived from jidctint's jpeg_idct_4x4 and
+// jpeg_idct_2x2: only the lowest 4x4 (2x2, 1x1) frequencies are transformed,
+// evaluated at the centre of each output pixel, so the block shrinks without
+// aliasing and with a fraction of the arithmetic
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+	int i, val[16], *v = val;
+	short *d = data;
+
+	// columns, keeping 2 extra bits of precision as above
+	for (i = 0; i < 4; ++i, ++d, ++v) {
+		int t10 = (d[0] + d[16]) << 2;
+		int t12 = (d[0] - d[16]) << 2;
+		int p1 = (d[8] + d[24]) * stbi__f2f(0.5411961f) + 512;
+		int t0 = (p1 + d[8] * stbi__f2f(0.765366865f)) >> 10;
+		int t2 = (p1 - d[24] * stbi__f2f(1.847759065f)) >> 10;
+		v[0] = t10 + t0;
+		v[12] = t10 - t0;
+		v[4] = t12 + t2;
+		v[8] = t12 - t2;
+	}
+
+	// rows; same 1<<17 scale, rounding and +128 as the full-size version
+	for (i = 0, v = val; i < 4; ++i, v += 4, out += out_stride) {
+		int t10 = stbi__fsh(v[0] + v[2]) + 65536 + (128 << 17);
+		int t12 = stbi__fsh(v[0] - v[2]) + 65536 + (128 << 17);
+		int p1 = (v[1] + v[3]) * stbi__f2f(0.5411961f);
+		int t0 = p1 + v[1] * stbi__f2f(0.765366865f);
+		int t2 = p1 - v[3] * stbi__f2f(1.847759065f);
+		out[0] = stbi__clamp((t10 + t0) >> 17);
+		out[3] = stbi__clamp((t10 - t0) >> 17);
+		out[1] = stbi__clamp((t12 + t2) >> 17);
+		out[2] = stbi__clamp((t12 - t2) >> 17);
+	}
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+	// both passes are just sums and differences; the 8-point scaling is 1<<3
+	int c0 = data[0] + 4 + (128 << 3), c1 = data[1];
+	int r0 = data[8], r1 = data[9];
+	out[0] = stbi__clamp((c0 + r0 + c1 + r1) >> 3);
+	out[1] = stbi__clamp((c0 + r0 - c1 - r1) >> 3);
+	out += out_stride;
+	out[0] = stbi__clamp((c0 - r0 + c1 - r1) >> 3);
+	out[1] = stbi__clamp((c0 - r0 - c1 + r1) >> 3);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+	STBI_NOTUSED(out_stride);
+	out[0] = stbi__clamp((data[0] + 4 + (128 << 3)) >> 3);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2414,53 +3685,241 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_trn8_32
 	}
 
-#undef dct_long_mul
-#undef dct_long_mac
-#undef dct_widen
-#undef dct_wadd
-#undef dct_wsub
-#undef dct_bfly32o
-#undef dct_pass
-}
+#undef dct_long_mul
+#undef dct_long_mac
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_pass
+}
+
+#endif // STBI_NEON
+
+#define STBI__MARKER_none  0xff
+// if there's a pending marker from the entropy stream, return that
+// otherwise, fetch from the stream and get a marker. if there's no
+// marker, return 0xff, which is never a valid marker value
+static stbi_uc stbi__get_marker(stbi__jpeg *j)
+{
+	stbi_uc x;
+	if (j->marker != STBI__MARKER_none) { x = j->marker; j->marker = STBI__MARKER_none; return x; }
+	x = stbi__get8(j->s);
+	if (x != 0xff) return STBI__MARKER_none;
+	while (x == 0xff)
+		x = stbi__get8(j->s);
+	return x;
+}
+
+// in each scan, we'll have scan_n components, and the order
+// of the components is specified by order[]
+#define STBI__RESTART(x)     ((x) >= 0xd0 && (x) <= 0xd7)
+
+// after a restart interval, stbi__jpeg_reset the entropy decoder and
+// the dc prediction
+static void stbi__jpeg_reset(stbi__jpeg *j)
+{
+	j->code_bits = 0;
+	j->code_buffer = 0;
+	j->nomore = 0;
+	j->img_comp[0].dc_pred = j->img_comp[1].dc_pred = j->img_comp[2].dc_pred = 0;
+	j->marker = STBI__MARKER_none;
+	j->todo = j->restart_interval ? j->restart_interval : 0x7fffffff;
+	j->eob_run = 0;
+	// no more than 1<<31 MCUs if no restart_interal? that's plenty safe,
+	// since we don't even allow 1<<30 pixels
+}
+
+// decoding a region, the blocks it doesn't reach are entropy-decoded (there's
+// no skipping ahead in a scan) but never transformed
+static int stbi__jpeg_block_wanted(stbi__jpeg *z, int n, int bx, int by)
+{
+	return bx >= z->img_comp[n].bx0 && bx < z->img_comp[n].bx1 &&
+		by >= z->img_comp[n].by0 && by < z->img_comp[n].by1;
+}
+
+// decodes baseline MCUs [first, last) of the current scan, in raster order,
+// without looking for restart markers
+static int stbi__jpeg_decode_baseline_mcus(stbi__jpeg *z, int first, int last)
+{
+	int m, k, x, y;
+	STBI_SIMD_ALIGN(short, data[64]);
+	if (z->scan_n == 1) {
+		int n = z->order[0];
+		int w = (z->img_comp[n].x + 7) >> 3;
+		int ha = z->img_comp[n].ha;
+		for (m = first; m < last; ++m) {
+			int i = m % w, j = m / w;
+			if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+			if (stbi__jpeg_block_wanted(z, n, i, j))
+				z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*j * z->block_size + i * z->block_size, z->img_comp[n].w2, data);
+		}
+	}
+	else {
+		for (m = first; m < last; ++m) {
+			int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+			for (k = 0; k < z->scan_n; ++k) {
+				int n = z->order[k];
+				int ha = z->img_comp[n].ha;
+				for (y = 0; y < z->img_comp[n].v; ++y) {
+					for (x = 0; x < z->img_comp[n].h; ++x) {
+						int x2 = (i*z->img_comp[n].h + x) * z->block_size;
+						int y2 = (j*z->img_comp[n].v + y) * z->block_size;
+						if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+						if (stbi__jpeg_block_wanted(z, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y))
+							z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*y2 + x2, z->img_comp[n].w2, data);
+					}
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+// restart intervals are independent, so with a parallel runner a baseline
+// scan is split at its RST markers and the intervals are decoded at once,
+// each into its own part of the component buffers
+#define STBI__PARALLEL_MIN_MCUS  1024
+
+typedef struct
+{
+	stbi__jpeg *z;
+	stbi_uc **segments; // start of each restart interval, plus the end of the scan
+	int num_segments;
+	int num_tasks;
+	int num_mcus;
+	int *failed;        // per task
+} stbi__jpeg_parallel;
+
+static void stbi__jpeg_decode_segments_task(void *arg, int task)
+{
+	stbi__jpeg_parallel *p = (stbi__jpeg_parallel *)arg;
+	int first = (int)((double)p->num_segments * task / p->num_tasks);
+	int last = (int)((double)p->num_segments * (task + 1) / p->num_tasks);
+	stbi__jpeg *z = (stbi__jpeg *)stbi__malloc(sizeof(stbi__jpeg));
+	stbi__context s;
+	int seg;
+
+	p->failed[task] = 1;
+	if (!z) return;
+
+	// each task reads its intervals through its own decoder and context
+	*z = *p->z;
+	memset(&s, 0, sizeof(s));
+	z->s = &s;
+	for (seg = first; seg < last; ++seg) {
+		int mcu = seg * z->restart_interval;
+		int end = mcu + z->restart_interval < p->num_mcus ? mcu + z->restart_interval : p->num_mcus;
+		s.img_buffer = p->segments[seg];
+		s.img_buffer_end = p->segments[seg + 1];
+		stbi__jpeg_reset(z);
+		if (!stbi__jpeg_decode_baseline_mcus(z, mcu, end)) break;
+		// the serial decoder gives up on the rest of the scan if an interval
+		// doesn't end right at its RST marker
+		if (seg + 1 < p->num_segments) {
+			if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+			if (!STBI__RESTART(z->marker)) break;
+		}
+	}
+	if (seg == last) p->failed[task] = 0;
+	STBI_FREE(z);
+}
+
+// returns -1 if the scan should be decoded serially instead: it can't be
+// split, or it's corrupt, in which case the serial decoder decides what
+// happens so that the outcome doesn't depend on the runner
+static int stbi__jpeg_parallel_entropy_coded_data(stbi__jpeg *z)
+{
+	stbi__context *s = z->s;
+	stbi__jpeg_parallel p;
+	stbi_uc *pos, *end;
+	int i, num_mcus, expected, ok = 1;
+
+	if (stbi__parallel_width() < 2 || z->progressive || !z->restart_interval || s->read_from_callbacks)
+		return -1;
+
+	if (z->scan_n == 1) {
+		int n = z->order[0];
+		num_mcus = ((z->img_comp[n].x + 7) >> 3) * ((z->img_comp[n].y + 7) >> 3);
+	}
+	else
+		num_mcus = z->img_mcu_x * z->img_mcu_y;
+	expected = (num_mcus + z->restart_interval - 1) / z->restart_interval;
+	if (num_mcus < STBI__PARALLEL_MIN_MCUS || expected < 2)
+		return -1;
+
+	p.segments = (stbi_uc **)stbi__malloc((expected + 1) * sizeof(stbi_uc *));
+	if (!p.segments) return -1;
+
+	// find the RST markers; any other marker (or 0xff 0xff) ends the scan
+	pos = s->img_buffer;
+	end = s->img_buffer_end;
+	p.segments[0] = pos;
+	p.num_segments = 1;
+	for (;;) {
+		pos = (stbi_uc *)memchr(pos, 0xff, end - pos);
+		if (!pos || pos + 1 >= end) {
+			pos = end;
+			break;
+		}
+		if (pos[1] == 0) {
+			pos += 2;
+			continue;
+		}
+		if (!STBI__RESTART(pos[1]))
+			break;
+		if (p.num_segments == expected) {
+			p.num_segments = 0; // more intervals than MCUs
+			break;
+		}
+		pos += 2;
+		p.segments[p.num_segments++] = pos;
+	}
+	if (p.num_segments != expected) {
+		STBI_FREE(p.segments);
+		return -1;
+	}
+	p.segments[expected] = pos;
+
+	p.z = z;
+	p.num_mcus = num_mcus;
+	p.num_tasks = expected < stbi__parallel_threads ? expected : stbi__parallel_threads;
+	p.failed = (int *)stbi__malloc(p.num_tasks * sizeof(int));
+	if (!p.failed) {
+		STBI_FREE(p.segments);
+		return -1;
+	}
+
+	stbi__parallel_runner(stbi__parallel_user, stbi__jpeg_decode_segments_task, &p, p.num_tasks);
 
-#endif // STBI_NEON
+	for (i = 0; i < p.num_tasks; ++i)
+		if (p.failed[i]) ok = 0;
+	STBI_FREE(p.failed);
+	STBI_FREE(p.segments);
+	if (!ok) return -1;
 
-#define STBI__MARKER_none  0xff
-// if there's a pending marker from the entropy stream, return that
-// otherwise, fetch from the stream and get a marker. if there's no
-// marker, return 0xff, which is never a valid marker value
-static stbi_uc stbi__get_marker(stbi__jpeg *j)
-{
-	stbi_uc x;
-	if (j->marker != STBI__MARKER_none) { x = j->marker; j->marker = STBI__MARKER_none; return x; }
-	x = stbi__get8(j->s);
-	if (x != 0xff) return STBI__MARKER_none;
-	while (x == 0xff)
-		x = stbi__get8(j->s);
-	return x;
+	// leave the stream where the serial decoder would look for the next marker
+	s->img_buffer = pos;
+	stbi__jpeg_reset(z);
+	return 1;
 }
 
-// in each scan, we'll have scan_n components, and the order
-// of the components is specified by order[]
-#define STBI__RESTART(x)     ((x) >= 0xd0 && (x) <= 0xd7)
-
-// after a restart interval, stbi__jpeg_reset the entropy decoder and
-// the dc prediction
-static void stbi__jpeg_reset(stbi__jpeg *j)
-{
-	j->code_bits = 0;
-	j->code_buffer = 0;
-	j->nomore = 0;
-	j->img_comp[0].dc_pred = j->img_comp[1].dc_pred = j->img_comp[2].dc_pred = 0;
-	j->marker = STBI__MARKER_none;
-	j->todo = j->restart_interval ? j->restart_interval : 0x7fffffff;
-	j->eob_run = 0;
-	// no more than 1<<31 MCUs if no restart_interal? that's plenty safe,
-	// since we don't even allow 1<<30 pixels
-}
+static int stbi__jpeg_pipelined_entropy_coded_data(stbi__jpeg *z);
+static int stbi__jpeg_speculative_entropy_coded_data(stbi__jpeg *z);
 
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
+	int parallel;
+	// anything converted from an earlier scan is out of date
+	z->rows_converted = 0;
+	parallel = stbi__jpeg_parallel_entropy_coded_data(z);
+	if (parallel < 0)
+		parallel = stbi__jpeg_speculative_entropy_coded_data(z);
+	if (parallel < 0)
+		parallel = stbi__jpeg_pipelined_entropy_coded_data(z);
+	if (parallel >= 0)
+		return parallel;
+
 	stbi__jpeg_reset(z);
 	if (!z->progressive) {
 		if (z->scan_n == 1) {
@@ -2477,7 +3936,8 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 				for (i = 0; i < w; ++i) {
 					int ha = z->img_comp[n].ha;
 					if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-					z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*j * 8 + i * 8, z->img_comp[n].w2, data);
+					if (stbi__jpeg_block_wanted(z, n, i, j))
+						z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*j * z->block_size + i * z->block_size, z->img_comp[n].w2, data);
 					// every data block is an MCU, so countdown the restart interval
 					if (--z->todo <= 0) {
 						if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2502,11 +3962,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 						// by the basic H and V specified for the component
 						for (y = 0; y < z->img_comp[n].v; ++y) {
 							for (x = 0; x < z->img_comp[n].h; ++x) {
-								int x2 = (i*z->img_comp[n].h + x) * 8;
-								int y2 = (j*z->img_comp[n].v + y) * 8;
+								int x2 = (i*z->img_comp[n].h + x) * z->block_size;
+								int y2 = (j*z->img_comp[n].v + y) * z->block_size;
 								int ha = z->img_comp[n].ha;
 								if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-								z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*y2 + x2, z->img_comp[n].w2, data);
+								if (stbi__jpeg_block_wanted(z, n, i*z->img_comp[n].h + x, j*z->img_comp[n].v + y))
+									z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*y2 + x2, z->img_comp[n].w2, data);
 							}
 						}
 					}
@@ -2594,25 +4055,6 @@ static void stbi__jpeg_dequantize(short *data, stbi_uc *dequant)
 		data[i] *= dequant[i];
 }
 
-static void stbi__jpeg_finish(stbi__jpeg *z)
-{
-	if (z->progressive) {
-		// dequantize and idct the data
-		int i, j, n;
-		for (n = 0; n < z->s->img_n; ++n) {
-			int w = (z->img_comp[n].x + 7) >> 3;
-			int h = (z->img_comp[n].y + 7) >> 3;
-			for (j = 0; j < h; ++j) {
-				for (i = 0; i < w; ++i) {
-					short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
-					stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-					z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*j * 8 + i * 8, z->img_comp[n].w2, data);
-				}
-			}
-		}
-	}
-}
-
 static int stbi__process_marker(stbi__jpeg *z, int m)
 {
 	int L;
@@ -2772,8 +4214,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 		// the bogus oversized data from using interleaved MCUs and their
 		// big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
 		// discard the extra data until colorspace conversion
-		z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-		z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+		z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->block_size;
+		z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->block_size;
 		z->img_comp[i].raw_data = stbi__malloc(z->img_comp[i].w2 * z->img_comp[i].h2 + 15);
 
 		if (z->img_comp[i].raw_data == NULL) {
@@ -2787,8 +4229,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 		z->img_comp[i].data = (stbi_uc*)(((size_t)z->img_comp[i].raw_data + 15) & ~15);
 		z->img_comp[i].linebuf = NULL;
 		if (z->progressive) {
-			z->img_comp[i].coeff_w = (z->img_comp[i].w2 + 7) >> 3;
-			z->img_comp[i].coeff_h = (z->img_comp[i].h2 + 7) >> 3;
+			z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+			z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
 			z->img_comp[i].raw_coeff = STBI_MALLOC(z->img_comp[i].coeff_w * z->img_comp[i].coeff_h * 64 * sizeof(short) + 15);
 			z->img_comp[i].coeff = (short*)(((size_t)z->img_comp[i].raw_coeff + 15) & ~15);
 		}
@@ -2832,6 +4274,10 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 	return 1;
 }
 
+static int stbi__jpeg_finish(stbi__jpeg *z, int preview);
+static int stbi__jpeg_preview(stbi__jpeg *z);
+static int stbi__jpeg_begin_planar(stbi__jpeg *z);
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
@@ -2841,12 +4287,30 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
 		j->img_comp[m].raw_coeff = NULL;
 	}
 	j->restart_interval = 0;
+	j->scans = j->dc_comps = j->ac_scans = j->preview_due = 0;
 	if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
+	if (!stbi__jpeg_begin_planar(j)) return 0;
 	m = stbi__get_marker(j);
 	while (!stbi__EOI(m)) {
 		if (stbi__SOS(m)) {
+			if (j->preview_due) {
+				// another scan follows, so the image so far is worth showing
+				j->preview_due = 0;
+				if (!stbi__jpeg_preview(j)) return 0;
+			}
 			if (!stbi__process_scan_header(j)) return 0;
 			if (!stbi__parse_entropy_coded_data(j)) return 0;
+			++j->scans;
+			if (j->preview && j->progressive) {
+				int k, luma = 0;
+				for (k = 0; k < j->scan_n; ++k) {
+					if (j->spec_start == 0) j->dc_comps |= 1 << j->order[k];
+					if (j->order[k] == 0) luma = 1;
+				}
+				if (j->spec_start != 0) ++j->ac_scans;
+				if (luma && j->dc_comps == (1 << j->s->img_n) - 1)
+					j->preview_due = 1;
+			}
 			if (j->marker == STBI__MARKER_none) {
 				// handle 0s at the end of image data from IP Kamera 9060
 				while (!stbi__at_eof(j->s)) {
@@ -2868,7 +4332,7 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
 		m = stbi__get_marker(j);
 	}
 	if (j->progressive)
-		stbi__jpeg_finish(j);
+		return stbi__jpeg_finish(j, 0);
 	return 1;
 }
 
@@ -3104,10 +4568,33 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
 		out[0] = (stbi_uc)r;
 		out[1] = (stbi_uc)g;
 		out[2] = (stbi_uc)b;
-		out[3] = 255;
+		if (step == 4) out[3] = 255; // rows may be converted out of order, so don't touch the next one
 		out += step;
 	}
 }
+
+static void stbi__YCbCr_to_RGB_planar_row(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count)
+{
+	int i;
+	for (i = 0; i < count; ++i) {
+		int y_fixed = (y[i] << 16) + 32768; // rounding
+		int r, g, b;
+		int cr = pcr[i] - 128;
+		int cb = pcb[i] - 128;
+		r = y_fixed + cr*float2fixed(1.40200f);
+		g = y_fixed - cr*float2fixed(0.71414f) - cb*float2fixed(0.34414f);
+		b = y_fixed + cb*float2fixed(1.77200f);
+		r >>= 16;
+		g >>= 16;
+		b >>= 16;
+		if ((unsigned)r > 255) { if (r < 0) r = 0; else r = 255; }
+		if ((unsigned)g > 255) { if (g < 0) g = 0; else g = 255; }
+		if ((unsigned)b > 255) { if (b < 0) b = 0; else b = 255; }
+		pr[i] = (stbi_uc)r;
+		pg[i] = (stbi_uc)g;
+		pb[i] = (stbi_uc)b;
+	}
+}
 #else
 // this is a reduced-precision calculation of YCbCr-to-RGB introduced
 // to make sure the code produces the same results in both SIMD and scalar
@@ -3132,10 +4619,33 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
 		out[0] = (stbi_uc)r;
 		out[1] = (stbi_uc)g;
 		out[2] = (stbi_uc)b;
-		out[3] = 255;
+		if (step == 4) out[3] = 255;
 		out += step;
 	}
 }
+
+static void stbi__YCbCr_to_RGB_planar_row(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count)
+{
+	int i;
+	for (i = 0; i < count; ++i) {
+		int y_fixed = (y[i] << 20) + (1 << 19); // rounding
+		int r, g, b;
+		int cr = pcr[i] - 128;
+		int cb = pcb[i] - 128;
+		r = y_fixed + cr* float2fixed(1.40200f);
+		g = y_fixed + (cr*-float2fixed(0.71414f)) + ((cb*-float2fixed(0.34414f)) & 0xffff0000);
+		b = y_fixed + cb* float2fixed(1.77200f);
+		r >>= 20;
+		g >>= 20;
+		b >>= 20;
+		if ((unsigned)r > 255) { if (r < 0) r = 0; else r = 255; }
+		if ((unsigned)g > 255) { if (g < 0) g = 0; else g = 255; }
+		if ((unsigned)b > 255) { if (b < 0) b = 0; else b = 255; }
+		pr[i] = (stbi_uc)r;
+		pg[i] = (stbi_uc)g;
+		pb[i] = (stbi_uc)b;
+	}
+}
 #endif
 
 #if defined(STBI_SSE2) || defined(STBI_NEON)
@@ -3267,36 +4777,820 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 		out[0] = (stbi_uc)r;
 		out[1] = (stbi_uc)g;
 		out[2] = (stbi_uc)b;
-		out[3] = 255;
+		if (step == 4) out[3] = 255;
 		out += step;
 	}
 }
-#endif
+#endif
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// same math as stbi__YCbCr_to_RGB_simd, but each channel goes to its own plane,
+// which also saves the final interleave
+static void stbi__YCbCr_to_RGB_planar_simd(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count)
+{
+	int i = 0;
+
+#ifdef STBI_SSE2
+	__m128i signflip = _mm_set1_epi8(-0x80);
+	__m128i cr_const0 = _mm_set1_epi16((short)(1.40200f*4096.0f + 0.5f));
+	__m128i cr_const1 = _mm_set1_epi16(-(short)(0.71414f*4096.0f + 0.5f));
+	__m128i cb_const0 = _mm_set1_epi16(-(short)(0.34414f*4096.0f + 0.5f));
+	__m128i cb_const1 = _mm_set1_epi16((short)(1.77200f*4096.0f + 0.5f));
+	__m128i y_bias = _mm_set1_epi8((char)(unsigned char)128);
+
+	for (; i + 7 < count; i += 8) {
+		// load
+		__m128i y_bytes = _mm_loadl_epi64((__m128i *) (y + i));
+		__m128i cr_bytes = _mm_loadl_epi64((__m128i *) (pcr + i));
+		__m128i cb_bytes = _mm_loadl_epi64((__m128i *) (pcb + i));
+		__m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+		__m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+		// unpack to short (and left-shift cr, cb by 8)
+		__m128i yw = _mm_unpacklo_epi8(y_bias, y_bytes);
+		__m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), cr_biased);
+		__m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cb_biased);
+
+		// color transform
+		__m128i yws = _mm_srli_epi16(yw, 4);
+		__m128i cr0 = _mm_mulhi_epi16(cr_const0, crw);
+		__m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw);
+		__m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1);
+		__m128i cr1 = _mm_mulhi_epi16(crw, cr_const1);
+		__m128i rws = _mm_add_epi16(cr0, yws);
+		__m128i gwt = _mm_add_epi16(cb0, yws);
+		__m128i bws = _mm_add_epi16(yws, cb1);
+		__m128i gws = _mm_add_epi16(gwt, cr1);
+
+		// descale
+		__m128i rw = _mm_srai_epi16(rws, 4);
+		__m128i bw = _mm_srai_epi16(bws, 4);
+		__m128i gw = _mm_srai_epi16(gws, 4);
+
+		// back to byte and store
+		__m128i rgb = _mm_packus_epi16(rw, gw);
+		__m128i bb = _mm_packus_epi16(bw, bw);
+		_mm_storel_epi64((__m128i *) (pr + i), rgb);
+		_mm_storel_epi64((__m128i *) (pg + i), _mm_srli_si128(rgb, 8));
+		_mm_storel_epi64((__m128i *) (pb + i), bb);
+	}
+#endif
+
+#ifdef STBI_NEON
+	uint8x8_t signflip = vdup_n_u8(0x80);
+	int16x8_t cr_const0 = vdupq_n_s16((short)(1.40200f*4096.0f + 0.5f));
+	int16x8_t cr_const1 = vdupq_n_s16(-(short)(0.71414f*4096.0f + 0.5f));
+	int16x8_t cb_const0 = vdupq_n_s16(-(short)(0.34414f*4096.0f + 0.5f));
+	int16x8_t cb_const1 = vdupq_n_s16((short)(1.77200f*4096.0f + 0.5f));
+
+	for (; i + 7 < count; i += 8) {
+		// load
+		uint8x8_t y_bytes = vld1_u8(y + i);
+		uint8x8_t cr_bytes = vld1_u8(pcr + i);
+		uint8x8_t cb_bytes = vld1_u8(pcb + i);
+		int8x8_t cr_biased = vreinterpret_s8_u8(vsub_u8(cr_bytes, signflip));
+		int8x8_t cb_biased = vreinterpret_s8_u8(vsub_u8(cb_bytes, signflip));
+
+		// expand to s16
+		int16x8_t yws = vreinterpretq_s16_u16(vshll_n_u8(y_bytes, 4));
+		int16x8_t crw = vshll_n_s8(cr_biased, 7);
+		int16x8_t cbw = vshll_n_s8(cb_biased, 7);
+
+		// color transform
+		int16x8_t cr0 = vqdmulhq_s16(crw, cr_const0);
+		int16x8_t cb0 = vqdmulhq_s16(cbw, cb_const0);
+		int16x8_t cr1 = vqdmulhq_s16(crw, cr_const1);
+		int16x8_t cb1 = vqdmulhq_s16(cbw, cb_const1);
+		int16x8_t rws = vaddq_s16(yws, cr0);
+		int16x8_t gws = vaddq_s16(vaddq_s16(yws, cb0), cr1);
+		int16x8_t bws = vaddq_s16(yws, cb1);
+
+		// undo scaling, round, convert to byte and store
+		vst1_u8(pr + i, vqrshrun_n_s16(rws, 4));
+		vst1_u8(pg + i, vqrshrun_n_s16(gws, 4));
+		vst1_u8(pb + i, vqrshrun_n_s16(bws, 4));
+	}
+#endif
+
+	if (i < count)
+		stbi__YCbCr_to_RGB_planar_row(pr + i, pg + i, pb + i, y + i, pcb + i, pcr + i, count - i);
+}
+#endif
+
+#if (defined(STBI_SSE2) || defined(STBI_NEON)) && !defined(STBI_JPEG_OLD)
+// one pixel of stbi__YCbCr_to_RGB_row
+static void stbi__YCbCr_to_RGB_pixel(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, int y, int cb, int cr)
+{
+	int y_fixed = (y << 20) + (1 << 19); // rounding
+	int r, g, b;
+	cr -= 128;
+	cb -= 128;
+	r = y_fixed + cr* float2fixed(1.40200f);
+	g = y_fixed + (cr*-float2fixed(0.71414f)) + ((cb*-float2fixed(0.34414f)) & 0xffff0000);
+	b = y_fixed + cb* float2fixed(1.77200f);
+	r >>= 20;
+	g >>= 20;
+	b >>= 20;
+	if ((unsigned)r > 255) { if (r < 0) r = 0; else r = 255; }
+	if ((unsigned)g > 255) { if (g < 0) g = 0; else g = 255; }
+	if ((unsigned)b > 255) { if (b < 0) b = 0; else b = 255; }
+	*pr = (stbi_uc)r;
+	*pg = (stbi_uc)g;
+	*pb = (stbi_uc)b;
+}
+
+// pixels x to end of stbi__YCbCr_upsample_to_RGB_simd, one at a time
+static void stbi__YCbCr_upsample_to_RGB_from(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc *pa, int step, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int x, int end, int count)
+{
+	// x is even, so pixels x and x+1 both come from input sample i, filtered
+	// with the one before and the one after (clamped at the edges)
+	int w = (count + 1) >> 1;
+	int i = x >> 1, n;
+	// stbi__resample_row_h_2 weights its second-last sample towards the wrong
+	// neighbor; do the same so the output doesn't change
+	int lopsided = !cb_far && w >= 2 ? 2 * (w - 1) : -1;
+	int cb_prev, cb_curr, cr_prev, cr_curr;
+	if (!cb_far) {
+		cb_far = cb_near;
+		cr_far = cr_near;
+	}
+	n = i ? i - 1 : 0;
+	cb_prev = 3 * cb_near[n] + cb_far[n];
+	cr_prev = 3 * cr_near[n] + cr_far[n];
+	cb_curr = 3 * cb_near[i] + cb_far[i];
+	cr_curr = 3 * cr_near[i] + cr_far[i];
+	for (; x < end; x += 2, ++i) {
+		int cb_next, cr_next;
+		n = i + 1 < w ? i + 1 : i;
+		cb_next = 3 * cb_near[n] + cb_far[n];
+		cr_next = 3 * cr_near[n] + cr_far[n];
+
+		if (x == lopsided)
+			stbi__YCbCr_to_RGB_pixel(pr + x * step, pg + x * step, pb + x * step, y[x], (3 * cb_prev + cb_curr + 8) >> 4, (3 * cr_prev + cr_curr + 8) >> 4);
+		else
+			stbi__YCbCr_to_RGB_pixel(pr + x * step, pg + x * step, pb + x * step, y[x], (3 * cb_curr + cb_prev + 8) >> 4, (3 * cr_curr + cr_prev + 8) >> 4);
+		if (pa) pa[x * step] = 255;
+		if (x + 1 < end) {
+			stbi__YCbCr_to_RGB_pixel(pr + (x + 1) * step, pg + (x + 1) * step, pb + (x + 1) * step, y[x + 1], (3 * cb_curr + cb_next + 8) >> 4, (3 * cr_curr + cr_next + 8) >> 4);
+			if (pa) pa[(x + 1) * step] = 255;
+		}
+
+		cb_prev = cb_curr, cb_curr = cb_next;
+		cr_prev = cr_curr, cr_curr = cr_next;
+	}
+}
+
+// resampling and color conversion in one pass, for the usual 4:2:0 and 4:2:2
+// cases, so the upsampled chroma is never written out. each chroma row is
+// blended 3:1 with 'far' and upsampled 2x horizontally, the same as
+// stbi__resample_row_hv_2; passing NULL for far gives stbi__resample_row_h_2.
+// with step 1 the channels go to the planes pr, pg and pb, otherwise they're
+// interleaved and pa, if not NULL, gets 255
+//
+// 16 pixels at a time, this is the math of stbi__resample_row_hv_2_simd feeding
+// that of stbi__YCbCr_to_RGB_simd, with the upsampled chroma kept in registers
+static void stbi__YCbCr_upsample_to_RGB_simd(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc *pa, int step, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count)
+{
+	int w = (count + 1) >> 1;
+	int i = 0;
+
+	if (step == 1 || step == 3 || (step == 4 && pa)) {
+		stbi_uc const *cbf = cb_far ? cb_far : cb_near;
+		stbi_uc const *crf = cr_far ? cr_far : cr_near;
+		int cb_t1 = 3 * cb_near[0] + cbf[0];
+		int cr_t1 = 3 * cr_near[0] + crf[0];
+
+#ifdef STBI_SSE2
+		__m128i zero = _mm_setzero_si128();
+		__m128i bias = _mm_set1_epi16(8);
+		__m128i c128 = _mm_set1_epi16(128);
+		__m128i cr_const0 = _mm_set1_epi16((short)(1.40200f*4096.0f + 0.5f));
+		__m128i cr_const1 = _mm_set1_epi16(-(short)(0.71414f*4096.0f + 0.5f));
+		__m128i cb_const0 = _mm_set1_epi16(-(short)(0.34414f*4096.0f + 0.5f));
+		__m128i cb_const1 = _mm_set1_epi16((short)(1.77200f*4096.0f + 0.5f));
+		__m128i y_bias = _mm_set1_epi8((char)(unsigned char)128);
+		__m128i xw = _mm_set1_epi16(255); // alpha channel
+
+		// 8 chroma samples to 16, as (c - 128) << 8 ready for the color transform
+		#define stbi__upsample8(pnear, pfar, t1, lo, hi) \
+		{ \
+			__m128i farw = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (pfar + i)), zero); \
+			__m128i nearw = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (pnear + i)), zero); \
+			__m128i curr = _mm_add_epi16(_mm_slli_epi16(nearw, 2), _mm_sub_epi16(farw, nearw)); \
+			__m128i prev = _mm_insert_epi16(_mm_slli_si128(curr, 2), t1, 0); \
+			__m128i next = _mm_insert_epi16(_mm_srli_si128(curr, 2), 3 * pnear[i + 8] + pfar[i + 8], 7); \
+			__m128i curb = _mm_add_epi16(_mm_slli_epi16(curr, 2), bias); \
+			__m128i even = _mm_add_epi16(_mm_sub_epi16(prev, curr), curb); \
+			__m128i odd = _mm_add_epi16(_mm_sub_epi16(next, curr), curb); \
+			lo = _mm_slli_epi16(_mm_sub_epi16(_mm_srli_epi16(_mm_unpacklo_epi16(even, odd), 4), c128), 8); \
+			hi = _mm_slli_epi16(_mm_sub_epi16(_mm_srli_epi16(_mm_unpackhi_epi16(even, odd), 4), c128), 8); \
+			t1 = 3 * pnear[i + 7] + pfar[i + 7]; \
+		}
+
+		// color transform of 8 pixels, leaving rw, gw and bw descaled
+		#define stbi__transform8(yw, cbw, crw) \
+		{ \
+			__m128i yws = _mm_srli_epi16(yw, 4); \
+			__m128i cr0 = _mm_mulhi_epi16(cr_const0, crw); \
+			__m128i cb0 = _mm_mulhi_epi16(cb_const0, cbw); \
+			__m128i cb1 = _mm_mulhi_epi16(cbw, cb_const1); \
+			__m128i cr1 = _mm_mulhi_epi16(crw, cr_const1); \
+			rw = _mm_srai_epi16(_mm_add_epi16(cr0, yws), 4); \
+			gw = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(cb0, yws), cr1), 4); \
+			bw = _mm_srai_epi16(_mm_add_epi16(yws, cb1), 4); \
+		}
+
+		for (; i < ((w - 1) & ~7); i += 8) {
+			__m128i cbw0, cbw1, crw0, crw1, rw, gw, bw, rw0, gw0, bw0;
+			__m128i y_bytes = _mm_loadu_si128((__m128i *) (y + i * 2));
+			stbi__upsample8(cb_near, cbf, cb_t1, cbw0, cbw1);
+			stbi__upsample8(cr_near, crf, cr_t1, crw0, crw1);
+			stbi__transform8(_mm_unpacklo_epi8(y_bias, y_bytes), cbw0, crw0);
+			rw0 = rw, gw0 = gw, bw0 = bw;
+			stbi__transform8(_mm_unpackhi_epi8(y_bias, y_bytes), cbw1, crw1);
+
+			if (step == 1) {
+				_mm_storeu_si128((__m128i *) (pr + i * 2), _mm_packus_epi16(rw0, rw));
+				_mm_storeu_si128((__m128i *) (pg + i * 2), _mm_packus_epi16(gw0, gw));
+				_mm_storeu_si128((__m128i *) (pb + i * 2), _mm_packus_epi16(bw0, bw));
+			}
+			else {
+				// transpose to interleave channels, then drop alpha for RGB
+				STBI_SIMD_ALIGN(stbi_uc, rgba[64]);
+				stbi_uc *o = step == 4 ? pr + i * 8 : rgba;
+				__m128i brb0 = _mm_packus_epi16(rw0, bw0);
+				__m128i gxb0 = _mm_packus_epi16(gw0, xw);
+				__m128i brb1 = _mm_packus_epi16(rw, bw);
+				__m128i gxb1 = _mm_packus_epi16(gw, xw);
+				__m128i t0 = _mm_unpacklo_epi8(brb0, gxb0);
+				__m128i t1 = _mm_unpackhi_epi8(brb0, gxb0);
+				__m128i t2 = _mm_unpacklo_epi8(brb1, gxb1);
+				__m128i t3 = _mm_unpackhi_epi8(brb1, gxb1);
+				_mm_storeu_si128((__m128i *) (o + 0), _mm_unpacklo_epi16(t0, t1));
+				_mm_storeu_si128((__m128i *) (o + 16), _mm_unpackhi_epi16(t0, t1));
+				_mm_storeu_si128((__m128i *) (o + 32), _mm_unpacklo_epi16(t2, t3));
+				_mm_storeu_si128((__m128i *) (o + 48), _mm_unpackhi_epi16(t2, t3));
+				if (step == 3) {
+					int k;
+					for (k = 0; k < 16; ++k) {
+						pr[(i * 2 + k) * 3 + 0] = rgba[k * 4 + 0];
+						pr[(i * 2 + k) * 3 + 1] = rgba[k * 4 + 1];
+						pr[(i * 2 + k) * 3 + 2] = rgba[k * 4 + 2];
+					}
+				}
+			}
+		}
+
+		#undef stbi__upsample8
+		#undef stbi__transform8
+#endif
+
+#ifdef STBI_NEON
+		int16x8_t c128 = vdupq_n_s16(128);
+		int16x8_t cr_const0 = vdupq_n_s16((short)(1.40200f*4096.0f + 0.5f));
+		int16x8_t cr_const1 = vdupq_n_s16(-(short)(0.71414f*4096.0f + 0.5f));
+		int16x8_t cb_const0 = vdupq_n_s16(-(short)(0.34414f*4096.0f + 0.5f));
+		int16x8_t cb_const1 = vdupq_n_s16((short)(1.77200f*4096.0f + 0.5f));
+
+		// 8 chroma samples to 16, as (c - 128) << 7 ready for the color transform
+		#define stbi__upsample8(pnear, pfar, t1, lo, hi) \
+		{ \
+			uint8x8_t farb = vld1_u8(pfar + i); \
+			uint8x8_t nearb = vld1_u8(pnear + i); \
+			int16x8_t diff = vreinterpretq_s16_u16(vsubl_u8(farb, nearb)); \
+			int16x8_t curr = vaddq_s16(vreinterpretq_s16_u16(vshll_n_u8(nearb, 2)), diff); \
+			int16x8_t prev = vsetq_lane_s16(t1, vextq_s16(curr, curr, 7), 0); \
+			int16x8_t next = vsetq_lane_s16(3 * pnear[i + 8] + pfar[i + 8], vextq_s16(curr, curr, 1), 7); \
+			int16x8_t curs = vshlq_n_s16(curr, 2); \
+			int16x8x2_t up = vzipq_s16(vrshrq_n_s16(vaddq_s16(curs, vsubq_s16(prev, curr)), 4), \
+			                           vrshrq_n_s16(vaddq_s16(curs, vsubq_s16(next, curr)), 4)); \
+			lo = vshlq_n_s16(vsubq_s16(up.val[0], c128), 7); \
+			hi = vshlq_n_s16(vsubq_s16(up.val[1], c128), 7); \
+			t1 = 3 * pnear[i + 7] + pfar[i + 7]; \
+		}
+
+		// color transform of 8 pixels, undoing the scaling and rounding to bytes
+		#define stbi__transform8(y_bytes, cbw, crw) \
+		{ \
+			int16x8_t yws = vreinterpretq_s16_u16(vshll_n_u8(y_bytes, 4)); \
+			int16x8_t cr0 = vqdmulhq_s16(crw, cr_const0); \
+			int16x8_t cb0 = vqdmulhq_s16(cbw, cb_const0); \
+			int16x8_t cr1 = vqdmulhq_s16(crw, cr_const1); \
+			int16x8_t cb1 = vqdmulhq_s16(cbw, cb_const1); \
+			rb = vqrshrun_n_s16(vaddq_s16(yws, cr0), 4); \
+			gb = vqrshrun_n_s16(vaddq_s16(vaddq_s16(yws, cb0), cr1), 4); \
+			bb = vqrshrun_n_s16(vaddq_s16(yws, cb1), 4); \
+		}
+
+		for (; i < ((w - 1) & ~7); i += 8) {
+			int16x8_t cbw0, cbw1, crw0, crw1;
+			uint8x16_t y_bytes = vld1q_u8(y + i * 2);
+			uint8x8_t rb, gb, bb, rb0, gb0, bb0;
+			stbi__upsample8(cb_near, cbf, cb_t1, cbw0, cbw1);
+			stbi__upsample8(cr_near, crf, cr_t1, crw0, crw1);
+			stbi__transform8(vget_low_u8(y_bytes), cbw0, crw0);
+			rb0 = rb, gb0 = gb, bb0 = bb;
+			stbi__transform8(vget_high_u8(y_bytes), cbw1, crw1);
+
+			if (step == 1) {
+				vst1q_u8(pr + i * 2, vcombine_u8(rb0, rb));
+				vst1q_u8(pg + i * 2, vcombine_u8(gb0, gb));
+				vst1q_u8(pb + i * 2, vcombine_u8(bb0, bb));
+			}
+			else if (step == 3) {
+				// store, interleaving r/g/b
+				uint8x8x3_t o;
+				o.val[0] = rb0, o.val[1] = gb0, o.val[2] = bb0;
+				vst3_u8(pr + i * 6, o);
+				o.val[0] = rb, o.val[1] = gb, o.val[2] = bb;
+				vst3_u8(pr + i * 6 + 24, o);
+			}
+			else {
+				// store, interleaving r/g/b/a
+				uint8x8x4_t o;
+				o.val[3] = vdup_n_u8(255);
+				o.val[0] = rb0, o.val[1] = gb0, o.val[2] = bb0;
+				vst4_u8(pr + i * 8, o);
+				o.val[0] = rb, o.val[1] = gb, o.val[2] = bb;
+				vst4_u8(pr + i * 8 + 32, o);
+			}
+		}
+
+		#undef stbi__upsample8
+		#undef stbi__transform8
+#endif
+	}
+
+	stbi__YCbCr_upsample_to_RGB_from(pr, pg, pb, pa, step, y, cb_near, cb_far, cr_near, cr_far, i * 2, count, count);
+}
+#endif
+
+#ifdef STBI_AVX2
+// AVX2 integer IDCT, bit-identical to stbi__idct_simd. rather than one row per
+// register, each register holds all eight columns (or rows) of the pairs of
+// rows (or columns) a rotation combines, so the 32-bit math happens eight lanes
+// at a time and the transposes are just regroupings of those pairs
+static STBI__AVX2_TARGET void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
+{
+	__m256i p04, p62, p15, p73;
+	__m256i row0, row1, row2, row3, row4, row5, row6, row7;
+
+	// dot product constant: even elems=x, odd elems=y
+#define dct_const(x,y)  _mm256_set1_epi32((int)(((unsigned)(y) << 16) | ((x) & 0xffff)))
+
+	// out = in << 12, for in in the low halves of the 32-bit elements
+#define dct_widen(in)  _mm256_srai_epi32(_mm256_slli_epi32((in), 16), 4)
+
+	// butterfly a/b, add bias, then shift by "s"
+#define dct_bfly32(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         out0 = _mm256_srai_epi32(_mm256_add_epi32(abiased, b), s); \
+         out1 = _mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s); \
+      }
+
+	// p04 pairs rows 0 and 4, p62 rows 6 and 2, and so on. sums and differences
+	// are taken in 16 bits first, the same as the SSE2 version
+#define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         __m256i t2e = _mm256_madd_epi16(p62, rot0_0); \
+         __m256i t3e = _mm256_madd_epi16(p62, rot0_1); \
+         __m256i p40 = _mm256_srli_epi32(p04, 16); \
+         __m256i t0e = dct_widen(_mm256_add_epi16(p04, p40)); \
+         __m256i t1e = dct_widen(_mm256_sub_epi16(p04, p40)); \
+         __m256i x0 = _mm256_add_epi32(t0e, t3e); \
+         __m256i x3 = _mm256_sub_epi32(t0e, t3e); \
+         __m256i x1 = _mm256_add_epi32(t1e, t2e); \
+         __m256i x2 = _mm256_sub_epi32(t1e, t2e); \
+         /* odd part */ \
+         __m256i y0o = _mm256_madd_epi16(p73, rot2_0); \
+         __m256i y2o = _mm256_madd_epi16(p73, rot2_1); \
+         __m256i y1o = _mm256_madd_epi16(p15, rot3_0); \
+         __m256i y3o = _mm256_madd_epi16(p15, rot3_1); \
+         __m256i sum1735 = _mm256_add_epi16(p15, p73); \
+         __m256i y4o = _mm256_madd_epi16(sum1735, rot1_0); \
+         __m256i y5o = _mm256_madd_epi16(sum1735, rot1_1); \
+         __m256i x4 = _mm256_add_epi32(y0o, y4o); \
+         __m256i x5 = _mm256_add_epi32(y1o, y5o); \
+         __m256i x6 = _mm256_add_epi32(y2o, y5o); \
+         __m256i x7 = _mm256_add_epi32(y3o, y4o); \
+         dct_bfly32(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32(row3,row4, x3,x4,bias,shift); \
+      }
+
+	// the same constants as stbi__idct_simd, swapped for p62 and p15 since
+	// those hold their pairs the other way around
+	__m256i rot0_0 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f), stbi__f2f(0.5411961f));
+	__m256i rot0_1 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(0.765366865f));
+	__m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+	__m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+	__m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f(0.298631336f), stbi__f2f(-1.961570560f));
+	__m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f(3.072711026f));
+	__m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f(2.053119869f));
+	__m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f(1.501321110f), stbi__f2f(-0.390180644f));
+
+	// rounding biases in column/row passes, see stbi__idct_block for explanation.
+	__m256i bias_0 = _mm256_set1_epi32(512);
+	__m256i bias_1 = _mm256_set1_epi32(65536 + (128 << 17));
+
+	{
+		// load two rows per register and pair them up across all eight columns
+		__m256i r01 = _mm256_loadu_si256((const __m256i *) (data + 0 * 8));
+		__m256i r23 = _mm256_loadu_si256((const __m256i *) (data + 2 * 8));
+		__m256i r45 = _mm256_loadu_si256((const __m256i *) (data + 4 * 8));
+		__m256i r67 = _mm256_loadu_si256((const __m256i *) (data + 6 * 8));
+		__m256i lo = _mm256_unpacklo_epi16(r01, r45); // rows 0/4 | 1/5, columns 0-3
+		__m256i hi = _mm256_unpackhi_epi16(r01, r45); // columns 4-7
+		p04 = _mm256_permute2x128_si256(lo, hi, 0x20);
+		p15 = _mm256_permute2x128_si256(lo, hi, 0x31);
+		lo = _mm256_unpacklo_epi16(r67, r23);
+		hi = _mm256_unpackhi_epi16(r67, r23);
+		p62 = _mm256_permute2x128_si256(lo, hi, 0x20);
+		p73 = _mm256_permute2x128_si256(lo, hi, 0x31);
+	}
+
+	// column pass
+	dct_pass(bias_0, 10);
+
+	{
+		// pack two rows per register, pick out each row's column pairs, then
+		// gather every pair across the rows. the rows end up in the order
+		// 0 2 4 6 | 1 3 5 7, which the row pass doesn't care about
+		__m256i pairs = _mm256_setr_epi8(0, 1, 8, 9, 12, 13, 4, 5, 2, 3, 10, 11, 14, 15, 6, 7,
+			0, 1, 8, 9, 12, 13, 4, 5, 2, 3, 10, 11, 14, 15, 6, 7);
+		__m256i y01 = _mm256_shuffle_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi32(row0, row1), 0xd8), pairs);
+		__m256i y23 = _mm256_shuffle_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi32(row2, row3), 0xd8), pairs);
+		__m256i y45 = _mm256_shuffle_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi32(row4, row5), 0xd8), pairs);
+		__m256i y67 = _mm256_shuffle_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi32(row6, row7), 0xd8), pairs);
+		__m256i a = _mm256_unpacklo_epi32(y01, y23);
+		__m256i b = _mm256_unpacklo_epi32(y45, y67);
+		__m256i c = _mm256_unpackhi_epi32(y01, y23);
+		__m256i d = _mm256_unpackhi_epi32(y45, y67);
+		p04 = _mm256_unpacklo_epi64(a, b);
+		p62 = _mm256_unpackhi_epi64(a, b);
+		p15 = _mm256_unpacklo_epi64(c, d);
+		p73 = _mm256_unpackhi_epi64(c, d);
+	}
+
+	// row pass
+	dct_pass(bias_1, 17);
+
+	{
+		// pack to bytes, which come out a column at a time with four rows per
+		// lane, and transpose those 4x4 groups
+		__m256i cols = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+			0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+		__m256i c03 = _mm256_shuffle_epi8(_mm256_packus_epi16(_mm256_packs_epi32(row0, row1), _mm256_packs_epi32(row2, row3)), cols);
+		__m256i c47 = _mm256_shuffle_epi8(_mm256_packus_epi16(_mm256_packs_epi32(row4, row5), _mm256_packs_epi32(row6, row7)), cols);
+		__m256i r02_13 = _mm256_unpacklo_epi32(c03, c47);
+		__m256i r46_57 = _mm256_unpackhi_epi32(c03, c47);
+		__m128i r02 = _mm256_castsi256_si128(r02_13);
+		__m128i r13 = _mm256_extracti128_si256(r02_13, 1);
+		__m128i r46 = _mm256_castsi256_si128(r46_57);
+		__m128i r57 = _mm256_extracti128_si256(r46_57, 1);
+		_mm256_zeroupper();
+
+		// store
+		_mm_storel_epi64((__m128i *) out, r02); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, r13); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(r02, 0x4e)); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(r13, 0x4e)); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, r46); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, r57); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(r46, 0x4e)); out += out_stride;
+		_mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(r57, 0x4e));
+	}
+
+#undef dct_const
+#undef dct_widen
+#undef dct_bfly32
+#undef dct_pass
+}
+
+// 3*near + far for 16 chroma samples from k, as 4*near + (far - near)
+#define stbi__vert16_avx2(out, pnear, pfar, k) \
+	{ \
+		__m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) ((pnear) + (k)))); \
+		__m256i farw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) ((pfar) + (k)))); \
+		out = _mm256_add_epi16(_mm256_slli_epi16(nearw, 2), _mm256_sub_epi16(farw, nearw)); \
+	}
+
+// both passes of stbi__resample_row_hv_2 for samples i to i+15, short of the
+// final shift: even = 3*curr + prev + 8 and odd = 3*curr + next + 8. the
+// neighbors are loaded rather than shifted in, so samples i-1 and i+16 have to
+// exist
+#define stbi__upsample16_avx2(even, odd, pnear, pfar) \
+	{ \
+		__m256i prev, curr, next, curb; \
+		stbi__vert16_avx2(prev, pnear, pfar, i - 1); \
+		stbi__vert16_avx2(curr, pnear, pfar, i); \
+		stbi__vert16_avx2(next, pnear, pfar, i + 1); \
+		curb = _mm256_add_epi16(_mm256_slli_epi16(curr, 2), bias); \
+		even = _mm256_add_epi16(_mm256_sub_epi16(prev, curr), curb); \
+		odd = _mm256_add_epi16(_mm256_sub_epi16(next, curr), curb); \
+	}
+
+// 16 samples at a time. the first and last, which clamp at the ends of the row,
+// are done on their own so every group can load both its neighbors
+static STBI__AVX2_TARGET stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+	int i, t0, t1;
+
+	if (w < 18)
+		return stbi__resample_row_hv_2_simd(out, in_near, in_far, w, hs);
+
+	t0 = 3 * in_near[0] + in_far[0];
+	t1 = 3 * in_near[1] + in_far[1];
+	out[0] = stbi__div4(t0 + 2);
+	out[1] = stbi__div16(3 * t0 + t1 + 8);
+
+	{
+		__m256i bias = _mm256_set1_epi16(8);
+		for (i = 1; i < w - 1; i += 16) {
+			__m256i even, odd;
+			if (i > w - 17) i = w - 17; // the last group overlaps the one before
+			stbi__upsample16_avx2(even, odd, in_near, in_far);
+
+			// the in-lane interleave and pack leave all 32 outputs in order
+			_mm256_storeu_si256((__m256i *) (out + i * 2), _mm256_packus_epi16(
+				_mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4),
+				_mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4)));
+		}
+		_mm256_zeroupper();
+	}
+
+	t0 = 3 * in_near[w - 2] + in_far[w - 2];
+	t1 = 3 * in_near[w - 1] + in_far[w - 1];
+	out[w * 2 - 2] = stbi__div16(3 * t1 + t0 + 8);
+	out[w * 2 - 1] = stbi__div4(t1 + 2);
+
+	STBI_NOTUSED(hs);
+
+	return out;
+}
+
+#ifndef STBI_JPEG_OLD
+// the color transform of stbi__YCbCr_to_RGB_simd on 16 pixels, leaving rw, gw
+// and bw descaled
+#define stbi__transform16_avx2(yw, cbw, crw) \
+	{ \
+		__m256i yws = _mm256_srli_epi16(yw, 4); \
+		__m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw); \
+		__m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw); \
+		__m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1); \
+		__m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1); \
+		rw = _mm256_srai_epi16(_mm256_add_epi16(cr0, yws), 4); \
+		gw = _mm256_srai_epi16(_mm256_add_epi16(_mm256_add_epi16(cb0, yws), cr1), 4); \
+		bw = _mm256_srai_epi16(_mm256_add_epi16(yws, cb1), 4); \
+	}
+
+// the in-lane unpacks split 32 pixels into 0-7 with 16-23 (r0, g0, b0) and 8-15
+// with 24-31 (r1, g1, b1); this interleaves them into RGBA, 8 pixels to each
+// of o0 to o3
+#define stbi__rgba32_avx2(o0, o1, o2, o3, r0, g0, b0, r1, g1, b1) \
+	{ \
+		__m256i t0 = _mm256_unpacklo_epi8(_mm256_packus_epi16(r0, b0), _mm256_packus_epi16(g0, xw)); \
+		__m256i t1 = _mm256_unpackhi_epi8(_mm256_packus_epi16(r0, b0), _mm256_packus_epi16(g0, xw)); \
+		__m256i t2 = _mm256_unpacklo_epi8(_mm256_packus_epi16(r1, b1), _mm256_packus_epi16(g1, xw)); \
+		__m256i t3 = _mm256_unpackhi_epi8(_mm256_packus_epi16(r1, b1), _mm256_packus_epi16(g1, xw)); \
+		__m256i q0 = _mm256_unpacklo_epi16(t0, t1); \
+		__m256i q1 = _mm256_unpackhi_epi16(t0, t1); \
+		__m256i q2 = _mm256_unpacklo_epi16(t2, t3); \
+		__m256i q3 = _mm256_unpackhi_epi16(t2, t3); \
+		o0 = _mm256_permute2x128_si256(q0, q1, 0x20); \
+		o1 = _mm256_permute2x128_si256(q2, q3, 0x20); \
+		o2 = _mm256_permute2x128_si256(q0, q1, 0x31); \
+		o3 = _mm256_permute2x128_si256(q2, q3, 0x31); \
+	}
+
+#define stbi__YCbCr_consts_avx2 \
+	__m256i cr_const0 = _mm256_set1_epi16((short)(1.40200f*4096.0f + 0.5f)); \
+	__m256i cr_const1 = _mm256_set1_epi16(-(short)(0.71414f*4096.0f + 0.5f)); \
+	__m256i cb_const0 = _mm256_set1_epi16(-(short)(0.34414f*4096.0f + 0.5f)); \
+	__m256i cb_const1 = _mm256_set1_epi16((short)(1.77200f*4096.0f + 0.5f)); \
+	__m256i y_bias = _mm256_set1_epi8((char)(unsigned char)128)
+
+// 32 pixels at a time, the rest go to stbi__YCbCr_to_RGB_simd
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+	int i = 0;
+
+	// only step == 4, as with SSE2
+	if (step == 4) {
+		stbi__YCbCr_consts_avx2;
+		__m256i signflip = _mm256_set1_epi8(-0x80);
+		__m256i zero = _mm256_setzero_si256();
+		__m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+		for (; i + 31 < count; i += 32) {
+			__m256i rw, gw, bw, rw0, gw0, bw0, o0, o1, o2, o3;
+			__m256i y_bytes = _mm256_loadu_si256((const __m256i *) (y + i));
+			__m256i cr_biased = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (pcr + i)), signflip); // -128
+			__m256i cb_biased = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (pcb + i)), signflip); // -128
+			stbi__transform16_avx2(_mm256_unpacklo_epi8(y_bias, y_bytes), _mm256_unpacklo_epi8(zero, cb_biased), _mm256_unpacklo_epi8(zero, cr_biased));
+			rw0 = rw, gw0 = gw, bw0 = bw;
+			stbi__transform16_avx2(_mm256_unpackhi_epi8(y_bias, y_bytes), _mm256_unpackhi_epi8(zero, cb_biased), _mm256_unpackhi_epi8(zero, cr_biased));
+			stbi__rgba32_avx2(o0, o1, o2, o3, rw0, gw0, bw0, rw, gw, bw);
+			_mm256_storeu_si256((__m256i *) (out + 0), o0);
+			_mm256_storeu_si256((__m256i *) (out + 32), o1);
+			_mm256_storeu_si256((__m256i *) (out + 64), o2);
+			_mm256_storeu_si256((__m256i *) (out + 96), o3);
+			out += 128;
+		}
+		_mm256_zeroupper();
+	}
+
+	if (i < count)
+		stbi__YCbCr_to_RGB_simd(out, y + i, pcb + i, pcr + i, count - i, step);
+}
+
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_planar_avx2(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count)
+{
+	int i = 0;
+
+	if (count >= 32) {
+		stbi__YCbCr_consts_avx2;
+		__m256i signflip = _mm256_set1_epi8(-0x80);
+		__m256i zero = _mm256_setzero_si256();
+
+		for (; i + 31 < count; i += 32) {
+			__m256i rw, gw, bw, rw0, gw0, bw0;
+			__m256i y_bytes = _mm256_loadu_si256((const __m256i *) (y + i));
+			__m256i cr_biased = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (pcr + i)), signflip); // -128
+			__m256i cb_biased = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (pcb + i)), signflip); // -128
+			stbi__transform16_avx2(_mm256_unpacklo_epi8(y_bias, y_bytes), _mm256_unpacklo_epi8(zero, cb_biased), _mm256_unpacklo_epi8(zero, cr_biased));
+			rw0 = rw, gw0 = gw, bw0 = bw;
+			stbi__transform16_avx2(_mm256_unpackhi_epi8(y_bias, y_bytes), _mm256_unpackhi_epi8(zero, cb_biased), _mm256_unpackhi_epi8(zero, cr_biased));
+
+			// packing the two halves back together puts the pixels in order
+			_mm256_storeu_si256((__m256i *) (pr + i), _mm256_packus_epi16(rw0, rw));
+			_mm256_storeu_si256((__m256i *) (pg + i), _mm256_packus_epi16(gw0, gw));
+			_mm256_storeu_si256((__m256i *) (pb + i), _mm256_packus_epi16(bw0, bw));
+		}
+		_mm256_zeroupper();
+	}
+
+	if (i < count)
+		stbi__YCbCr_to_RGB_planar_simd(pr + i, pg + i, pb + i, y + i, pcb + i, pcr + i, count - i);
+}
+
+// 32 pixels from 16 chroma samples at a time, loading neighbors the same way
+// as stbi__resample_row_hv_2_avx2; short rows and odd steps go to
+// stbi__YCbCr_upsample_to_RGB_simd
+static STBI__AVX2_TARGET void stbi__YCbCr_upsample_to_RGB_avx2(stbi_uc *pr, stbi_uc *pg, stbi_uc *pb, stbi_uc *pa, int step, stbi_uc const *y, stbi_uc const *cb_near, stbi_uc const *cb_far, stbi_uc const *cr_near, stbi_uc const *cr_far, int count)
+{
+	int w = (count + 1) >> 1;
+	stbi_uc const *cbf = cb_far ? cb_far : cb_near;
+	stbi_uc const *crf = cr_far ? cr_far : cr_near;
+	int i;
+
+	if (w < 18 || !(step == 1 || step == 3 || (step == 4 && pa))) {
+		stbi__YCbCr_upsample_to_RGB_simd(pr, pg, pb, pa, step, y, cb_near, cb_far, cr_near, cr_far, count);
+		return;
+	}
+
+	stbi__YCbCr_upsample_to_RGB_from(pr, pg, pb, pa, step, y, cb_near, cb_far, cr_near, cr_far, 0, 2, count);
+
+	{
+		stbi__YCbCr_consts_avx2;
+		__m256i bias = _mm256_set1_epi16(8);
+		__m256i c128 = _mm256_set1_epi16(128);
+		__m256i xw = _mm256_set1_epi16(255); // alpha channel
+		// keeps the low 3 bytes of each pixel, then closes the gap between lanes
+		__m256i rgb = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		__m256i rgb_gap = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+		__m256i rgb_last = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+
+		for (i = 1; i < w - 1; i += 16) {
+			__m256i cbe, cbo, cre, cro, cbw0, cbw1, crw0, crw1;
+			__m256i rw, gw, bw, rw0, gw0, bw0, o0, o1, o2, o3;
+			__m256i y_bytes;
+			int x;
+			if (i > w - 17) i = w - 17; // the last group overlaps the one before
+			x = i * 2;
+			y_bytes = _mm256_loadu_si256((const __m256i *) (y + x));
+			stbi__upsample16_avx2(cbe, cbo, cb_near, cbf);
+			stbi__upsample16_avx2(cre, cro, cr_near, crf);
+
+			// interleaving the phases lines them up with the in-lane unpacks of
+			// y; then (c - 128) << 8 for the transform
+			cbw0 = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_srli_epi16(_mm256_unpacklo_epi16(cbe, cbo), 4), c128), 8);
+			cbw1 = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_srli_epi16(_mm256_unpackhi_epi16(cbe, cbo), 4), c128), 8);
+			crw0 = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_srli_epi16(_mm256_unpacklo_epi16(cre, cro), 4), c128), 8);
+			crw1 = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_srli_epi16(_mm256_unpackhi_epi16(cre, cro), 4), c128), 8);
+			stbi__transform16_avx2(_mm256_unpacklo_epi8(y_bias, y_bytes), cbw0, crw0);
+			rw0 = rw, gw0 = gw, bw0 = bw;
+			stbi__transform16_avx2(_mm256_unpackhi_epi8(y_bias, y_bytes), cbw1, crw1);
+
+			if (step == 1) {
+				_mm256_storeu_si256((__m256i *) (pr + x), _mm256_packus_epi16(rw0, rw));
+				_mm256_storeu_si256((__m256i *) (pg + x), _mm256_packus_epi16(gw0, gw));
+				_mm256_storeu_si256((__m256i *) (pb + x), _mm256_packus_epi16(bw0, bw));
+				continue;
+			}
+
+			stbi__rgba32_avx2(o0, o1, o2, o3, rw0, gw0, bw0, rw, gw, bw);
+			if (step == 4) {
+				_mm256_storeu_si256((__m256i *) (pr + x * 4 + 0), o0);
+				_mm256_storeu_si256((__m256i *) (pr + x * 4 + 32), o1);
+				_mm256_storeu_si256((__m256i *) (pr + x * 4 + 64), o2);
+				_mm256_storeu_si256((__m256i *) (pr + x * 4 + 96), o3);
+			}
+			else {
+				// 24 bytes from each; every store but the last runs 8 bytes into
+				// the next one's place, and the last is masked so it doesn't run
+				// past pixels that might not exist
+				_mm256_storeu_si256((__m256i *) (pr + x * 3 + 0), _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(o0, rgb), rgb_gap));
+				_mm256_storeu_si256((__m256i *) (pr + x * 3 + 24), _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(o1, rgb), rgb_gap));
+				_mm256_storeu_si256((__m256i *) (pr + x * 3 + 48), _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(o2, rgb), rgb_gap));
+				_mm256_maskstore_epi32((int *) (pr + x * 3 + 72), rgb_last, _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(o3, rgb), rgb_gap));
+			}
+		}
+		_mm256_zeroupper();
+	}
+
+	stbi__YCbCr_upsample_to_RGB_from(pr, pg, pb, pa, step, y, cb_near, cb_far, cr_near, cr_far, w * 2 - 2, count, count);
+}
+
+#undef stbi__transform16_avx2
+#undef stbi__rgba32_avx2
+#undef stbi__YCbCr_consts_avx2
+#endif // STBI_JPEG_OLD
+
+#undef stbi__vert16_avx2
+#undef stbi__upsample16_avx2
+#endif // STBI_AVX2
 
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+	int i;
 	j->idct_block_kernel = stbi__idct_block;
 	j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
+	j->YCbCr_to_RGB_planar_kernel = stbi__YCbCr_to_RGB_planar_row;
 	j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+	j->YCbCr_upsample_to_RGB_kernel = NULL;
 
 #ifdef STBI_SSE2
 	if (stbi__sse2_available()) {
 		j->idct_block_kernel = stbi__idct_simd;
 #ifndef STBI_JPEG_OLD
 		j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+		j->YCbCr_to_RGB_planar_kernel = stbi__YCbCr_to_RGB_planar_simd;
+		j->YCbCr_upsample_to_RGB_kernel = stbi__YCbCr_upsample_to_RGB_simd;
 #endif
 		j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 	}
 #endif
 
+#ifdef STBI_AVX2
+	if (stbi__avx2_available()) {
+		j->idct_block_kernel = stbi__idct_avx2;
+#ifndef STBI_JPEG_OLD
+		j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+		j->YCbCr_to_RGB_planar_kernel = stbi__YCbCr_to_RGB_planar_avx2;
+		j->YCbCr_upsample_to_RGB_kernel = stbi__YCbCr_upsample_to_RGB_avx2;
+#endif
+		j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+	}
+#endif
+
 #ifdef STBI_NEON
 	j->idct_block_kernel = stbi__idct_simd;
 #ifndef STBI_JPEG_OLD
 	j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+	j->YCbCr_to_RGB_planar_kernel = stbi__YCbCr_to_RGB_planar_simd;
+	j->YCbCr_upsample_to_RGB_kernel = stbi__YCbCr_upsample_to_RGB_simd;
 #endif
 	j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+	j->scale_shift = 0;
+	j->block_size = 8;
+	for (i = 0; i < 4; ++i) {
+		j->img_comp[i].bx0 = j->img_comp[i].by0 = 0;
+		j->img_comp[i].bx1 = j->img_comp[i].by1 = 0x7fffffff;
+	}
+	j->output = NULL;
+	j->rows_converted = 0;
+	j->preview = NULL;
+}
+
+// decode at 1/(1<<shift) size; the blocks are still entropy-decoded in full,
+// only the IDCT and the size of the component buffers change
+static void stbi__jpeg_set_scale(stbi__jpeg *j, int shift)
+{
+	static void(*const reduced[4])(stbi_uc *out, int out_stride, short data[64]) = {
+		NULL, stbi__idct_block_4x4, stbi__idct_block_2x2, stbi__idct_block_1x1
+	};
+	j->scale_shift = shift;
+	j->block_size = 8 >> shift;
+	if (shift)
+		j->idct_block_kernel = reduced[shift];
 }
 
 // clean up the temporary component buffers
@@ -3321,113 +5615,1054 @@ static void stbi__cleanup_jpeg(stbi__jpeg *j)
 	}
 }
 
-typedef struct
+typedef struct
+{
+	resample_row_func resample;
+	stbi_uc *line0, *line1;
+	int hs, vs;   // expansion factor in each axis
+	int w_lores; // horizontal pixels pre-expansion
+	int ystep;   // how far through vertical expansion we are
+	int ypos;    // which pre-expansion row we're on
+} stbi__resample;
+
+// with 'planar' set, the image is written to its planes and the returned pointer is only
+// meaningful as a success flag
+// the output of load_jpeg_image, and how each component is resampled into it
+typedef struct stbi__jpeg_output_s
+{
+	stbi__uint32 img_x, img_y; // rounded up when decoding scaled
+	int n, decode_n, req_comp;
+	stbi__planar *planar;
+	stbi_uc *output;
+	stbi__resample res_comp[4]; // line0/line1/ystep/ypos aren't used
+	int fuse; // Cb and Cr are upsampled as they're converted, by YCbCr_upsample_to_RGB_kernel
+} stbi__jpeg_output;
+
+// once the frame header is known: works out the output and allocates it
+static int stbi__jpeg_begin_output(stbi__jpeg *z)
+{
+	stbi__jpeg_output *o = z->output;
+	int k;
+
+	o->img_x = (z->s->img_x + (1 << z->scale_shift) - 1) >> z->scale_shift;
+	o->img_y = (z->s->img_y + (1 << z->scale_shift) - 1) >> z->scale_shift;
+
+	if (o->planar && !stbi__planar_fits(o->planar, o->img_x, o->img_y))
+		return stbi__planar_misfit(o->planar);
+
+	// determine actual number of components to generate
+	o->n = o->req_comp ? o->req_comp : z->s->img_n;
+
+	if (z->s->img_n == 3 && o->n < 3)
+		o->decode_n = 1;
+	else
+		o->decode_n = z->s->img_n;
+
+	for (k = 0; k < o->decode_n; ++k) {
+		stbi__resample *r = &o->res_comp[k];
+
+		r->hs = z->img_h_max / z->img_comp[k].h;
+		r->vs = z->img_v_max / z->img_comp[k].v;
+		r->w_lores = (o->img_x + r->hs - 1) / r->hs;
+
+		if (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+		else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+		else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+		else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+		else                               r->resample = stbi__resample_row_generic;
+	}
+
+	// a region needs the samples its pixels are resampled from, plus one on
+	// each side for the triangle filters; the other blocks aren't transformed
+	if (o->planar && o->planar->region) {
+		stbi__planar *p = o->planar;
+		int b = z->block_size;
+		for (k = 0; k < z->s->img_n; ++k) {
+			stbi__resample *r = &o->res_comp[k];
+			int x0, x1, y0, y1;
+			if (k >= o->decode_n) {
+				z->img_comp[k].bx0 = z->img_comp[k].bx1 = 0;
+				continue;
+			}
+			x0 = p->x / r->hs - 1;
+			y0 = p->y / r->vs - 1;
+			x1 = (p->x + p->w + r->hs - 1) / r->hs + 1;
+			y1 = (p->y + p->h + r->vs - 1) / r->vs + 1;
+			z->img_comp[k].bx0 = x0 > 0 ? x0 / b : 0;
+			z->img_comp[k].by0 = y0 > 0 ? y0 / b : 0;
+			z->img_comp[k].bx1 = (x1 + b - 1) / b;
+			z->img_comp[k].by1 = (y1 + b - 1) / b;
+		}
+	}
+
+	// 4:2:0 and 4:2:2 can skip the chroma line buffers. that only pays off with
+	// SIMD; the scalar loops are quicker apart. it works on whole rows
+	o->fuse = z->YCbCr_upsample_to_RGB_kernel && o->decode_n == 3 &&
+		(!o->planar || o->planar->w == (int)o->img_x) &&
+		o->res_comp[0].hs == 1 && o->res_comp[0].vs == 1 &&
+		o->res_comp[1].hs == 2 && o->res_comp[1].vs <= 2 &&
+		o->res_comp[2].hs == 2 && o->res_comp[2].vs == o->res_comp[1].vs;
+
+	if (o->planar)
+		o->output = o->planar->plane[0];
+	else
+		o->output = (stbi_uc *)stbi__malloc(o->n * o->img_x * o->img_y + 1);
+	if (!o->output) return stbi__err("outofmem", "Out of memory");
+	return 1;
+}
+
+// planes are there from the start, so they can be checked, and a region's
+// blocks picked, before anything is decoded
+static int stbi__jpeg_begin_planar(stbi__jpeg *z)
+{
+	if (!z->output || !z->output->planar || z->output->output) return 1;
+	return stbi__jpeg_begin_output(z);
+}
+
+// resamples and color-converts output rows [j0, j1); linebuf holds one
+// img_x+3 byte line buffer per component, for upsampling off the edges.
+// planes holding a region only get its rows, and only its columns are
+// resampled (with a sample either side, so they come out as in the whole
+// image) and converted
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__uint32 j0, stbi__uint32 j1, stbi_uc **linebuf)
+{
+	stbi__jpeg_output *o = z->output;
+	stbi__planar *pl = o->planar;
+	stbi__uint32 img_x = o->img_x;
+	stbi__uint32 rx = 0, ry = 0, rw = img_x;
+	int n = o->n, k;
+	unsigned int i, j;
+	stbi_uc *coutput[4];
+	stbi__resample res_comp[4];
+	int lx[4], off[4]; // first sample resampled, and where rx lands in the result
+
+	if (pl) {
+		rx = pl->x;
+		ry = pl->y;
+		rw = pl->w;
+		if (j0 < ry) j0 = ry;
+		if (j1 > ry + pl->h) j1 = ry + pl->h;
+		if (j0 >= j1) return;
+	}
+
+	// the resampler state after j0 rows, as if they'd all been stepped through
+	for (k = 0; k < o->decode_n; ++k) {
+		stbi__resample *r = &res_comp[k];
+		int rows = (z->img_comp[k].y + (1 << z->scale_shift) - 1) >> z->scale_shift;
+		int steps = (o->res_comp[k].vs >> 1) + (int)j0;
+		int lines = steps / o->res_comp[k].vs;
+		int lx1;
+		*r = o->res_comp[k];
+		lx[k] = (int)rx / r->hs - 1;
+		if (lx[k] < 0) lx[k] = 0;
+		lx1 = (int)(rx + rw + r->hs - 1) / r->hs + 1;
+		if (lx1 > r->w_lores) lx1 = r->w_lores;
+		r->w_lores = lx1 - lx[k];
+		off[k] = (int)rx - lx[k] * r->hs;
+		r->ystep = steps % r->vs;
+		r->ypos = lines;
+		r->line1 = z->img_comp[k].data + z->img_comp[k].w2 * (lines < rows - 1 ? lines : rows - 1);
+		r->line0 = lines ? z->img_comp[k].data + z->img_comp[k].w2 * (lines - 1 < rows - 1 ? lines - 1 : rows - 1) : z->img_comp[k].data;
+	}
+
+	for (j = j0; j < j1; ++j) {
+		stbi_uc *out = o->output + n * img_x * j;
+		stbi_uc *in_near[4], *in_far[4];
+		for (k = 0; k < o->decode_n; ++k) {
+			stbi__resample *r = &res_comp[k];
+			int y_bot = r->ystep >= (r->vs >> 1);
+			in_near[k] = (y_bot ? r->line1 : r->line0) + lx[k];
+			in_far[k] = (y_bot ? r->line0 : r->line1) + lx[k];
+			if (k == 0 || !o->fuse)
+				coutput[k] = r->resample(linebuf[k], in_near[k], in_far[k], r->w_lores, r->hs) + off[k];
+			if (++r->ystep >= r->vs) {
+				r->ystep = 0;
+				r->line0 = r->line1;
+				if (++r->ypos < (z->img_comp[k].y + (1 << z->scale_shift) - 1) >> z->scale_shift)
+					r->line1 += z->img_comp[k].w2;
+			}
+		}
+		if (o->fuse) {
+			stbi_uc *pr = out, *pg = out + 1, *pb = out + 2, *pa = n == 4 ? out + 3 : NULL;
+			int step = n, blend;
+			if (pl) {
+				pr = pl->plane[0] + (int)(j - ry) * pl->stride[0];
+				pg = pl->plane[1] + (int)(j - ry) * pl->stride[1];
+				pb = pl->plane[2] + (int)(j - ry) * pl->stride[2];
+				pa = NULL;
+				step = 1;
+				if (n == 4)
+					memset(pl->plane[3] + (int)(j - ry) * pl->stride[3], 255, img_x);
+			}
+			// without vertical blending, far is whatever row came before
+			blend = res_comp[1].vs == 2;
+			z->YCbCr_upsample_to_RGB_kernel(pr, pg, pb, pa, step, coutput[0],
+				in_near[1], blend ? in_far[1] : NULL, in_near[2], blend ? in_far[2] : NULL, img_x);
+			continue;
+		}
+		if (pl) {
+			stbi_uc *p[4];
+			stbi_uc *y = coutput[0];
+			for (k = 0; k < n; ++k)
+				p[k] = pl->plane[k] + (int)(j - ry) * pl->stride[k];
+			if (n >= 3 && z->s->img_n == 3)
+				z->YCbCr_to_RGB_planar_kernel(p[0], p[1], p[2], y, coutput[1], coutput[2], rw);
+			else
+				for (k = 0; k < (n < 3 ? 1 : 3); ++k)
+					memcpy(p[k], y, rw);
+			if (n == 2 || n == 4)
+				memset(p[n - 1], 255, rw);
+		}
+		else if (n >= 3) {
+			stbi_uc *y = coutput[0];
+			if (z->s->img_n == 3) {
+				z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], img_x, n);
+			}
+			else
+				for (i = 0; i < img_x; ++i) {
+					out[0] = out[1] = out[2] = y[i];
+					if (n == 4) out[3] = 255;
+					out += n;
+				}
+		}
+		else {
+			stbi_uc *y = coutput[0];
+			if (n == 1)
+				for (i = 0; i < img_x; ++i) out[i] = y[i];
+			else
+				for (i = 0; i < img_x; ++i) *out++ = y[i], *out++ = 255;
+		}
+	}
+}
+
+// without restart intervals to split at, entropy decoding is serial, but the
+// IDCT and colour conversion can overlap with it. the scan is cut into chunks
+// of MCU rows, and in each phase one task decodes chunk p to coefficients
+// while the others IDCT chunk p-1 and convert the output rows that chunk p-2
+// completed. a phase ends when the runner returns, so tasks never wait on one
+// another and a runner that runs them one after another still works
+#define STBI__PIPELINE_CHUNKS  32
+
+typedef struct
+{
+	stbi__jpeg *z;
+	int mcus_x, mcu_rows;
+	int blocks_per_mcu;
+	int chunk_rows, num_chunks;
+	short *coeff[2];        // two chunks' worth of dequantized blocks
+	int chunk_end[2];       // MCUs actually decoded into each
+	int phase;
+	int stopped;            // the serial decoder would have stopped here
+	int failed;
+	const char *failure;
+	int num_tasks;
+	stbi_uc **linebuf;      // decode_n per task
+	stbi__uint32 convert_from, convert_to;
+} stbi__jpeg_pipeline;
+
+static void stbi__jpeg_pipeline_entropy(stbi__jpeg_pipeline *p, int c)
+{
+	stbi__jpeg *z = p->z;
+	short *data = p->coeff[c & 1];
+	int m = c * p->chunk_rows * p->mcus_x;
+	int end = (c + 1) * p->chunk_rows < p->mcu_rows ? (c + 1) * p->chunk_rows * p->mcus_x : p->mcu_rows * p->mcus_x;
+	int k, x, y;
+
+	p->chunk_end[c & 1] = m;
+	if (p->stopped) return;
+
+	for (; m < end; ++m) {
+		for (k = 0; k < z->scan_n; ++k) {
+			int n = z->order[k];
+			int ha = z->img_comp[n].ha;
+			int h = z->scan_n == 1 ? 1 : z->img_comp[n].h;
+			int v = z->scan_n == 1 ? 1 : z->img_comp[n].v;
+			for (y = 0; y < v; ++y) {
+				for (x = 0; x < h; ++x) {
+					if (!stbi__jpeg_decode_block(z, data, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) {
+						p->failure = stbi__g_failure_reason;
+						p->failed = 1;
+						return;
+					}
+					data += 64;
+				}
+			}
+		}
+		p->chunk_end[c & 1] = m + 1;
+		if (--z->todo <= 0) {
+			if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+			if (!STBI__RESTART(z->marker)) {
+				p->stopped = 1;
+				return;
+			}
+			stbi__jpeg_reset(z);
+		}
+	}
+}
+
+static void stbi__jpeg_pipeline_idct(stbi__jpeg_pipeline *p, int c, int worker, int workers)
+{
+	stbi__jpeg *z = p->z;
+	int first = c * p->chunk_rows * p->mcus_x;
+	int count = p->chunk_end[c & 1] - first;
+	int m = first + (int)((double)count * worker / workers);
+	int end = first + (int)((double)count * (worker + 1) / workers);
+	short *data = p->coeff[c & 1] + (m - first) * p->blocks_per_mcu * 64;
+	int k, x, y;
+
+	for (; m < end; ++m) {
+		int i = m % p->mcus_x, j = m / p->mcus_x;
+		for (k = 0; k < z->scan_n; ++k) {
+			int n = z->order[k];
+			int h = z->scan_n == 1 ? 1 : z->img_comp[n].h;
+			int v = z->scan_n == 1 ? 1 : z->img_comp[n].v;
+			for (y = 0; y < v; ++y) {
+				for (x = 0; x < h; ++x) {
+					int x2 = (i*h + x) * z->block_size;
+					int y2 = (j*v + y) * z->block_size;
+					if (stbi__jpeg_block_wanted(z, n, i*h + x, j*v + y))
+						z->idct_block_kernel(z->img_comp[n].data + z->img_comp[n].w2*y2 + x2, z->img_comp[n].w2, data);
+					data += 64;
+				}
+			}
+		}
+	}
+}
+
+static void stbi__jpeg_pipeline_task(void *arg, int task)
+{
+	stbi__jpeg_pipeline *p = (stbi__jpeg_pipeline *)arg;
+	int workers = p->num_tasks, worker = task;
+
+	if (p->phase < p->num_chunks) {
+		if (task == 0) {
+			stbi__jpeg_pipeline_entropy(p, p->phase);
+			return;
+		}
+		--workers;
+		--worker;
+	}
+	if (p->phase >= 1 && p->phase - 1 < p->num_chunks)
+		stbi__jpeg_pipeline_idct(p, p->phase - 1, worker, workers);
+	if (p->convert_to > p->convert_from) {
+		stbi__uint32 count = p->convert_to - p->convert_from;
+		stbi__uint32 j0 = p->convert_from + (stbi__uint32)((double)count * worker / workers);
+		stbi__uint32 j1 = p->convert_from + (stbi__uint32)((double)count * (worker + 1) / workers);
+		stbi__jpeg_convert_rows(p->z, j0, j1, p->linebuf + task * p->z->output->decode_n);
+	}
+}
+
+// output rows whose every resampled input line is in the first mcu_rows_done
+// MCU rows. an MCU row holds v block rows of each component, or a single one
+// if the scan isn't interleaved
+static stbi__uint32 stbi__jpeg_ready_rows(stbi__jpeg *z, int mcu_rows_done, int interleaved)
+{
+	stbi__jpeg_output *o = z->output;
+	stbi__uint32 ready = o->img_y;
+	int k;
+
+	for (k = 0; k < o->decode_n; ++k) {
+		int rows = (z->img_comp[k].y + (1 << z->scale_shift) - 1) >> z->scale_shift;
+		int done = mcu_rows_done * (interleaved ? z->img_comp[k].v : 1) * z->block_size;
+		int vs = o->res_comp[k].vs;
+		int j = done * vs - (vs >> 1);
+		if (done >= rows) continue;
+		if (j < 0) j = 0;
+		if ((stbi__uint32)j < ready) ready = j;
+	}
+	return ready;
+}
+
+// returns -1 if the scan should be decoded the usual way instead
+static int stbi__jpeg_pipelined_entropy_coded_data(stbi__jpeg *z)
+{
+	stbi__jpeg_pipeline p;
+	void *raw_coeff[2] = { NULL, NULL };
+	size_t chunk_bytes;
+	int k, ok = 1, linebufs = 0;
+	stbi_uc *linebuf_block = NULL;
+
+	if (stbi__parallel_width() < 2 || z->progressive)
+		return -1;
+	// the scan has to hold every component, so finished rows are final
+	if (z->scan_n != z->s->img_n)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	p.z = z;
+	if (z->scan_n == 1) {
+		int n = z->order[0];
+		p.mcus_x = (z->img_comp[n].x + 7) >> 3;
+		p.mcu_rows = (z->img_comp[n].y + 7) >> 3;
+		p.blocks_per_mcu = 1;
+	}
+	else {
+		p.mcus_x = z->img_mcu_x;
+		p.mcu_rows = z->img_mcu_y;
+		for (k = 0; k < z->scan_n; ++k)
+			p.blocks_per_mcu += z->img_comp[z->order[k]].h * z->img_comp[z->order[k]].v;
+	}
+	if (p.mcus_x * p.mcu_rows < STBI__PARALLEL_MIN_MCUS || p.mcu_rows < 4)
+		return -1;
+
+	p.chunk_rows = (p.mcu_rows + STBI__PIPELINE_CHUNKS - 1) / STBI__PIPELINE_CHUNKS;
+	p.num_chunks = (p.mcu_rows + p.chunk_rows - 1) / p.chunk_rows;
+	p.num_tasks = stbi__parallel_threads;
+
+	chunk_bytes = (size_t)p.chunk_rows * p.mcus_x * p.blocks_per_mcu * 64 * sizeof(short);
+	for (k = 0; k < 2; ++k) {
+		raw_coeff[k] = stbi__malloc(chunk_bytes + 15);
+		if (!raw_coeff[k]) ok = 0;
+		else p.coeff[k] = (short *)(((size_t)raw_coeff[k] + 15) & ~15);
+	}
+	if (ok && z->output) {
+		if (!z->output->output && !stbi__jpeg_begin_output(z)) {
+			STBI_FREE(raw_coeff[0]);
+			STBI_FREE(raw_coeff[1]);
+			return 0;
+		}
+		linebufs = p.num_tasks * z->output->decode_n;
+		p.linebuf = (stbi_uc **)stbi__malloc(linebufs * sizeof(stbi_uc *));
+		linebuf_block = (stbi_uc *)stbi__malloc((size_t)linebufs * (z->output->img_x + 3));
+		if (!p.linebuf || !linebuf_block) ok = 0;
+		else
+			for (k = 0; k < linebufs; ++k)
+				p.linebuf[k] = linebuf_block + (size_t)k * (z->output->img_x + 3);
+	}
+	if (!ok) {
+		// not enough memory to pipeline; maybe enough to decode serially
+		STBI_FREE(raw_coeff[0]);
+		STBI_FREE(raw_coeff[1]);
+		STBI_FREE(p.linebuf);
+		STBI_FREE(linebuf_block);
+		return -1;
+	}
+
+	stbi__jpeg_reset(z);
+	for (p.phase = 0; p.phase < p.num_chunks + 2; ++p.phase) {
+		if (z->output) {
+			int chunks_done = p.phase >= 1 ? p.phase - 1 : 0;
+			p.convert_from = z->rows_converted;
+			p.convert_to = stbi__jpeg_ready_rows(z, chunks_done * p.chunk_rows, z->scan_n != 1);
+		}
+		stbi__parallel_runner(stbi__parallel_user, stbi__jpeg_pipeline_task, &p, p.num_tasks);
+		if (p.failed) {
+			// the reason was recorded on whichever thread decoded the chunk
+			stbi__g_failure_reason = p.failure;
+			ok = 0;
+			break;
+		}
+		if (z->output)
+			z->rows_converted = p.convert_to;
+	}
+
+	STBI_FREE(raw_coeff[0]);
+	STBI_FREE(raw_coeff[1]);
+	STBI_FREE(p.linebuf);
+	STBI_FREE(linebuf_block);
+	return ok;
+}
+
+// without restart markers the scan can still be split: Huffman codes
+// resynchronize, so a decoder started at an arbitrary byte soon falls into
+// step with the real bit stream. with enough threads the scan is cut into
+// chunks of bytes and decoded in two parallel passes:
+//  1. every chunk but the last is skimmed (symbols only, no coefficients)
+//     from its first byte as if an MCU started there, noting where its
+//     first blocks begin and where it crosses into the next chunk
+//  2. serially, the true path is followed from where the previous chunk
+//     crossed over until it meets one of this chunk's block starts, with
+//     the same block of the MCU due; from there on the skim was right, so
+//     its crossing point (and the DC predictions, counted as sums of the
+//     differences) carries over. failing that, the true path is skimmed
+//     through the whole chunk. this also finds the first MCU each chunk
+//     really starts
+//  3. each chunk's MCUs are decoded for real from there
+// any error falls back to the serial decoder, so corrupt files come out
+// exactly as they would without a parallel runner
+#ifndef STBI__SPECULATE_MIN_CHUNK  // (a test can shrink it to split small files)
+#define STBI__SPECULATE_MIN_CHUNK  65536  // bytes of scan per chunk, at least
+#endif
+#define STBI__SPECULATE_STARTS     4096   // block starts noted per chunk
+#define STBI__SPECULATE_MAX_UNITS  32
+
+// a point between two blocks on a decoder's path
+typedef struct
+{
+	size_t pos;           // bit offset into the scan's bytes
+	int count;            // blocks before it
+	unsigned int dc[4];   // per component, the sum of the DC differences before it
+} stbi__jpeg_sync;
+
+typedef struct
+{
+	stbi_uc *start, *end;     // the chunk's bytes
+	stbi__jpeg_sync *starts;  // the skim's first block starts
+	int num_starts;
+	stbi__jpeg_sync exit;     // the skim's first block start in the next chunk
+	int has_exit;
+	stbi__jpeg_sync entry;    // the true path's first MCU in the chunk
+} stbi__jpeg_speculation;
+
+typedef struct
+{
+	stbi__jpeg *z;
+	stbi_uc *start, *end;     // the entropy-coded bytes
+	int num_mcus, num_blocks;
+	int units;                // blocks per MCU
+	int unit_comp[STBI__SPECULATE_MAX_UNITS];
+	int num_chunks;
+	stbi__jpeg_speculation *chunk;
+	int *failed;              // per chunk
+	stbi_uc *tail;            // where reading stopped after the last MCU
+	unsigned char tail_marker;
+	stbi_uc **linebuf;        // decode_n per chunk, if the rows are converted here
+} stbi__jpeg_speculative;
+
+// the bit z reads next. the whole bytes it has buffered are walked back over,
+// skipping the zero stuffed after each 0xff; past the end of the scan (where
+// zeros are made up) there's no telling, so that's as far as can be
+static size_t stbi__jpeg_bit_pos(stbi__jpeg_speculative *p, stbi__jpeg *z)
+{
+	stbi_uc *q = z->s->img_buffer;
+	int n = (z->code_bits + 7) >> 3;
+	if (q >= p->end) return (size_t)-1;
+	while (n--) {
+		--q;
+		if (*q == 0 && q > p->start && q[-1] == 0xff) --q;
+	}
+	return (size_t)(q - p->start) * 8 + ((8 - (z->code_bits & 7)) & 7);
+}
+
+static void stbi__jpeg_seek_bits(stbi__jpeg_speculative *p, stbi__jpeg *z, size_t pos, stbi_uc *end)
+{
+	z->s->img_buffer = p->start + pos / 8;
+	z->s->img_buffer_end = end;
+	stbi__jpeg_reset(z);
+	stbi__grow_buffer_unsafe(z);
+	z->code_buffer <<= pos & 7;
+	z->code_bits -= (int)(pos & 7);
+}
+
+// reads a block's symbols like stbi__jpeg_decode_block, but keeps nothing
+// except the DC difference, and fails quietly
+static int stbi__jpeg_skim_block(stbi__jpeg *j, stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int *diff)
+{
+	int k = 1, t;
+
+	if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+	t = stbi__jpeg_huff_decode(j, hdc);
+	if (t < 0 || t > 15) return 0;
+	*diff = t ? stbi__extend_receive(j, t) : 0;
+
+	do {
+		int c, r, s;
+		if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+		c = stbi__jpeg_peek(j, FAST_BITS);
+		r = fac[c];
+		if (r) {
+			k += ((r >> 4) & 15) + 1;
+			s = r & 15;
+		}
+		else {
+			int rs = stbi__jpeg_huff_decode(j, hac);
+			if (rs < 0) return 0;
+			s = rs & 15;
+			if (s == 0) {
+				if (rs != 0xf0) break;
+				k += 16;
+				continue;
+			}
+			k += (rs >> 4) + 1;
+			if (j->code_bits < s) stbi__grow_buffer_unsafe(j);
+		}
+		j->code_buffer <<= s;
+		j->code_bits -= s;
+	} while (k < 64);
+	return 1;
+}
+
+static int stbi__jpeg_skim_unit(stbi__jpeg_speculative *p, stbi__jpeg *z, stbi__jpeg_sync *at)
+{
+	int n = p->unit_comp[at->count % p->units];
+	int ha = z->img_comp[n].ha, diff;
+	if (!stbi__jpeg_skim_block(z, z->huff_dc + z->img_comp[n].hd, z->huff_ac + ha, z->fast_ac[ha], &diff))
+		return 0;
+	at->dc[n] += (unsigned int)diff;
+	++at->count;
+	return 1;
+}
+
+// a decoder of its own, reading the scan through a context of its own
+static stbi__jpeg *stbi__jpeg_speculative_decoder(stbi__jpeg_speculative *p, stbi__context *s)
+{
+	stbi__jpeg *z = (stbi__jpeg *)stbi__malloc(sizeof(stbi__jpeg));
+	if (!z) return NULL;
+	*z = *p->z;
+	memset(s, 0, sizeof(*s));
+	z->s = s;
+	return z;
+}
+
+static void stbi__jpeg_skim_task(void *arg, int i)
+{
+	stbi__jpeg_speculative *p = (stbi__jpeg_speculative *)arg;
+	stbi__jpeg_speculation *c = &p->chunk[i];
+	size_t next = (size_t)(c->end - p->start) * 8;
+	stbi__context s;
+	stbi__jpeg *z = stbi__jpeg_speculative_decoder(p, &s);
+	stbi__jpeg_sync at;
+
+	c->num_starts = 0;
+	c->has_exit = 0;
+	if (!z) return;
+	memset(&at, 0, sizeof(at));
+	stbi__jpeg_seek_bits(p, z, (size_t)(c->start - p->start) * 8, p->end);
+	for (;;) {
+		if ((i > 0 && c->num_starts < STBI__SPECULATE_STARTS) || s.img_buffer >= c->end) {
+			at.pos = stbi__jpeg_bit_pos(p, z);
+			if (at.pos >= next) {
+				c->exit = at;
+				c->has_exit = 1;
+				break;
+			}
+			if (i > 0 && c->num_starts < STBI__SPECULATE_STARTS)
+				c->starts[c->num_starts++] = at;
+		}
+		if (!stbi__jpeg_skim_unit(p, z, &at)) break;
+	}
+	STBI_FREE(z);
+}
+
+// follows the true path from 'from', the first block start at or after chunk
+// i's first byte, to the first one at or after chunk i+1's, and to chunk i's
+// first MCU on the way
+static int stbi__jpeg_bridge(stbi__jpeg_speculative *p, stbi__jpeg *d, int i, stbi__jpeg_sync *from)
+{
+	stbi__jpeg_speculation *c = &p->chunk[i];
+	int last = i == p->num_chunks - 1;
+	size_t next = last ? (size_t)-1 : (size_t)(c->end - p->start) * 8;
+	stbi__jpeg_sync at = *from;
+	int have_entry = 0, synced = last, seeked = 0, r = 0, k;
+
+	for (;;) {
+		if (at.count >= p->num_blocks) {
+			// the scan ends before this chunk has an MCU of its own
+			if (!have_entry) c->entry = at;
+			*from = at;
+			return 1;
+		}
+		if (!have_entry && at.count % p->units == 0) {
+			c->entry = at;
+			have_entry = 1;
+		}
+		if (!synced) {
+			while (r < c->num_starts && c->starts[r].pos < at.pos) ++r;
+			if (r < c->num_starts && c->starts[r].pos == at.pos && c->starts[r].count % p->units == at.count % p->units) {
+				stbi__jpeg_sync *s = &c->starts[r];
+				// the skim errs from here on, so the true path will
+				if (!c->has_exit) return 0;
+				from->pos = c->exit.pos;
+				from->count = at.count + (c->exit.count - s->count);
+				for (k = 0; k < 4; ++k)
+					from->dc[k] = at.dc[k] + (c->exit.dc[k] - s->dc[k]);
+				synced = 1;
+			}
+			else if (at.pos >= next) {
+				// never fell into step: the whole chunk was skimmed here
+				*from = at;
+				synced = 1;
+			}
+		}
+		if (synced && have_entry) return 1;
+		if (!seeked) {
+			stbi__jpeg_seek_bits(p, d, at.pos, p->end);
+			seeked = 1;
+		}
+		if (!stbi__jpeg_skim_unit(p, d, &at)) return 0;
+		at.pos = stbi__jpeg_bit_pos(p, d);
+	}
+}
+
+static void stbi__jpeg_speculative_decode_task(void *arg, int i)
+{
+	stbi__jpeg_speculative *p = (stbi__jpeg_speculative *)arg;
+	stbi__jpeg_speculation *c = &p->chunk[i];
+	int first = c->entry.count / p->units;
+	int last = i + 1 < p->num_chunks ? p->chunk[i + 1].entry.count / p->units : p->num_mcus;
+	stbi__context s;
+	stbi__jpeg *z;
+	int k;
+
+	p->failed[i] = 0;
+	if (last > p->num_mcus) last = p->num_mcus;
+	if (first >= last) return;
+	p->failed[i] = 1;
+	z = stbi__jpeg_speculative_decoder(p, &s);
+	if (!z) return;
+	// reading on into the marker, as the serial decoder does
+	stbi__jpeg_seek_bits(p, z, c->entry.pos, p->z->s->img_buffer_end);
+	for (k = 0; k < 4; ++k)
+		z->img_comp[k].dc_pred = (int)c->entry.dc[k];
+	if (stbi__jpeg_decode_baseline_mcus(z, first, last)) {
+		p->failed[i] = 0;
+		if (last == p->num_mcus) {
+			p->tail = s.img_buffer;
+			p->tail_marker = z->marker;
+		}
+	}
+	STBI_FREE(z);
+}
+
+static void stbi__jpeg_speculative_convert_task(void *arg, int i)
+{
+	stbi__jpeg_speculative *p = (stbi__jpeg_speculative *)arg;
+	stbi__jpeg *z = p->z;
+	stbi__uint32 rows = z->output->img_y - z->rows_converted;
+	stbi__uint32 j0 = z->rows_converted + (stbi__uint32)((double)rows * i / p->num_chunks);
+	stbi__uint32 j1 = z->rows_converted + (stbi__uint32)((double)rows * (i + 1) / p->num_chunks);
+	stbi__jpeg_convert_rows(z, j0, j1, p->linebuf + i * z->output->decode_n);
+}
+
+// returns -1 if the scan should be decoded another way
+static int stbi__jpeg_speculative_entropy_coded_data(stbi__jpeg *z)
+{
+	stbi__context *s = z->s;
+	stbi__jpeg_speculative p;
+	stbi__jpeg_sync from;
+	stbi__jpeg *d = NULL;
+	stbi__context ds;
+	stbi_uc *pos, *linebuf_block = NULL;
+	size_t len;
+	int i, k, x, y, ok = 1;
+
+	if (stbi__parallel_width() < 3 || z->progressive || z->restart_interval || s->read_from_callbacks)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	p.z = z;
+	if (z->scan_n == 1) {
+		int n = z->order[0];
+		p.num_mcus = ((z->img_comp[n].x + 7) >> 3) * ((z->img_comp[n].y + 7) >> 3);
+		p.units = 1;
+		p.unit_comp[0] = n;
+	}
+	else {
+		p.num_mcus = z->img_mcu_x * z->img_mcu_y;
+		for (k = 0; k < z->scan_n; ++k) {
+			int n = z->order[k];
+			for (y = 0; y < z->img_comp[n].v; ++y)
+				for (x = 0; x < z->img_comp[n].h; ++x) {
+					if (p.units == STBI__SPECULATE_MAX_UNITS) return -1;
+					p.unit_comp[p.units++] = n;
+				}
+		}
+	}
+	if (p.num_mcus < STBI__PARALLEL_MIN_MCUS)
+		return -1;
+	p.num_blocks = p.num_mcus * p.units;
+
+	// the scan runs to the first marker
+	p.start = pos = s->img_buffer;
+	for (;;) {
+		pos = (stbi_uc *)memchr(pos, 0xff, s->img_buffer_end - pos);
+		if (!pos || pos + 1 >= s->img_buffer_end) {
+			pos = s->img_buffer_end;
+			break;
+		}
+		if (pos[1] != 0) break;
+		pos += 2;
+	}
+	p.end = pos;
+	len = p.end - p.start;
+	if (len / STBI__SPECULATE_MIN_CHUNK < 3 || len > (size_t)-1 / 16)
+		return -1;
+	p.num_chunks = len / STBI__SPECULATE_MIN_CHUNK < (size_t)stbi__parallel_threads ? (int)(len / STBI__SPECULATE_MIN_CHUNK) : stbi__parallel_threads;
+
+	p.chunk = (stbi__jpeg_speculation *)stbi__malloc(p.num_chunks * sizeof(stbi__jpeg_speculation));
+	p.failed = (int *)stbi__malloc(p.num_chunks * sizeof(int));
+	if (p.chunk)
+		p.chunk[0].starts = (stbi__jpeg_sync *)stbi__malloc((size_t)p.num_chunks * STBI__SPECULATE_STARTS * sizeof(stbi__jpeg_sync));
+	if (!p.chunk || !p.failed || !p.chunk[0].starts) {
+		if (p.chunk) STBI_FREE(p.chunk[0].starts);
+		STBI_FREE(p.chunk);
+		STBI_FREE(p.failed);
+		return -1;
+	}
+	for (i = 0; i < p.num_chunks; ++i) {
+		stbi__jpeg_speculation *c = &p.chunk[i];
+		c->starts = p.chunk[0].starts + (size_t)i * STBI__SPECULATE_STARTS;
+		c->start = p.start + len * i / p.num_chunks;
+		// a zero stuffed after 0xff isn't a place to start
+		if (i > 0 && c->start[-1] == 0xff) ++c->start;
+		if (i > 0) p.chunk[i - 1].end = c->start;
+	}
+	p.chunk[p.num_chunks - 1].end = p.end;
+
+	// 1. skim the chunks (the last one's crossing isn't needed)
+	stbi__parallel_runner(stbi__parallel_user, stbi__jpeg_skim_task, &p, p.num_chunks - 1);
+
+	// 2. line the chunks up along the true path; the first one is on it already
+	memset(&p.chunk[0].entry, 0, sizeof(stbi__jpeg_sync));
+	from = p.chunk[0].exit;
+	ok = p.chunk[0].has_exit;
+	d = ok ? stbi__jpeg_speculative_decoder(&p, &ds) : NULL;
+	if (!d) ok = 0;
+	for (i = 1; ok && i < p.num_chunks; ++i) {
+		ok = stbi__jpeg_bridge(&p, d, i, &from);
+		// (an MCU spanning a whole chunk would make its neighbour's first)
+		if (p.chunk[i].entry.count < p.chunk[i - 1].entry.count) ok = 0;
+	}
+	STBI_FREE(d);
+
+	// 3. decode them
+	if (ok) {
+		stbi__parallel_runner(stbi__parallel_user, stbi__jpeg_speculative_decode_task, &p, p.num_chunks);
+		for (i = 0; i < p.num_chunks; ++i)
+			if (p.failed[i]) ok = 0;
+		if (!p.tail) ok = 0;
+	}
+
+	// with every component in the scan its rows are final, so they can be
+	// converted here, on every thread
+	if (ok && z->output && z->scan_n == z->s->img_n) {
+		int linebufs;
+		if (!z->output->output && !stbi__jpeg_begin_output(z)) {
+			STBI_FREE(p.chunk[0].starts);
+			STBI_FREE(p.chunk);
+			STBI_FREE(p.failed);
+			return 0;
+		}
+		linebufs = p.num_chunks * z->output->decode_n;
+		p.linebuf = (stbi_uc **)stbi__malloc(linebufs * sizeof(stbi_uc *));
+		linebuf_block = (stbi_uc *)stbi__malloc((size_t)linebufs * (z->output->img_x + 3));
+		if (p.linebuf && linebuf_block) {
+			for (k = 0; k < linebufs; ++k)
+				p.linebuf[k] = linebuf_block + (size_t)k * (z->output->img_x + 3);
+			stbi__parallel_runner(stbi__parallel_user, stbi__jpeg_speculative_convert_task, &p, p.num_chunks);
+			z->rows_converted = z->output->img_y;
+		}
+		STBI_FREE(p.linebuf);
+		STBI_FREE(linebuf_block);
+	}
+
+	STBI_FREE(p.chunk[0].starts);
+	STBI_FREE(p.chunk);
+	STBI_FREE(p.failed);
+	if (!ok) return -1;
+
+	// leave the stream as the serial decoder would
+	stbi__jpeg_reset(z);
+	s->img_buffer = p.tail;
+	z->marker = p.tail_marker;
+	return 1;
+}
+
+// progressive images are dequantized and IDCT'd once the last scan is in.
+// that's done in bands of MCU rows, each color-converted straight after its
+// IDCT while it's still in cache, and the bands are shared out over the
+// parallel runner. the few output rows at the top of a band that resample
+// from the band above wait until every band is done
+#define STBI__FINISH_BAND_ROWS  32   // output rows per band, at least
+
+typedef struct
+{
+	stbi__jpeg *z;
+	int band_mcu_rows, num_bands;
+	int num_tasks;
+	int edges;              // 0: IDCT and convert each band; 1: convert the band tops
+	int preview;            // leave the coefficients as they are, for more scans
+	int flat;               // and they're only DC, so every block is flat
+	stbi_uc **linebuf;      // decode_n per task, or NULL to leave conversion to the caller
+} stbi__jpeg_finisher;
+
+// the first output row that only resamples from rows below the first
+// mcu_rows_done MCU rows, so doesn't need the band above
+static stbi__uint32 stbi__jpeg_band_interior(stbi__jpeg *z, int mcu_rows_done)
+{
+	stbi__jpeg_output *o = z->output;
+	stbi__uint32 interior = 0;
+	int k;
+
+	for (k = 0; k < o->decode_n; ++k) {
+		int rows = (z->img_comp[k].y + (1 << z->scale_shift) - 1) >> z->scale_shift;
+		int done = mcu_rows_done * z->img_comp[k].v * z->block_size;
+		int vs = o->res_comp[k].vs;
+		int j = (done + 1) * vs - (vs >> 1);
+		if (done >= rows || mcu_rows_done == 0) continue;
+		if ((stbi__uint32)j > interior) interior = j;
+	}
+	return interior < o->img_y ? interior : o->img_y;
+}
+
+static void stbi__jpeg_finish_band(stbi__jpeg_finisher *f, int b, stbi_uc **linebuf)
+{
+	stbi__jpeg *z = f->z;
+	stbi__uint32 top, interior, bottom;
+	int i, j, n;
+	STBI_SIMD_ALIGN(short, block[64]);
+
+	if (!f->edges) {
+		for (n = 0; n < z->s->img_n; ++n) {
+			int w = (z->img_comp[n].x + 7) >> 3;
+			int h = (z->img_comp[n].y + 7) >> 3;
+			int j0 = b * f->band_mcu_rows * z->img_comp[n].v;
+			int j1 = j0 + f->band_mcu_rows * z->img_comp[n].v;
+			if (j1 > h) j1 = h;
+			for (j = j0; j < j1; ++j) {
+				for (i = 0; i < w; ++i) {
+					short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+					if (!stbi__jpeg_block_wanted(z, n, i, j)) continue;
+					stbi_uc *out = z->img_comp[n].data + z->img_comp[n].w2*j * z->block_size + i * z->block_size;
+					if (f->flat) {
+						stbi_uc v;
+						int row;
+						block[0] = (short)(data[0] * z->dequant[z->img_comp[n].tq][0]);
+						stbi__idct_block_1x1(&v, 0, block);
+						for (row = 0; row < z->block_size; ++row)
+							memset(out + row * z->img_comp[n].w2, v, z->block_size);
+						continue;
+					}
+					if (f->preview) {
+						memcpy(block, data, sizeof(block));
+						data = block;
+					}
+					stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
+					z->idct_block_kernel(out, z->img_comp[n].w2, data);
+				}
+			}
+		}
+	}
+	if (!linebuf) return;
+
+	top = stbi__jpeg_ready_rows(z, b * f->band_mcu_rows, 1);
+	bottom = stbi__jpeg_ready_rows(z, (b + 1) * f->band_mcu_rows, 1);
+	interior = stbi__jpeg_band_interior(z, b * f->band_mcu_rows);
+	if (interior < top) interior = top;
+	if (interior > bottom) interior = bottom;
+	if (f->edges)
+		stbi__jpeg_convert_rows(z, top, interior, linebuf);
+	else
+		stbi__jpeg_convert_rows(z, interior, bottom, linebuf);
+}
+
+static void stbi__jpeg_finish_task(void *arg, int task)
+{
+	stbi__jpeg_finisher *f = (stbi__jpeg_finisher *)arg;
+	stbi_uc **linebuf = f->linebuf ? f->linebuf + task * f->z->output->decode_n : NULL;
+	int b;
+	for (b = task; b < f->num_bands; b += f->num_tasks)
+		stbi__jpeg_finish_band(f, b, linebuf);
+}
+
+static int stbi__jpeg_finish(stbi__jpeg *z, int preview)
+{
+	stbi__jpeg_finisher f;
+	stbi_uc *linebuf_block = NULL;
+	int mcu_height = z->img_v_max * z->block_size;
+	int k, linebufs;
+
+	memset(&f, 0, sizeof(f));
+	f.z = z;
+	f.preview = preview;
+	f.flat = preview && !z->ac_scans;
+	f.band_mcu_rows = (STBI__FINISH_BAND_ROWS + mcu_height - 1) / mcu_height;
+	f.num_bands = (z->img_mcu_y + f.band_mcu_rows - 1) / f.band_mcu_rows;
+	f.num_tasks = 1;
+	if (stbi__parallel_width() >= 2 && z->img_mcu_x * z->img_mcu_y >= STBI__PARALLEL_MIN_MCUS)
+		f.num_tasks = stbi__parallel_threads < f.num_bands ? stbi__parallel_threads : f.num_bands;
+
+	if (z->output) {
+		if (!z->output->output && !stbi__jpeg_begin_output(z))
+			return 0;
+		// without line buffers, load_jpeg_image converts the whole image afterwards
+		linebufs = f.num_tasks * z->output->decode_n;
+		f.linebuf = (stbi_uc **)stbi__malloc(linebufs * sizeof(stbi_uc *));
+		linebuf_block = (stbi_uc *)stbi__malloc((size_t)linebufs * (z->output->img_x + 3));
+		if (!f.linebuf || !linebuf_block) {
+			STBI_FREE(f.linebuf);
+			f.linebuf = NULL;
+			// the final image can be converted later, but not a preview
+			if (preview) {
+				STBI_FREE(linebuf_block);
+				return stbi__err("outofmem", "Out of memory");
+			}
+		}
+		else
+			for (k = 0; k < linebufs; ++k)
+				f.linebuf[k] = linebuf_block + (size_t)k * (z->output->img_x + 3);
+	}
+
+	for (f.edges = 0; f.edges < (f.linebuf ? 2 : 1); ++f.edges) {
+		if (f.num_tasks > 1)
+			stbi__parallel_runner(stbi__parallel_user, stbi__jpeg_finish_task, &f, f.num_tasks);
+		else
+			stbi__jpeg_finish_task(&f, 0);
+	}
+	if (f.linebuf)
+		z->rows_converted = z->output->img_y;
+
+	STBI_FREE(f.linebuf);
+	STBI_FREE(linebuf_block);
+	return 1;
+}
+
+// shows stbi_load_progressive's callback the image as it stands
+static int stbi__jpeg_preview(stbi__jpeg *z)
 {
-	resample_row_func resample;
-	stbi_uc *line0, *line1;
-	int hs, vs;   // expansion factor in each axis
-	int w_lores; // horizontal pixels pre-expansion
-	int ystep;   // how far through vertical expansion we are
-	int ypos;    // which pre-expansion row we're on
-} stbi__resample;
+	stbi__jpeg_output *o = z->output;
+	if (!stbi__jpeg_finish(z, 1)) return 0;
+	// the next scan changes every row again
+	z->rows_converted = 0;
+	if (!z->preview(z->preview_user, z->scans, o->output, o->img_x, o->img_y, o->n))
+		return stbi__err("stopped", "Preview callback stopped decoding");
+	return 1;
+}
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp, stbi__planar *planar)
 {
-	int n, decode_n;
+	stbi__jpeg_output o;
+	int k;
 	z->s->img_n = 0; // make stbi__cleanup_jpeg safe
 
 					 // validate req_comp
 	if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
 
-	// load a jpeg image from whichever source, but leave in YCbCr format
-	if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
-
-	// determine actual number of components to generate
-	n = req_comp ? req_comp : z->s->img_n;
-
-	if (z->s->img_n == 3 && n < 3)
-		decode_n = 1;
-	else
-		decode_n = z->s->img_n;
-
-	// resample and color-convert
-	{
-		int k;
-		unsigned int i, j;
-		stbi_uc *output;
-		stbi_uc *coutput[4];
-
-		stbi__resample res_comp[4];
+	memset(&o, 0, sizeof(o));
+	o.req_comp = req_comp;
+	o.planar = planar;
+	z->output = &o;
 
-		for (k = 0; k < decode_n; ++k) {
-			stbi__resample *r = &res_comp[k];
+	// load a jpeg image from whichever source, but leave in YCbCr format
+	// (unless it was pipelined, which converts as it goes)
+	if (!stbi__decode_jpeg_image(z) || (!o.output && !stbi__jpeg_begin_output(z))) {
+		if (o.output && !planar) STBI_FREE(o.output);
+		stbi__cleanup_jpeg(z);
+		return NULL;
+	}
 
+	// resample and color-convert whatever the decode didn't
+	if (z->rows_converted < o.img_y) {
+		stbi_uc *linebuf[4];
+		for (k = 0; k < o.decode_n; ++k) {
 			// allocate line buffer big enough for upsampling off the edges
 			// with upsample factor of 4
-			z->img_comp[k].linebuf = (stbi_uc *)stbi__malloc(z->s->img_x + 3);
-			if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-			r->hs = z->img_h_max / z->img_comp[k].h;
-			r->vs = z->img_v_max / z->img_comp[k].v;
-			r->ystep = r->vs >> 1;
-			r->w_lores = (z->s->img_x + r->hs - 1) / r->hs;
-			r->ypos = 0;
-			r->line0 = r->line1 = z->img_comp[k].data;
-
-			if (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-			else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-			else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-			else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-			else                               r->resample = stbi__resample_row_generic;
-		}
-
-		// can't error after this so, this is safe
-		output = (stbi_uc *)stbi__malloc(n * z->s->img_x * z->s->img_y + 1);
-		if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-		// now go ahead and resample
-		for (j = 0; j < z->s->img_y; ++j) {
-			stbi_uc *out = output + n * z->s->img_x * j;
-			for (k = 0; k < decode_n; ++k) {
-				stbi__resample *r = &res_comp[k];
-				int y_bot = r->ystep >= (r->vs >> 1);
-				coutput[k] = r->resample(z->img_comp[k].linebuf,
-					y_bot ? r->line1 : r->line0,
-					y_bot ? r->line0 : r->line1,
-					r->w_lores, r->hs);
-				if (++r->ystep >= r->vs) {
-					r->ystep = 0;
-					r->line0 = r->line1;
-					if (++r->ypos < z->img_comp[k].y)
-						r->line1 += z->img_comp[k].w2;
-				}
-			}
-			if (n >= 3) {
-				stbi_uc *y = coutput[0];
-				if (z->s->img_n == 3) {
-					z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-				}
-				else
-					for (i = 0; i < z->s->img_x; ++i) {
-						out[0] = out[1] = out[2] = y[i];
-						out[3] = 255; // not used if n==3
-						out += n;
-					}
-			}
-			else {
-				stbi_uc *y = coutput[0];
-				if (n == 1)
-					for (i = 0; i < z->s->img_x; ++i) out[i] = y[i];
-				else
-					for (i = 0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+			z->img_comp[k].linebuf = (stbi_uc *)stbi__malloc(o.img_x + 3);
+			if (!z->img_comp[k].linebuf) {
+				if (!planar) STBI_FREE(o.output);
+				stbi__cleanup_jpeg(z);
+				return stbi__errpuc("outofmem", "Out of memory");
 			}
+			linebuf[k] = z->img_comp[k].linebuf;
 		}
-		stbi__cleanup_jpeg(z);
-		*out_x = z->s->img_x;
-		*out_y = z->s->img_y;
-		if (comp) *comp = z->s->img_n; // report original components, not output
-		return output;
+		stbi__jpeg_convert_rows(z, z->rows_converted, o.img_y, linebuf);
 	}
+
+	stbi__cleanup_jpeg(z);
+	*out_x = o.img_x;
+	*out_y = o.img_y;
+	if (comp) *comp = z->s->img_n; // report original components, not output
+	return o.output;
 }
 
 static unsigned char *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp)
@@ -3435,7 +6670,89 @@ static unsigned char *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *com
 	stbi__jpeg j;
 	j.s = s;
 	stbi__setup_jpeg(&j);
-	return load_jpeg_image(&j, x, y, comp, req_comp);
+	return load_jpeg_image(&j, x, y, comp, req_comp, NULL);
+}
+
+static stbi_uc *stbi__jpeg_load_progressive(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
+{
+	stbi__jpeg j;
+	j.s = s;
+	stbi__setup_jpeg(&j);
+	j.preview = preview;
+	j.preview_user = user;
+	return load_jpeg_image(&j, x, y, comp, req_comp, NULL);
+}
+
+static int stbi__jpeg_load_planar(stbi__context *s, int scale_shift, int *comp, int req_comp, stbi__planar *p)
+{
+	stbi__jpeg j;
+	int w, h;
+	j.s = s;
+	stbi__setup_jpeg(&j);
+	stbi__jpeg_set_scale(&j, scale_shift);
+	return load_jpeg_image(&j, &w, &h, comp, req_comp, p) != NULL;
+}
+
+static int stbi__jpeg_components_info(stbi__context *s, int *x, int *y, int *comp, int *h_samp, int *v_samp)
+{
+	stbi__jpeg j;
+	int k;
+	j.s = s;
+	if (!stbi__decode_jpeg_header(&j, STBI__SCAN_header)) {
+		stbi__rewind(s);
+		return 0;
+	}
+	if (x) *x = s->img_x;
+	if (y) *y = s->img_y;
+	if (comp) *comp = s->img_n;
+	for (k = 0; k < s->img_n; ++k) {
+		if (h_samp) h_samp[k] = j.img_comp[k].h;
+		if (v_samp) v_samp[k] = j.img_comp[k].v;
+	}
+	return 1;
+}
+
+static int stbi__jpeg_load_components(stbi__context *s, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights)
+{
+	stbi__jpeg j;
+	int k, row;
+	int shift = stbi__scale_shift(scale);
+	if (shift < 0) return stbi__err("bad scale", "Scale must be 1, 2, 4 or 8");
+	j.s = s;
+	stbi__setup_jpeg(&j);
+	stbi__jpeg_set_scale(&j, shift);
+	j.s->img_n = 0; // make stbi__cleanup_jpeg safe
+	if (!stbi__decode_jpeg_image(&j)) { stbi__cleanup_jpeg(&j); return 0; }
+
+	for (k = 0; k < s->img_n; ++k) {
+		if (widths[k] < 0 || heights[k] < 0) {
+			stbi__cleanup_jpeg(&j);
+			return stbi__err("wrong size", "Negative plane size");
+		}
+	}
+
+	for (k = 0; k < s->img_n; ++k) {
+		// only whole decoded blocks are valid, which may be less than w2/h2 for
+		// non-interleaved scans; anything past them repeats the last column/row
+		int valid_w = ((j.img_comp[k].x + 7) >> 3) * j.block_size;
+		int valid_h = ((j.img_comp[k].y + 7) >> 3) * j.block_size;
+		int copy_w = widths[k] < valid_w ? widths[k] : valid_w;
+		stbi_uc *dest = planes[k];
+		int stride = strides[k];
+		if (stbi__vertically_flip_on_load) {
+			dest += (heights[k] - 1) * stride;
+			stride = -stride;
+		}
+		for (row = 0; row < heights[k]; ++row) {
+			stbi_uc *d = dest + row * stride;
+			memcpy(d, j.img_comp[k].data + (row < valid_h ? row : valid_h - 1) * j.img_comp[k].w2, copy_w);
+			if (widths[k] > copy_w)
+				memset(d + copy_w, d[copy_w - 1], widths[k] - copy_w);
+		}
+	}
+
+	stbi__cleanup_jpeg(&j);
+	return 1;
 }
 
 static int stbi__jpeg_test(stbi__context *s)
@@ -3479,9 +6796,22 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  10 // accelerate all cases in default tables, and most in dynamic ones
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// like the jpeg decoder, the bit buffer is a register wide
+#if defined(STBI__X64_TARGET) || defined(__aarch64__) || defined(_M_ARM64)
+#define STBI__ZBUF_BITS  64
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__zbits;
+#else
+typedef uint64_t stbi__zbits;
+#endif
+#else
+#define STBI__ZBUF_BITS  32
+typedef stbi__uint32 stbi__zbits;
+#endif
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3511,7 +6841,7 @@ stbi_inline static int stbi__bit_reverse(int v, int bits)
 	return stbi__bitreverse16(v) >> (16 - bits);
 }
 
-static int stbi__zbuild_huffman(stbi__zhuffman *z, stbi_uc *sizelist, int num)
+static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int num)
 {
 	int i, k = 0;
 	int code, next_code[16], sizes[17];
@@ -3563,41 +6893,72 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, stbi_uc *sizelist, int num)
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
+//
+//    the exception is streamed PNG decoding, which sets zrefill to be
+//    called for more input when zbuffer runs out, and zflush to be called
+//    instead of growing the output when it fills up, to hand over what's
+//    been inflated and slide the last 32k down to make room
 
-typedef struct
+typedef struct stbi__zbuf
 {
 	stbi_uc *zbuffer, *zbuffer_end;
 	int num_bits;
-	stbi__uint32 code_buffer;
+	stbi__zbits code_buffer;
 
 	char *zout;
 	char *zout_start;
 	char *zout_end;
 	int   z_expandable;
+	int   z_full;       // ran out of room in a fixed-size output buffer
+	int   z_eof;        // zero bytes buffered from past the end of the input
+	int (*zrefill)(struct stbi__zbuf *z);        // returns 0 at the end of the input
+	int (*zflush)(struct stbi__zbuf *z, int n);  // must leave room for n bytes
 
 	stbi__zhuffman z_length, z_distance;
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 {
-	if (z->zbuffer >= z->zbuffer_end) return 0;
+	if (z->zbuffer >= z->zbuffer_end && (!z->zrefill || !z->zrefill(z))) {
+		++z->z_eof;
+		return 0;
+	}
 	return *z->zbuffer++;
 }
 
 static void stbi__fill_bits(stbi__zbuf *z)
 {
+#if STBI__ZBUF_BITS == 64
+	// take all the whole bytes that fit with one load while there are 8 left
+	if (z->zbuffer_end - z->zbuffer >= 8) {
+		stbi_uc *p = z->zbuffer;
+		int n = (63 - z->num_bits) >> 3;
+		stbi__zbits w;
+		STBI_ASSERT(z->code_buffer < ((stbi__zbits)1 << z->num_bits));
+#ifdef _MSC_VER
+		memcpy(&w, p, 8); // x64 and ARM64 are little-endian
+#else
+		w = (stbi__zbits)p[0] | ((stbi__zbits)p[1] << 8) | ((stbi__zbits)p[2] << 16) | ((stbi__zbits)p[3] << 24) |
+			((stbi__zbits)p[4] << 32) | ((stbi__zbits)p[5] << 40) | ((stbi__zbits)p[6] << 48) | ((stbi__zbits)p[7] << 56);
+#endif
+		z->code_buffer |= (w & (((stbi__zbits)1 << (8 * n)) - 1)) << z->num_bits;
+		z->num_bits += 8 * n;
+		z->zbuffer += n;
+		return;
+	}
+#endif
 	do {
-		STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-		z->code_buffer |= (unsigned int)stbi__zget8(z) << z->num_bits;
+		STBI_ASSERT(z->code_buffer < ((stbi__zbits)1 << z->num_bits));
+		z->code_buffer |= (stbi__zbits)stbi__zget8(z) << z->num_bits;
 		z->num_bits += 8;
-	} while (z->num_bits <= 24);
+	} while (z->num_bits <= STBI__ZBUF_BITS - 8);
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
 	unsigned int k;
 	if (z->num_bits < n) stbi__fill_bits(z);
-	k = z->code_buffer & ((1 << n) - 1);
+	k = (unsigned int)z->code_buffer & ((1 << n) - 1);
 	z->code_buffer >>= n;
 	z->num_bits -= n;
 	return k;
@@ -3608,7 +6969,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
 	int b, s, k;
 	// not resolved by fast table, so compute it the slow way
 	// use jpeg approach, which requires MSbits at top
-	k = stbi__bit_reverse(a->code_buffer, 16);
+	k = stbi__bit_reverse((int)(a->code_buffer & 0xffff), 16);
 	for (s = STBI__ZFAST_BITS + 1; ; ++s)
 		if (k < z->maxcode[s])
 			break;
@@ -3625,7 +6986,7 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
 	int b, s;
 	if (a->num_bits < 16) stbi__fill_bits(a);
-	b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+	b = z->fast[(int)a->code_buffer & STBI__ZFAST_MASK];
 	if (b) {
 		s = b >> 9;
 		a->code_buffer >>= s;
@@ -3640,7 +7001,12 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
 	char *q;
 	int cur, limit, old_limit;
 	z->zout = zout;
-	if (!z->z_expandable) return stbi__err("output buffer limit", "Corrupt PNG");
+	if (z->zflush)
+		return z->zflush(z, n);
+	if (!z->z_expandable) {
+		z->z_full = 1;
+		return stbi__err("output buffer limit", "Corrupt PNG");
+	}
 	cur = (int)(z->zout - z->zout_start);
 	limit = old_limit = (int)(z->zout_end - z->zout_start);
 	while (cur + n > limit)
@@ -3692,18 +7058,50 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
 			len = stbi__zlength_base[z];
 			if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
 			z = stbi__zhuffman_decode(a, &a->z_distance);
-			if (z < 0) return stbi__err("bad huffman code", "Corrupt PNG");
+			if (z < 0 || z >= 30) return stbi__err("bad huffman code", "Corrupt PNG"); // 30 and 31 aren't distances
 			dist = stbi__zdist_base[z];
 			if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
 			if (zout - a->zout_start < dist) return stbi__err("bad dist", "Corrupt PNG");
 			if (zout + len > a->zout_end) {
+				if (!a->z_expandable) {
+					// fill a fixed-size buffer to the end before giving up, so
+					// a caller that only wants a prefix gets all of it
+					p = (stbi_uc *)(zout - dist);
+					while (zout < a->zout_end) *zout++ = *p++;
+				}
 				if (!stbi__zexpand(a, zout, len)) return 0;
 				zout = a->zout;
 			}
 			p = (stbi_uc *)(zout - dist);
 			if (dist == 1) { // run of one byte; common in images.
-				stbi_uc v = *p;
-				if (len) { do *zout++ = v; while (--len); }
+				memset(zout, *p, len);
+				zout += len;
+			}
+			else if (dist >= 8 && a->zout_end - zout >= len + 8) {
+				// 8 bytes at a time, which can write a little past the match
+				// but not past the buffer. the source is at least a word
+				// behind, so every word it reads has been written already
+				char *end = zout + len;
+				do {
+					memcpy(zout, p, 8);
+					zout += 8;
+					p += 8;
+				} while (zout < end);
+				zout = end;
+			}
+			else if (dist < 8 && len > 16 && a->zout_end - zout >= len + 8) {
+				// a short repeating pattern. once its first 8..14 bytes (a
+				// whole number of periods) are out, the rest can be copied a
+				// word at a time from that far back without overlapping
+				char *end = zout + len;
+				int period = dist * ((8 + dist - 1) / dist);
+				len = period;
+				do *zout++ = *p++; while (--len);
+				do {
+					memcpy(zout, zout - period, 8);
+					zout += 8;
+				} while (zout < end);
+				zout = end;
 			}
 			else {
 				if (len) { do *zout++ = *p++; while (--len); }
@@ -3738,6 +7136,7 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
 		if (c < 16)
 			lencodes[n++] = (stbi_uc)c;
 		else if (c == 16) {
+			if (n == 0) return stbi__err("bad codelengths", "Corrupt PNG"); // nothing to repeat
 			c = stbi__zreceive(a, 2) + 3;
 			memset(lencodes + n, lencodes[n - 1], c);
 			n += c;
@@ -3768,11 +7167,21 @@ static int stbi__parse_uncomperssed_block(stbi__zbuf *a)
 		stbi__zreceive(a, a->num_bits & 7); // discard
 											// drain the bit-packed data into header
 	k = 0;
-	while (a->num_bits > 0) {
+	while (a->num_bits > 0 && k < 4) {
 		header[k++] = (stbi_uc)(a->code_buffer & 255); // suppress MSVC run-time check
 		a->code_buffer >>= 8;
 		a->num_bits -= 8;
 	}
+	// a 64-bit buffer can hold more than the header; hand those bytes back
+	// to the input, apart from zeros that were read past its end
+	if (a->num_bits > 0) {
+		int extra = a->num_bits >> 3;
+		int past_end = a->z_eof < extra ? a->z_eof : extra;
+		a->zbuffer -= extra - past_end;
+		a->z_eof -= past_end;
+		a->code_buffer = 0;
+		a->num_bits = 0;
+	}
 	STBI_ASSERT(a->num_bits == 0);
 	// now fill header the normal way
 	while (k < 4)
@@ -3780,12 +7189,23 @@ static int stbi__parse_uncomperssed_block(stbi__zbuf *a)
 	len = header[1] * 256 + header[0];
 	nlen = header[3] * 256 + header[2];
 	if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt", "Corrupt PNG");
-	if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer", "Corrupt PNG");
-	if (a->zout + len > a->zout_end)
-		if (!stbi__zexpand(a, a->zout, len)) return 0;
-	memcpy(a->zout, a->zbuffer, len);
-	a->zbuffer += len;
-	a->zout += len;
+	// a fixed-size buffer is filled to the end before giving up, even from a
+	// block that runs past the end of the input, so a caller that only wants
+	// a prefix gets all of it
+	if (a->zbuffer + len > a->zbuffer_end && !a->zrefill && (a->z_expandable || a->zflush)) return stbi__err("read past buffer", "Corrupt PNG");
+	// copy as much as the input and output have room for at a time
+	while (len > 0) {
+		int n = len;
+		if (a->zbuffer >= a->zbuffer_end && !(a->zrefill ? a->zrefill(a) : a->zout >= a->zout_end))
+			return stbi__err("read past buffer", "Corrupt PNG");
+		if (n > a->zbuffer_end - a->zbuffer) n = (int)(a->zbuffer_end - a->zbuffer);
+		if (a->zout >= a->zout_end && !stbi__zexpand(a, a->zout, n)) return 0;
+		if (n > a->zout_end - a->zout) n = (int)(a->zout_end - a->zout);
+		memcpy(a->zout, a->zbuffer, n);
+		a->zbuffer += n;
+		a->zout += n;
+		len -= n;
+	}
 	return 1;
 }
 
@@ -3802,18 +7222,24 @@ static int stbi__parse_zlib_header(stbi__zbuf *a)
 	return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static stbi_uc stbi__zdefault_length[288], stbi__zdefault_distance[32];
-static void stbi__init_zdefaults(void)
+// fixed huffman code lengths (RFC 1951 3.2.6), initialized statically so
+// that concurrent decodes never write to them
+static const stbi_uc stbi__zdefault_length[288] =
 {
-	int i;   // use <= to match clearly with spec
-	for (i = 0; i <= 143; ++i)     stbi__zdefault_length[i] = 8;
-	for (; i <= 255; ++i)     stbi__zdefault_length[i] = 9;
-	for (; i <= 279; ++i)     stbi__zdefault_length[i] = 7;
-	for (; i <= 287; ++i)     stbi__zdefault_length[i] = 8;
-
-	for (i = 0; i <= 31; ++i)     stbi__zdefault_distance[i] = 5;
-}
+	8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+	8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+	8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+	8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+	8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+	7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static const stbi_uc stbi__zdefault_distance[32] =
+{
+	5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
 static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
 {
@@ -3834,7 +7260,6 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
 		else {
 			if (type == 1) {
 				// use fixed code lengths
-				if (!stbi__zdefault_distance[31]) stbi__init_zdefaults();
 				if (!stbi__zbuild_huffman(&a->z_length, stbi__zdefault_length, 288)) return 0;
 				if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance, 32)) return 0;
 			}
@@ -3853,6 +7278,10 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
 	a->zout = obuf;
 	a->zout_end = obuf + olen;
 	a->z_expandable = exp;
+	a->z_full = 0;
+	a->z_eof = 0;
+	a->zrefill = NULL;
+	a->zflush = NULL;
 
 	return stbi__parse_zlib(a, parse_header);
 }
@@ -3934,6 +7363,38 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
 	else
 		return -1;
 }
+
+STBIDEF int stbi_zlib_decode_noheader_prefix(char *obuffer, int olen, const char *ibuffer, int ilen)
+{
+	stbi__zbuf a;
+	a.zbuffer = (stbi_uc *)ibuffer;
+	a.zbuffer_end = (stbi_uc *)ibuffer + ilen;
+	if (stbi__do_zlib(&a, obuffer, olen, 0, 0))
+		return (int)(a.zout - a.zout_start);
+	// unless it ran out of input first, and has been decoding the zeros that
+	// stand in for what's past the end
+	if (a.z_full && a.z_eof * 8 <= a.num_bits)
+		return (int)(a.zout - a.zout_start);
+	return -1;
+}
+
+// for when the caller knows the decoded size, as PNG does: the output is
+// allocated once, and anything past that size is dropped instead of growing
+// the buffer, so a stream that never reaches its end can't run away with memory
+static char *stbi__zlib_decode_exact(const char *buffer, int len, int olen, int *outlen, int parse_header)
+{
+	stbi__zbuf a;
+	char *p = (char *)stbi__malloc(olen);
+	if (p == NULL) return (char *)stbi__errpuc("outofmem", "Out of memory");
+	a.zbuffer = (stbi_uc *)buffer;
+	a.zbuffer_end = (stbi_uc *)buffer + len;
+	if (stbi__do_zlib(&a, p, olen, 0, parse_header) || (a.z_full && a.z_eof * 8 <= a.num_bits)) {
+		if (outlen) *outlen = (int)(a.zout - a.zout_start);
+		return a.zout_start;
+	}
+	STBI_FREE(a.zout_start);
+	return NULL;
+}
 #endif
 
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
@@ -3974,6 +7435,12 @@ typedef struct
 {
 	stbi__context *s;
 	stbi_uc *idata, *expanded, *out;
+	stbi__rows *rows;  // if set, rows are handed over here instead of to out
+	stbi_uc *final;    // an interlaced image, as far as it's been de-interlaced
+	int passes;
+	stbi_preview_callback *preview;  // stbi_load_progressive's, for interlaced images
+	void *preview_user;
+	stbi_uc *view;     // what the previews were drawn in, and the result goes in
 } stbi__png;
 
 
@@ -3997,27 +7464,350 @@ static stbi_uc first_row_filter[5] =
 	STBI__F_paeth_first
 };
 
-static int stbi__paeth(int a, int b, int c)
+// the same choice as the spec's predictor (the one of a, b and c nearest to
+// a + b - c, preferring a then b on ties), rearranged so that it compiles to
+// selects instead of branches, which noisy scans mispredict constantly
+stbi_inline static int stbi__paeth(int a, int b, int c)
 {
-	int p = a + b - c;
-	int pa = abs(p - a);
-	int pb = abs(p - b);
-	int pc = abs(p - c);
-	if (pa <= pb && pa <= pc) return a;
-	if (pb <= pc) return b;
-	return c;
+	int thresh = c * 3 - (a + b);
+	int lo = a < b ? a : b;
+	int hi = a < b ? b : a;
+	int t0 = (hi <= thresh) ? lo : c;
+	return (thresh <= lo) ? hi : t0;
+}
+
+// unfilter kernels for 8-bit rows from the second pixel on, where cur[-bpp]
+// and prior[-bpp] are the pixel to the left, already done. one per filter and
+// pixel size, so that the byte loops see a constant distance to the left
+typedef void(*stbi__unfilter_kernel)(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n);
+
+static void stbi__unfilter_up(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n)
+{
+	int k;
+	for (k = 0; k < n; ++k)
+		cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+#define STBI__UNFILTER_ROWS(bpp) \
+static void stbi__unfilter_sub_##bpp(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n) \
+{ \
+	int k; \
+	STBI_NOTUSED(prior); \
+	for (k = 0; k < n; ++k) \
+		cur[k] = STBI__BYTECAST(raw[k] + cur[k - bpp]); \
+} \
+static void stbi__unfilter_avg_##bpp(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n) \
+{ \
+	int k; \
+	for (k = 0; k < n; ++k) \
+		cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k - bpp]) >> 1)); \
+} \
+static void stbi__unfilter_paeth_##bpp(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n) \
+{ \
+	int k; \
+	for (k = 0; k < n; ++k) \
+		cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - bpp], prior[k], prior[k - bpp])); \
+}
+
+STBI__UNFILTER_ROWS(1)
+STBI__UNFILTER_ROWS(2)
+STBI__UNFILTER_ROWS(3)
+STBI__UNFILTER_ROWS(4)
+#undef STBI__UNFILTER_ROWS
+
+#ifdef STBI_SSE2
+// Up is independent per byte. the others depend on the pixel to the left, so
+// they go a pixel at a time, with the pixel's 3 or 4 bytes side by side in
+// one register: a byte at a time for Sub and Avg, 16 bits wide for Paeth
+static void stbi__unfilter_up_simd(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n)
+{
+	int k = 0;
+	for (; k + 16 <= n; k += 16) {
+		__m128i b = _mm_loadu_si128((const __m128i *) (prior + k));
+		__m128i d = _mm_loadu_si128((const __m128i *) (raw + k));
+		_mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(d, b));
+	}
+	for (; k < n; ++k)
+		cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+// pixels are moved w bytes at a time. 3-byte pixels are moved 4 bytes at a
+// time, the extra byte being the next pixel's, which is written over when its
+// turn comes; all but the last in a row, which mustn't touch the next row
+stbi_inline static __m128i stbi__load_pixel(const stbi_uc *p, int w)
+{
+	int v;
+	if (w == 4)
+		memcpy(&v, p, 4);
+	else
+		v = p[0] | (p[1] << 8) | (p[2] << 16);
+	return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void stbi__store_pixel(stbi_uc *p, __m128i x, int w)
+{
+	int v = _mm_cvtsi128_si32(x);
+	memcpy(p, &v, w);
+}
+
+// each step does one pixel and returns it, as the next one's left neighbour
+stbi_inline static __m128i stbi__unfilter_sub_step(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, __m128i a, int bpp, int w)
+{
+	STBI_NOTUSED(prior);
+	STBI_NOTUSED(bpp);
+	a = _mm_add_epi8(a, stbi__load_pixel(raw, w));
+	stbi__store_pixel(cur, a, w);
+	return a;
+}
+
+stbi_inline static __m128i stbi__unfilter_avg_step(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, __m128i a, int bpp, int w)
+{
+	__m128i b = stbi__load_pixel(prior, w);
+	// pavgb rounds up; take the carry back off where a + b is odd
+	__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+	STBI_NOTUSED(bpp);
+	a = _mm_add_epi8(avg, stbi__load_pixel(raw, w));
+	stbi__store_pixel(cur, a, w);
+	return a;
+}
+
+// stbi__paeth, with what doesn't depend on a worked out first, and a kept 16
+// bits wide so that the next pixel doesn't wait on a pack and unpack
+stbi_inline static __m128i stbi__unfilter_paeth_step(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, __m128i a, int bpp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i b = _mm_unpacklo_epi8(stbi__load_pixel(prior, w), zero);
+	__m128i c = _mm_unpacklo_epi8(stbi__load_pixel(prior - bpp, w), zero);
+	__m128i d = _mm_unpacklo_epi8(stbi__load_pixel(raw, w), zero);
+	__m128i c3_b = _mm_sub_epi16(_mm_add_epi16(c, _mm_add_epi16(c, c)), b);
+	__m128i thresh = _mm_sub_epi16(c3_b, a);
+	__m128i lo = _mm_min_epi16(a, b);
+	__m128i hi = _mm_max_epi16(a, b);
+	__m128i t0 = _mm_xor_si128(lo, _mm_and_si128(_mm_xor_si128(lo, c), _mm_cmpgt_epi16(hi, thresh)));
+	__m128i pred = _mm_xor_si128(hi, _mm_and_si128(_mm_xor_si128(hi, t0), _mm_cmpgt_epi16(thresh, lo)));
+	a = _mm_and_si128(_mm_add_epi16(pred, d), _mm_set1_epi16(255));
+	stbi__store_pixel(cur, _mm_packus_epi16(a, a), w);
+	return a;
+}
+
+#define STBI__UNFILTER_ROW_SSE2(filter, bpp, widen) \
+static void stbi__unfilter_##filter##_##bpp##_simd(stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int n) \
+{ \
+	__m128i a = stbi__load_pixel(cur - bpp, bpp); \
+	int k; \
+	if (widen) a = _mm_unpacklo_epi8(a, _mm_setzero_si128()); \
+	for (k = 0; k + bpp < n; k += bpp) \
+		a = stbi__unfilter_##filter##_step(cur + k, prior + k, raw + k, a, bpp, 4); \
+	if (k < n) \
+		stbi__unfilter_##filter##_step(cur + k, prior + k, raw + k, a, bpp, bpp); \
+}
+
+STBI__UNFILTER_ROW_SSE2(sub, 3, 0)
+STBI__UNFILTER_ROW_SSE2(sub, 4, 0)
+STBI__UNFILTER_ROW_SSE2(avg, 3, 0)
+STBI__UNFILTER_ROW_SSE2(avg, 4, 0)
+STBI__UNFILTER_ROW_SSE2(paeth, 4, 1)
+#undef STBI__UNFILTER_ROW_SSE2
+#endif // STBI_SSE2
+
+// the kernels for filters 1-4 of an image with bpp-byte pixels; none is a memcpy
+static void stbi__setup_png_unfilter(stbi__unfilter_kernel kernels[5], int bpp)
+{
+	static const stbi__unfilter_kernel scalar[4][3] = {
+		{ stbi__unfilter_sub_1, stbi__unfilter_avg_1, stbi__unfilter_paeth_1 },
+		{ stbi__unfilter_sub_2, stbi__unfilter_avg_2, stbi__unfilter_paeth_2 },
+		{ stbi__unfilter_sub_3, stbi__unfilter_avg_3, stbi__unfilter_paeth_3 },
+		{ stbi__unfilter_sub_4, stbi__unfilter_avg_4, stbi__unfilter_paeth_4 },
+	};
+	STBI_ASSERT(bpp >= 1 && bpp <= 4);
+	kernels[STBI__F_none] = NULL;
+	kernels[STBI__F_sub] = scalar[bpp - 1][0];
+	kernels[STBI__F_up] = stbi__unfilter_up;
+	kernels[STBI__F_avg] = scalar[bpp - 1][1];
+	kernels[STBI__F_paeth] = scalar[bpp - 1][2];
+
+#ifdef STBI_SSE2
+	if (stbi__sse2_available()) {
+		kernels[STBI__F_up] = stbi__unfilter_up_simd;
+		if (bpp == 3) {
+			kernels[STBI__F_sub] = stbi__unfilter_sub_3_simd;
+			kernels[STBI__F_avg] = stbi__unfilter_avg_3_simd;
+			// Paeth keeps the C loop for 3-byte pixels, which the SSE2
+			// version was no faster than (197 against 200 Mpixels/s)
+		}
+		else if (bpp == 4) {
+			kernels[STBI__F_sub] = stbi__unfilter_sub_4_simd;
+			kernels[STBI__F_avg] = stbi__unfilter_avg_4_simd;
+			kernels[STBI__F_paeth] = stbi__unfilter_paeth_4_simd;
+		}
+	}
+#endif
 }
 
 static stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // create the png data from post-deflated data
+// undoes the filter on one row of x pixels. cur gets img_n channels, or out_n
+// with alpha = 255 added, though below 8 bits it gets the packed bytes instead;
+// prior is the row above it in the same layout, and isn't read for the first
+// row, whose filter has to be mapped through first_row_filter
+static void stbi__png_unfilter_row(stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int filter, stbi__uint32 x, int img_n, int out_n, int depth, stbi__unfilter_kernel unfilter[5])
+{
+	stbi__uint32 i;
+	int k;
+	int filter_bytes = img_n;
+	int width = x;
+
+	if (depth < 8) {
+		filter_bytes = 1;
+		width = ((img_n * x * depth) + 7) >> 3;
+	}
+
+	// handle first byte explicitly
+	for (k = 0; k < filter_bytes; ++k) {
+		switch (filter) {
+		case STBI__F_none: cur[k] = raw[k]; break;
+		case STBI__F_sub: cur[k] = raw[k]; break;
+		case STBI__F_up: cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
+		case STBI__F_avg: cur[k] = STBI__BYTECAST(raw[k] + (prior[k] >> 1)); break;
+		case STBI__F_paeth: cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0, prior[k], 0)); break;
+		case STBI__F_avg_first: cur[k] = raw[k]; break;
+		case STBI__F_paeth_first: cur[k] = raw[k]; break;
+		}
+	}
+
+	if (depth == 8) {
+		if (img_n != out_n)
+			cur[img_n] = 255; // first pixel
+		raw += img_n;
+		cur += out_n;
+		prior += out_n;
+	}
+	else {
+		raw += 1;
+		cur += 1;
+		prior += 1;
+	}
+
+	// this is a little gross, so that we don't switch per-pixel or per-component
+	if (depth < 8 || img_n == out_n) {
+		int nk = (width - 1)*img_n;
+#define CASE(f) \
+             case f:     \
+                for (k=0; k < nk; ++k)
+		switch (filter) {
+			// "none" filter turns into a memcpy here; make that explicit.
+		case STBI__F_none:         memcpy(cur, raw, nk); break;
+		case STBI__F_sub:
+		case STBI__F_up:
+		case STBI__F_avg:
+		case STBI__F_paeth:        unfilter[filter](cur, prior, raw, nk); break;
+			CASE(STBI__F_avg_first)    cur[k] = STBI__BYTECAST(raw[k] + (cur[k - filter_bytes] >> 1)); break;
+			CASE(STBI__F_paeth_first)  cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - filter_bytes], 0, 0)); break;
+		}
+#undef CASE
+	}
+	else {
+		STBI_ASSERT(img_n + 1 == out_n);
+#define CASE(f) \
+             case f:     \
+                for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
+                   for (k=0; k < img_n; ++k)
+		switch (filter) {
+			CASE(STBI__F_none)         cur[k] = raw[k]; break;
+			CASE(STBI__F_sub)          cur[k] = STBI__BYTECAST(raw[k] + cur[k - out_n]); break;
+			CASE(STBI__F_up)           cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
+			CASE(STBI__F_avg)          cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k - out_n]) >> 1)); break;
+			CASE(STBI__F_paeth)        cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - out_n], prior[k], prior[k - out_n])); break;
+			CASE(STBI__F_avg_first)    cur[k] = STBI__BYTECAST(raw[k] + (cur[k - out_n] >> 1)); break;
+			CASE(STBI__F_paeth_first)  cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - out_n], 0, 0)); break;
+		}
+#undef CASE
+	}
+}
+
+// expands a row of x pixels packed at 1/2/4 bits from 'in' into 'cur', with
+// alpha = 255 added if out_n is img_n + 1. 'in' may be the tail end of 'cur'
+static void stbi__png_unpack_row(stbi_uc *cur, stbi_uc *in, stbi__uint32 x, int img_n, int out_n, int depth, int color)
+{
+	int k;
+	stbi_uc *out = cur;
+	// unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+	// png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+	stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+
+																	   // note that the final byte might overshoot and write more data than desired.
+																	   // we can allocate enough data that this never writes out of memory, but it
+																	   // could also overwrite the next scanline. can it overwrite non-empty data
+																	   // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+																	   // so we need to explicitly clamp the final ones
+
+	if (depth == 4) {
+		for (k = x*img_n; k >= 2; k -= 2, ++in) {
+			*cur++ = scale * ((*in >> 4));
+			*cur++ = scale * ((*in) & 0x0f);
+		}
+		if (k > 0) *cur++ = scale * ((*in >> 4));
+	}
+	else if (depth == 2) {
+		for (k = x*img_n; k >= 4; k -= 4, ++in) {
+			*cur++ = scale * ((*in >> 6));
+			*cur++ = scale * ((*in >> 4) & 0x03);
+			*cur++ = scale * ((*in >> 2) & 0x03);
+			*cur++ = scale * ((*in) & 0x03);
+		}
+		if (k > 0) *cur++ = scale * ((*in >> 6));
+		if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+		if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+	}
+	else if (depth == 1) {
+		for (k = x*img_n; k >= 8; k -= 8, ++in) {
+			*cur++ = scale * ((*in >> 7));
+			*cur++ = scale * ((*in >> 6) & 0x01);
+			*cur++ = scale * ((*in >> 5) & 0x01);
+			*cur++ = scale * ((*in >> 4) & 0x01);
+			*cur++ = scale * ((*in >> 3) & 0x01);
+			*cur++ = scale * ((*in >> 2) & 0x01);
+			*cur++ = scale * ((*in >> 1) & 0x01);
+			*cur++ = scale * ((*in) & 0x01);
+		}
+		if (k > 0) *cur++ = scale * ((*in >> 7));
+		if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+		if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+		if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+		if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+		if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+		if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
+	}
+	if (img_n != out_n) {
+		int q;
+		// insert alpha = 255
+		cur = out;
+		if (img_n == 1) {
+			for (q = x - 1; q >= 0; --q) {
+				cur[q * 2 + 1] = 255;
+				cur[q * 2 + 0] = cur[q];
+			}
+		}
+		else {
+			STBI_ASSERT(img_n == 3);
+			for (q = x - 1; q >= 0; --q) {
+				cur[q * 4 + 3] = 255;
+				cur[q * 4 + 2] = cur[q * 3 + 2];
+				cur[q * 4 + 1] = cur[q * 3 + 1];
+				cur[q * 4 + 0] = cur[q * 3 + 0];
+			}
+		}
+	}
+}
+
 static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
 {
 	stbi__context *s = a->s;
-	stbi__uint32 i, j, stride = x*out_n;
+	stbi__uint32 j, stride = x*out_n;
 	stbi__uint32 img_len, img_width_bytes;
-	int k;
 	int img_n = s->img_n; // copy it into a local for later
+	stbi__unfilter_kernel unfilter[5];
 
 	STBI_ASSERT(out_n == s->img_n || out_n == s->img_n + 1);
 	a->out = (stbi_uc *)stbi__malloc(x * y * out_n); // extra bytes to write off the end into
@@ -4025,6 +7815,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
 
 	img_width_bytes = (((img_n * x * depth) + 7) >> 3);
 	img_len = (img_width_bytes + 1) * y;
+	stbi__setup_png_unfilter(unfilter, depth < 8 ? 1 : img_n);
 	if (s->img_x == x && s->img_y == y) {
 		if (raw_len != img_len) return stbi__err("not enough pixels", "Corrupt PNG");
 	}
@@ -4034,85 +7825,21 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
 
 	for (j = 0; j < y; ++j) {
 		stbi_uc *cur = a->out + stride*j;
-		stbi_uc *prior = cur - stride;
 		int filter = *raw++;
-		int filter_bytes = img_n;
-		int width = x;
 		if (filter > 4)
 			return stbi__err("invalid filter", "Corrupt PNG");
 
 		if (depth < 8) {
 			STBI_ASSERT(img_width_bytes <= x);
 			cur += x*out_n - img_width_bytes; // store output to the rightmost img_len bytes, so we can decode in place
-			filter_bytes = 1;
-			width = img_width_bytes;
 		}
 
 		// if first row, use special filter that doesn't sample previous row
 		if (j == 0) filter = first_row_filter[filter];
 
-		// handle first byte explicitly
-		for (k = 0; k < filter_bytes; ++k) {
-			switch (filter) {
-			case STBI__F_none: cur[k] = raw[k]; break;
-			case STBI__F_sub: cur[k] = raw[k]; break;
-			case STBI__F_up: cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-			case STBI__F_avg: cur[k] = STBI__BYTECAST(raw[k] + (prior[k] >> 1)); break;
-			case STBI__F_paeth: cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(0, prior[k], 0)); break;
-			case STBI__F_avg_first: cur[k] = raw[k]; break;
-			case STBI__F_paeth_first: cur[k] = raw[k]; break;
-			}
-		}
-
-		if (depth == 8) {
-			if (img_n != out_n)
-				cur[img_n] = 255; // first pixel
-			raw += img_n;
-			cur += out_n;
-			prior += out_n;
-		}
-		else {
-			raw += 1;
-			cur += 1;
-			prior += 1;
-		}
-
-		// this is a little gross, so that we don't switch per-pixel or per-component
-		if (depth < 8 || img_n == out_n) {
-			int nk = (width - 1)*img_n;
-#define CASE(f) \
-             case f:     \
-                for (k=0; k < nk; ++k)
-			switch (filter) {
-				// "none" filter turns into a memcpy here; make that explicit.
-			case STBI__F_none:         memcpy(cur, raw, nk); break;
-				CASE(STBI__F_sub)          cur[k] = STBI__BYTECAST(raw[k] + cur[k - filter_bytes]); break;
-				CASE(STBI__F_up)           cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-				CASE(STBI__F_avg)          cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k - filter_bytes]) >> 1)); break;
-				CASE(STBI__F_paeth)        cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - filter_bytes], prior[k], prior[k - filter_bytes])); break;
-				CASE(STBI__F_avg_first)    cur[k] = STBI__BYTECAST(raw[k] + (cur[k - filter_bytes] >> 1)); break;
-				CASE(STBI__F_paeth_first)  cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - filter_bytes], 0, 0)); break;
-			}
-#undef CASE
-			raw += nk;
-		}
-		else {
-			STBI_ASSERT(img_n + 1 == out_n);
-#define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-			switch (filter) {
-				CASE(STBI__F_none)         cur[k] = raw[k]; break;
-				CASE(STBI__F_sub)          cur[k] = STBI__BYTECAST(raw[k] + cur[k - out_n]); break;
-				CASE(STBI__F_up)           cur[k] = STBI__BYTECAST(raw[k] + prior[k]); break;
-				CASE(STBI__F_avg)          cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k - out_n]) >> 1)); break;
-				CASE(STBI__F_paeth)        cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - out_n], prior[k], prior[k - out_n])); break;
-				CASE(STBI__F_avg_first)    cur[k] = STBI__BYTECAST(raw[k] + (cur[k - out_n] >> 1)); break;
-				CASE(STBI__F_paeth_first)  cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k - out_n], 0, 0)); break;
-			}
-#undef CASE
-		}
+		// the row above was stored at the same offset
+		stbi__png_unfilter_row(cur, cur - stride, raw, filter, x, img_n, out_n, depth, unfilter);
+		raw += img_width_bytes;
 	}
 
 	// we make a separate pass to expand bits to pixels; for performance,
@@ -4121,127 +7848,100 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
 	if (depth < 8) {
 		for (j = 0; j < y; ++j) {
 			stbi_uc *cur = a->out + stride*j;
-			stbi_uc *in = a->out + stride*j + x*out_n - img_width_bytes;
-			// unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-			// png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-			stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-																			   // note that the final byte might overshoot and write more data than desired.
-																			   // we can allocate enough data that this never writes out of memory, but it
-																			   // could also overwrite the next scanline. can it overwrite non-empty data
-																			   // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-																			   // so we need to explicitly clamp the final ones
-
-			if (depth == 4) {
-				for (k = x*img_n; k >= 2; k -= 2, ++in) {
-					*cur++ = scale * ((*in >> 4));
-					*cur++ = scale * ((*in) & 0x0f);
-				}
-				if (k > 0) *cur++ = scale * ((*in >> 4));
-			}
-			else if (depth == 2) {
-				for (k = x*img_n; k >= 4; k -= 4, ++in) {
-					*cur++ = scale * ((*in >> 6));
-					*cur++ = scale * ((*in >> 4) & 0x03);
-					*cur++ = scale * ((*in >> 2) & 0x03);
-					*cur++ = scale * ((*in) & 0x03);
-				}
-				if (k > 0) *cur++ = scale * ((*in >> 6));
-				if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-				if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-			}
-			else if (depth == 1) {
-				for (k = x*img_n; k >= 8; k -= 8, ++in) {
-					*cur++ = scale * ((*in >> 7));
-					*cur++ = scale * ((*in >> 6) & 0x01);
-					*cur++ = scale * ((*in >> 5) & 0x01);
-					*cur++ = scale * ((*in >> 4) & 0x01);
-					*cur++ = scale * ((*in >> 3) & 0x01);
-					*cur++ = scale * ((*in >> 2) & 0x01);
-					*cur++ = scale * ((*in >> 1) & 0x01);
-					*cur++ = scale * ((*in) & 0x01);
-				}
-				if (k > 0) *cur++ = scale * ((*in >> 7));
-				if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-				if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-				if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-				if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-				if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-				if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-			}
-			if (img_n != out_n) {
-				int q;
-				// insert alpha = 255
-				cur = a->out + stride*j;
-				if (img_n == 1) {
-					for (q = x - 1; q >= 0; --q) {
-						cur[q * 2 + 1] = 255;
-						cur[q * 2 + 0] = cur[q];
-					}
-				}
-				else {
-					STBI_ASSERT(img_n == 3);
-					for (q = x - 1; q >= 0; --q) {
-						cur[q * 4 + 3] = 255;
-						cur[q * 4 + 2] = cur[q * 3 + 2];
-						cur[q * 4 + 1] = cur[q * 3 + 1];
-						cur[q * 4 + 0] = cur[q * 3 + 0];
-					}
-				}
-			}
+			stbi__png_unpack_row(cur, cur + x*out_n - img_width_bytes, x, img_n, out_n, depth, color);
 		}
 	}
 
 	return 1;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
+// size of the filtered scanlines the zlib stream inflates to, adding up the
+// seven reduced images for an interlaced one
+static stbi__uint32 stbi__png_raw_len(stbi__uint32 w, stbi__uint32 h, int n, int depth, int interlaced)
 {
-	stbi_uc *final;
+	static const int xorig[] = { 0,4,0,2,0,1,0 };
+	static const int yorig[] = { 0,0,4,0,2,0,1 };
+	static const int xspc[] = { 8,8,4,4,2,2,1 };
+	static const int yspc[] = { 8,8,8,4,4,2,2 };
+	stbi__uint32 len = 0;
 	int p;
 	if (!interlaced)
-		return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
-
-	// de-interlacing
-	final = (stbi_uc *)stbi__malloc(a->s->img_x * a->s->img_y * out_n);
+		return (((w * n * depth) + 7) >> 3) * h + h /* filter mode per row */;
 	for (p = 0; p < 7; ++p) {
-		int xorig[] = { 0,4,0,2,0,1,0 };
-		int yorig[] = { 0,0,4,0,2,0,1 };
-		int xspc[] = { 8,8,4,4,2,2,1 };
-		int yspc[] = { 8,8,8,4,4,2,2 };
-		int i, j, x, y;
-		// pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-		x = (a->s->img_x - xorig[p] + xspc[p] - 1) / xspc[p];
-		y = (a->s->img_y - yorig[p] + yspc[p] - 1) / yspc[p];
-		if (x && y) {
-			stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-			if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-				STBI_FREE(final);
-				return 0;
-			}
-			for (j = 0; j < y; ++j) {
-				for (i = 0; i < x; ++i) {
-					int out_y = j*yspc[p] + yorig[p];
-					int out_x = i*xspc[p] + xorig[p];
-					memcpy(final + out_y*a->s->img_x*out_n + out_x*out_n,
-						a->out + (j*x + i)*out_n, out_n);
-				}
-			}
-			STBI_FREE(a->out);
-			image_data += img_len;
-			image_data_len -= img_len;
+		stbi__uint32 x = (w - xorig[p] + xspc[p] - 1) / xspc[p];
+		stbi__uint32 y = (h - yorig[p] + yspc[p] - 1) / yspc[p];
+		if (x && y)
+			len += ((((n * x * depth) + 7) >> 3) + 1) * y;
+	}
+	return len;
+}
+
+static const int stbi__adam7_xorig[] = { 0,4,0,2,0,1,0 };
+static const int stbi__adam7_yorig[] = { 0,0,4,0,2,0,1 };
+static const int stbi__adam7_xspc[] = { 8,8,4,4,2,2,1 };
+static const int stbi__adam7_yspc[] = { 8,8,8,4,4,2,2 };
+
+// the size of pass p's filtered data, 0 if the pass is empty
+static stbi__uint32 stbi__png_pass_len(stbi__png *a, int p, int depth)
+{
+	// pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
+	stbi__uint32 x = (a->s->img_x - stbi__adam7_xorig[p] + stbi__adam7_xspc[p] - 1) / stbi__adam7_xspc[p];
+	stbi__uint32 y = (a->s->img_y - stbi__adam7_yorig[p] + stbi__adam7_yspc[p] - 1) / stbi__adam7_yspc[p];
+	if (!x || !y) return 0;
+	return ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
+}
+
+// unfilters the next pass and scatters its pixels into a->final
+static int stbi__png_deinterlace_pass(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color)
+{
+	int p = a->passes++;
+	int i, j, x, y;
+	x = (a->s->img_x - stbi__adam7_xorig[p] + stbi__adam7_xspc[p] - 1) / stbi__adam7_xspc[p];
+	y = (a->s->img_y - stbi__adam7_yorig[p] + stbi__adam7_yspc[p] - 1) / stbi__adam7_yspc[p];
+	if (!x || !y) return 1;
+	if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color))
+		return 0;
+	for (j = 0; j < y; ++j) {
+		for (i = 0; i < x; ++i) {
+			int out_y = j*stbi__adam7_yspc[p] + stbi__adam7_yorig[p];
+			int out_x = i*stbi__adam7_xspc[p] + stbi__adam7_xorig[p];
+			memcpy(a->final + out_y*a->s->img_x*out_n + out_x*out_n,
+				a->out + (j*x + i)*out_n, out_n);
 		}
 	}
-	a->out = final;
+	STBI_FREE(a->out);
+	a->out = NULL;
+	return 1;
+}
+
+static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
+{
+	int p;
+	if (!interlaced)
+		return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+
+	// de-interlacing, after whatever passes the previews already did
+	if (!a->final) {
+		a->final = (stbi_uc *)stbi__malloc(a->s->img_x * a->s->img_y * out_n);
+		if (!a->final) return stbi__err("outofmem", "Out of memory");
+		a->passes = 0;
+	}
+	for (p = 0; p < 7; ++p) {
+		stbi__uint32 img_len = stbi__png_pass_len(a, p, depth);
+		if (p >= a->passes && !stbi__png_deinterlace_pass(a, image_data, image_data_len, out_n, depth, color))
+			return 0;
+		image_data += img_len;
+		image_data_len -= img_len;
+	}
+	a->out = a->final;
+	a->final = NULL;
 
 	return 1;
 }
 
-static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
+static int stbi__compute_transparency(stbi_uc *p, stbi__uint32 pixel_count, stbi_uc tc[3], int out_n)
 {
-	stbi__context *s = z->s;
-	stbi__uint32 i, pixel_count = s->img_x * s->img_y;
-	stbi_uc *p = z->out;
+	stbi__uint32 i;
 
 	// compute color-based transparency, assuming we've
 	// already got 255 as the alpha value in the output
@@ -4263,17 +7963,10 @@ static int stbi__compute_transparency(stbi__png *z, stbi_uc tc[3], int out_n)
 	return 1;
 }
 
-static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+// looks up 'pixel_count' palette indices, writing pal_img_n channels for each
+static void stbi__expand_palette_row(stbi_uc *p, stbi_uc const *orig, stbi__uint32 pixel_count, stbi_uc const *palette, int pal_img_n)
 {
-	stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-	stbi_uc *p, *temp_out, *orig = a->out;
-
-	p = (stbi_uc *)stbi__malloc(pixel_count * pal_img_n);
-	if (p == NULL) return stbi__err("outofmem", "Out of memory");
-
-	// between here and free(out) below, exitting would leak
-	temp_out = p;
-
+	stbi__uint32 i;
 	if (pal_img_n == 3) {
 		for (i = 0; i < pixel_count; ++i) {
 			int n = orig[i] * 4;
@@ -4293,6 +7986,17 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
 			p += 4;
 		}
 	}
+}
+
+static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
+{
+	stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+	stbi_uc *temp_out;
+
+	temp_out = (stbi_uc *)stbi__malloc(pixel_count * pal_img_n);
+	if (temp_out == NULL) return stbi__err("outofmem", "Out of memory");
+
+	stbi__expand_palette_row(temp_out, a->out, pixel_count, palette, pal_img_n);
 	STBI_FREE(a->out);
 	a->out = temp_out;
 
@@ -4301,17 +8005,24 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
 	return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
-
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
-	stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+	stbi__unpremultiply_on_load_global = flag_true_if_should_unpremultiply;
 }
 
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 {
-	stbi__de_iphone_flag = flag_true_if_should_convert;
+	stbi__de_iphone_flag_global = flag_true_if_should_convert;
+}
+
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply)
+{
+	stbi__set_thread(stbi__unpremultiply_on_load, flag_true_if_should_unpremultiply);
+}
+
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert)
+{
+	stbi__set_thread(stbi__de_iphone_flag, flag_true_if_should_convert);
 }
 
 static void stbi__de_iphone(stbi__png *z)
@@ -4361,6 +8072,338 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((a) << 24) + ((b) << 16) + ((c) << 8) + (d))
 
+// streamed decoding, for the stbi_load_rows family: instead of gathering the
+// IDAT chunks and inflating the whole image, the chunks are read a piece at a
+// time and inflated into a window that's handed over whenever it fills up, so
+// each row is unfiltered, expanded and passed on as soon as it's complete.
+// only the rows not yet handed over and the 32k zlib can refer back to are
+// kept, plus the previous row for unfiltering
+
+#define STBI__PNG_STREAM_IN      16384
+#define STBI__PNG_STREAM_WINDOW  (4 * 32768)
+
+typedef struct
+{
+	stbi__zbuf z; // first, so the zlib hooks can get back here
+	stbi__context *s;
+	stbi__rows *rows;
+	stbi__uint32 chunk_left;  // bytes of the current IDAT not yet read
+	int idat_done;
+	stbi_uc *in;              // input, after a copy of the last 8 bytes read
+	char *window, *next;      // inflated data, and the next row in it not handed over
+	char *window_end;
+	stbi__uint32 row, row_len;
+	int img_n, out_n, depth, color, pal_img_n, has_trans;
+	stbi_uc *line[2];         // this row and the one above, unfiltered
+	stbi_uc *unpacked, *expanded;
+	stbi_uc *palette, *tc;
+	stbi__unfilter_kernel unfilter[5];
+} stbi__png_stream;
+
+static int stbi__png_stream_refill(stbi__zbuf *z)
+{
+	stbi__png_stream *st = (stbi__png_stream *)z;
+	stbi__uint32 n;
+	while (st->chunk_left == 0) {
+		stbi__pngchunk c;
+		if (st->idat_done) return 0;
+		stbi__get32be(st->s); // CRC of the IDAT just finished
+		c = stbi__get_chunk_header(st->s);
+		if (c.type != STBI__PNG_TYPE('I', 'D', 'A', 'T')) {
+			st->idat_done = 1;
+			return 0;
+		}
+		st->chunk_left = c.length;
+	}
+	// a stored block header can hand back a few bytes the bit buffer took
+	// too many of, so the tail of the last piece stays in front of the next
+	memmove(st->in - 8, z->zbuffer_end - 8, 8);
+	n = st->chunk_left < STBI__PNG_STREAM_IN ? st->chunk_left : STBI__PNG_STREAM_IN;
+	if (!stbi__getn(st->s, st->in, n)) {
+		st->idat_done = 1;
+		return 0;
+	}
+	st->chunk_left -= n;
+	z->zbuffer = st->in;
+	z->zbuffer_end = st->in + n;
+	return 1;
+}
+
+static int stbi__png_stream_row(stbi__png_stream *st, stbi_uc *raw)
+{
+	stbi__uint32 x = st->s->img_x, j = st->row;
+	stbi_uc *cur = st->line[j & 1], *pixels = cur;
+	int filter = *raw++;
+	if (filter > 4) return stbi__err("invalid filter", "Corrupt PNG");
+	if (j == 0) filter = first_row_filter[filter];
+	stbi__png_unfilter_row(cur, st->line[~j & 1], raw, filter, x, st->img_n, st->out_n, st->depth, st->unfilter);
+	if (st->depth < 8) {
+		stbi__png_unpack_row(st->unpacked, cur, x, st->img_n, st->out_n, st->depth, st->color);
+		pixels = st->unpacked;
+	}
+	// this only writes alpha, which unfiltering the next row doesn't read
+	if (st->has_trans)
+		stbi__compute_transparency(pixels, x, st->tc, st->out_n);
+	if (st->pal_img_n) {
+		stbi__expand_palette_row(st->expanded, pixels, x, st->palette, st->pal_img_n);
+		pixels = st->expanded;
+	}
+	return stbi__rows_emit(st->rows, j, pixels, x, st->s->img_y, st->pal_img_n ? st->pal_img_n : st->out_n);
+}
+
+// the rows the callback wants, which it can cut short once it's seen the first
+static stbi__uint32 stbi__png_stream_wanted(stbi__png_stream *st)
+{
+	stbi__uint32 limit = (stbi__uint32)st->rows->limit;
+	return limit < st->s->img_y ? limit : st->s->img_y;
+}
+
+static int stbi__png_stream_flush(stbi__zbuf *z, int n)
+{
+	stbi__png_stream *st = (stbi__png_stream *)z;
+	stbi__uint32 left;
+	char *keep;
+	while (st->row < stbi__png_stream_wanted(st) && (stbi__uint32)(z->zout - st->next) >= st->row_len) {
+		if (!stbi__png_stream_row(st, (stbi_uc *)st->next)) return 0;
+		st->next += st->row_len;
+		++st->row;
+	}
+	if (st->row == stbi__png_stream_wanted(st)) {
+		// that's the whole image, or all of it that's wanted; whatever else
+		// is in the stream is ignored
+		z->z_full = 1;
+		return 0;
+	}
+	// slide down the last 32k and the partial row, whichever reaches back further
+	keep = z->zout - 32768;
+	if (keep > st->next) keep = st->next;
+	if (keep > z->zout_start) {
+		ptrdiff_t len = z->zout - keep;
+		memmove(z->zout_start, keep, len);
+		st->next -= keep - z->zout_start;
+		z->zout = z->zout_start + len;
+	}
+	// like the whole-image decode's buffer, the output ends where the wanted
+	// image data does, so inflating stops there instead of running on into whatever
+	// follows; a match that runs past it still gets its room
+	left = (stbi__png_stream_wanted(st) - st->row) * st->row_len - (stbi__uint32)(z->zout - st->next);
+	z->zout_end = z->zout + (left > (stbi__uint32)n ? left : (stbi__uint32)n);
+	if (z->zout_end > st->window_end) z->zout_end = st->window_end;
+	return 1;
+}
+
+static int stbi__stream_png_image(stbi__png *p, stbi__uint32 idat_len, int depth, int color, int pal_img_n, stbi_uc *palette, int has_trans, stbi_uc *tc)
+{
+	stbi__context *s = p->s;
+	stbi__png_stream st;
+	stbi__uint32 x = s->img_x, line_len, window_len;
+	int ok;
+
+	st.s = s;
+	st.rows = p->rows;
+	st.img_n = s->img_n;
+	st.out_n = s->img_n + (has_trans ? 1 : 0);
+	st.depth = depth;
+	st.color = color;
+	st.pal_img_n = pal_img_n;
+	st.has_trans = has_trans;
+	st.palette = palette;
+	st.tc = tc;
+	st.row = 0;
+	st.row_len = (((st.img_n * x * depth) + 7) >> 3) + 1;
+	// the window always has room for a whole row and a longest match past
+	// what's kept, so each slide makes room for several rows
+	line_len = x * st.out_n;
+	window_len = STBI__PNG_STREAM_WINDOW + 2 * st.row_len;
+	st.window = (char *)stbi__malloc((size_t)window_len + 3 * (size_t)line_len + (size_t)x * 4 + 8 + STBI__PNG_STREAM_IN);
+	if (!st.window) return stbi__err("outofmem", "Out of memory");
+	st.line[0] = (stbi_uc *)st.window + window_len;
+	st.line[1] = st.line[0] + line_len;
+	st.unpacked = st.line[1] + line_len;
+	st.expanded = st.unpacked + line_len;
+	st.in = st.expanded + (size_t)x * 4 + 8;
+	stbi__setup_png_unfilter(st.unfilter, depth < 8 ? 1 : st.img_n);
+
+	st.chunk_left = idat_len;
+	st.idat_done = 0;
+	st.z.zbuffer = st.z.zbuffer_end = st.in;
+	st.z.zout_start = st.z.zout = st.next = st.window;
+	st.window_end = st.window + window_len;
+	st.z.zout_end = st.row_len * s->img_y < window_len ? st.window + st.row_len * s->img_y : st.window_end;
+	st.z.z_expandable = 1;
+	st.z.z_full = 0;
+	st.z.z_eof = 0;
+	st.z.zrefill = stbi__png_stream_refill;
+	st.z.zflush = stbi__png_stream_flush;
+	ok = stbi__parse_zlib(&st.z, 1);
+	if (ok)
+		ok = stbi__png_stream_flush(&st.z, 0); // the rows still in the window
+	if (st.row == stbi__png_stream_wanted(&st))
+		ok = 1; // flushing stops inflating once every row is out
+	else if (ok)
+		ok = stbi__err("not enough pixels", "Corrupt PNG");
+	STBI_FREE(st.window);
+
+	if (pal_img_n)
+		s->img_n = pal_img_n;
+	s->img_out_n = pal_img_n ? pal_img_n : st.out_n;
+	return ok;
+}
+
+// previews of interlaced images, for stbi_load_progressive: the zlib stream
+// is inflated with a hook at the end of each pass, which de-interlaces the
+// pass right away. after the first six passes, every pixel that's known
+// stands in for the block of the image that isn't yet, like a blocky
+// version of the full image: 1/8 of the size after the first pass, full
+// width and half height after the sixth
+
+typedef struct
+{
+	stbi__zbuf z; // first, so the zflush hook can get back here
+	stbi__png *png;
+	stbi__uint32 raw_len;
+	stbi__uint32 pass_end[7];  // where each pass's data ends
+	int out_n, depth, color, pal_img_n, has_trans, req_comp;
+	stbi_uc *palette, *tc;
+} stbi__png_previewer;
+
+// the known pixels after pass p, converted as the final image will be, and
+// blown up to fill the image
+static int stbi__png_preview(stbi__png_previewer *pv, int p)
+{
+	stbi__png *a = pv->png;
+	stbi__uint32 w = a->s->img_x, h = a->s->img_y;
+	// the known pixels are every xs'th one of every ys'th row
+	int xs = 8 >> ((p + 1) >> 1), ys = 8 >> (p >> 1);
+	stbi__uint32 lw = (w + xs - 1) / xs, lh = (h + ys - 1) / ys, i, j, k;
+	int n = pv->out_n;
+	stbi_uc *low, *src, *dest;
+
+	low = (stbi_uc *)stbi__malloc((size_t)lw * lh * 4);
+	if (!low) return stbi__err("outofmem", "Out of memory");
+	for (j = 0; j < lh; ++j)
+		for (i = 0; i < lw; ++i)
+			memcpy(low + (j * lw + i) * n, a->final + ((size_t)j * ys * w + (size_t)i * xs) * n, n);
+	if (pv->has_trans)
+		stbi__compute_transparency(low, lw * lh, pv->tc, n);
+	if (pv->pal_img_n) {
+		// the indices are expanded in place, from the back
+		src = low + lw * lh - 1;
+		dest = low + (lw * lh - 1) * pv->pal_img_n;
+		for (i = 0; i < lw * lh; ++i, --src, dest -= pv->pal_img_n)
+			stbi__expand_palette_row(dest, src, 1, pv->palette, pv->pal_img_n);
+		n = pv->pal_img_n;
+	}
+	if (pv->req_comp && pv->req_comp != n) {
+		low = stbi__convert_format(low, n, pv->req_comp, lw, lh);
+		if (!low) return 0;
+		n = pv->req_comp;
+	}
+
+	if (!a->view) {
+		a->view = (stbi_uc *)stbi__malloc((size_t)w * h * n);
+		if (!a->view) {
+			STBI_FREE(low);
+			return stbi__err("outofmem", "Out of memory");
+		}
+	}
+	for (j = 0; j < h; ++j) {
+		dest = a->view + (size_t)j * w * n;
+		if (j % ys) {
+			memcpy(dest, dest - (size_t)w * n, (size_t)w * n);
+			continue;
+		}
+		src = low + (size_t)(j / ys) * lw * n;
+		for (i = 0; i < w; i += xs, src += n)
+			for (k = 0; k < (stbi__uint32)xs && i + k < w; ++k, dest += n)
+				memcpy(dest, src, n);
+	}
+	STBI_FREE(low);
+
+	if (!a->preview(a->preview_user, p + 1, a->view, w, h, n))
+		return stbi__err("stopped", "Preview callback stopped decoding");
+	return 1;
+}
+
+static int stbi__png_preview_flush(stbi__zbuf *z, int n)
+{
+	stbi__png_previewer *pv = (stbi__png_previewer *)z;
+	stbi__png *a = pv->png;
+	stbi__uint32 done = (stbi__uint32)(z->zout - z->zout_start);
+	while (a->passes < 7 && done >= pv->pass_end[a->passes]) {
+		int p = a->passes;
+		stbi_uc *data = (stbi_uc *)z->zout_start + (p ? pv->pass_end[p - 1] : 0);
+		if (!stbi__png_deinterlace_pass(a, data, pv->pass_end[p] - (p ? pv->pass_end[p - 1] : 0), pv->out_n, pv->depth, pv->color))
+			return 0;
+		if (p < 6 && pv->pass_end[p] > (p ? pv->pass_end[p - 1] : 0) && !stbi__png_preview(pv, p))
+			return 0;
+	}
+	if (done >= pv->raw_len) {
+		// that's the whole image; whatever else is in the stream is ignored
+		z->z_full = 1;
+		return 0;
+	}
+	// the output has room for a longest match past the end, so a match
+	// running into the next pass can always be finished first; stored
+	// blocks just copy what fits
+	z->zout_end = z->zout_start + pv->pass_end[a->passes];
+	if (z->zout_end < z->zout + n) z->zout_end = z->zout + n;
+	if (z->zout_end > z->zout_start + pv->raw_len + 258) z->zout_end = z->zout_start + pv->raw_len + 258;
+	// the last pass ends the buffer, as stbi__zlib_decode_exact's does, so a
+	// match running past the image data fills it up and stops there
+	if (z->zout_end == z->zout_start + pv->raw_len) z->z_expandable = 0;
+	return 1;
+}
+
+static stbi_uc *stbi__png_inflate_previewed(stbi__png *a, stbi__uint32 idata_len, stbi__uint32 raw_len, stbi__uint32 *out_len, int out_n, int depth, int color, int pal_img_n, stbi_uc *palette, int has_trans, stbi_uc *tc, int req_comp)
+{
+	stbi__png_previewer pv;
+	char *raw;
+	int p, ok;
+
+	a->final = (stbi_uc *)stbi__malloc((size_t)a->s->img_x * a->s->img_y * out_n);
+	raw = (char *)stbi__malloc((size_t)raw_len + 258);
+	if (!a->final || !raw) {
+		STBI_FREE(raw);
+		return stbi__errpuc("outofmem", "Out of memory");
+	}
+	a->passes = 0;
+	pv.png = a;
+	pv.raw_len = raw_len;
+	for (p = 0; p < 7; ++p)
+		pv.pass_end[p] = (p ? pv.pass_end[p - 1] : 0) + stbi__png_pass_len(a, p, depth);
+	pv.out_n = out_n;
+	pv.depth = depth;
+	pv.color = color;
+	pv.pal_img_n = pal_img_n;
+	pv.has_trans = has_trans;
+	pv.req_comp = req_comp;
+	pv.palette = palette;
+	pv.tc = tc;
+
+	pv.z.zbuffer = a->idata;
+	pv.z.zbuffer_end = a->idata + idata_len;
+	pv.z.zout_start = pv.z.zout = raw;
+	pv.z.zout_end = raw + pv.pass_end[0];
+	pv.z.z_expandable = pv.pass_end[0] < raw_len;
+	pv.z.z_full = 0;
+	pv.z.z_eof = 0;
+	pv.z.zrefill = NULL;
+	pv.z.zflush = stbi__png_preview_flush;
+	ok = stbi__parse_zlib(&pv.z, 1);
+	if (ok)
+		ok = stbi__png_preview_flush(&pv.z, 0) || pv.z.z_full; // passes that ended the stream
+	// as with stbi__zlib_decode_exact, running out of room is fine unless it's
+	// made up of the zeros read past the end of the input
+	if (ok || (pv.z.z_full && pv.z.z_eof * 8 <= pv.z.num_bits)) {
+		*out_len = (stbi__uint32)(pv.z.zout - pv.z.zout_start);
+		if (*out_len > raw_len) *out_len = raw_len;
+		return (stbi_uc *)raw;
+	}
+	STBI_FREE(raw);
+	return NULL;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
 	stbi_uc palette[1024], pal_img_n = 0;
@@ -4372,6 +8415,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 	z->expanded = NULL;
 	z->idata = NULL;
 	z->out = NULL;
+	z->final = NULL;
+	z->view = NULL;
 
 	if (!stbi__check_png_header(s)) return 0;
 
@@ -4452,6 +8497,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 			if (first) return stbi__err("first not IHDR", "Corrupt PNG");
 			if (pal_img_n && !pal_len) return stbi__err("no PLTE", "Corrupt PNG");
 			if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+			if (z->rows && !interlace && !is_iphone)
+				return stbi__stream_png_image(z, c.length, depth, color, pal_img_n, palette, has_trans, tc);
 			if ((int)(ioff + c.length) < (int)ioff) return 0;
 			if (ioff + c.length > idata_limit) {
 				stbi__uint32 idata_limit_old = idata_limit;
@@ -4469,23 +8516,25 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 		}
 
 		case STBI__PNG_TYPE('I', 'E', 'N', 'D'): {
-			stbi__uint32 raw_len, bpl;
+			stbi__uint32 raw_len;
 			if (first) return stbi__err("first not IHDR", "Corrupt PNG");
 			if (scan != STBI__SCAN_load) return 1;
 			if (z->idata == NULL) return stbi__err("no IDAT", "Corrupt PNG");
-			// initial guess for decoded data size to avoid unnecessary reallocs
-			bpl = (s->img_x * depth + 7) / 8; // bytes per line, per component
-			raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-			z->expanded = (stbi_uc *)stbi_zlib_decode_malloc_guesssize_headerflag((char *)z->idata, ioff, raw_len, (int *)&raw_len, !is_iphone);
-			if (z->expanded == NULL) return 0; // zlib should set error
-			STBI_FREE(z->idata); z->idata = NULL;
 			if ((req_comp == s->img_n + 1 && req_comp != 3 && !pal_img_n) || has_trans)
 				s->img_out_n = s->img_n + 1;
 			else
 				s->img_out_n = s->img_n;
+			// the exact decoded data size, so the output is allocated once
+			raw_len = stbi__png_raw_len(s->img_x, s->img_y, s->img_n, depth, interlace);
+			if (z->preview && interlace && !is_iphone)
+				z->expanded = stbi__png_inflate_previewed(z, ioff, raw_len, &raw_len, s->img_out_n, depth, color, pal_img_n, palette, has_trans, tc, req_comp);
+			else
+				z->expanded = (stbi_uc *)stbi__zlib_decode_exact((char *)z->idata, ioff, raw_len, (int *)&raw_len, !is_iphone);
+			if (z->expanded == NULL) return 0; // zlib should set error
+			STBI_FREE(z->idata); z->idata = NULL;
 			if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, depth, color, interlace)) return 0;
 			if (has_trans)
-				if (!stbi__compute_transparency(z, tc, s->img_out_n)) return 0;
+				if (!stbi__compute_transparency(z->out, s->img_x * s->img_y, tc, s->img_out_n)) return 0;
 			if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
 				stbi__de_iphone(z);
 			if (pal_img_n) {
@@ -4505,8 +8554,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 			if (first) return stbi__err("first not IHDR", "Corrupt PNG");
 			if ((c.type & (1 << 29)) == 0) {
 #ifndef STBI_NO_FAILURE_STRINGS
-				// not threadsafe
-				static char invalid_chunk[] = "XXXX PNG chunk not known";
+				// per thread, like the failure reason that points at it
+#ifdef STBI_THREAD_LOCAL
+				static STBI_THREAD_LOCAL
+#else
+				static
+#endif
+				char invalid_chunk[] = "XXXX PNG chunk not known";
 				invalid_chunk[0] = STBI__BYTECAST(c.type >> 24);
 				invalid_chunk[1] = STBI__BYTECAST(c.type >> 16);
 				invalid_chunk[2] = STBI__BYTECAST(c.type >> 8);
@@ -4537,10 +8591,19 @@ static unsigned char *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req
 		*x = p->s->img_x;
 		*y = p->s->img_y;
 		if (n) *n = p->s->img_out_n;
+		if (p->view) {
+			// the previews were drawn in the buffer the image goes in
+			memcpy(p->view, result, (size_t)*x * *y * p->s->img_out_n);
+			STBI_FREE(result);
+			result = p->view;
+			p->view = NULL;
+		}
 	}
 	STBI_FREE(p->out);      p->out = NULL;
 	STBI_FREE(p->expanded); p->expanded = NULL;
 	STBI_FREE(p->idata);    p->idata = NULL;
+	STBI_FREE(p->final);    p->final = NULL;
+	STBI_FREE(p->view);     p->view = NULL;
 
 	return result;
 }
@@ -4549,9 +8612,42 @@ static unsigned char *stbi__png_load(stbi__context *s, int *x, int *y, int *comp
 {
 	stbi__png p;
 	p.s = s;
+	p.rows = NULL;
+	p.preview = NULL;
+	return stbi__do_png(&p, x, y, comp, req_comp);
+}
+
+static unsigned char *stbi__png_load_progressive(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_preview_callback *preview, void *user)
+{
+	stbi__png p;
+	p.s = s;
+	p.rows = NULL;
+	p.preview = preview;
+	p.preview_user = user;
 	return stbi__do_png(&p, x, y, comp, req_comp);
 }
 
+static int stbi__png_load_rows(stbi__context *s, stbi__rows *r)
+{
+	stbi__png p;
+	int ok;
+	p.s = s;
+	p.rows = r;
+	p.preview = NULL;
+	ok = stbi__parse_png_file(&p, STBI__SCAN_load, 0);
+	if (ok && p.out) {
+		// interlaced (or iPhone) images can't be streamed, so were decoded whole
+		stbi__uint32 j, len = s->img_x * s->img_out_n;
+		for (j = 0; ok && j < s->img_y && (int)j < r->limit; ++j)
+			ok = stbi__rows_emit(r, j, p.out + j * len, s->img_x, s->img_y, s->img_out_n);
+	}
+	STBI_FREE(p.out);
+	STBI_FREE(p.expanded);
+	STBI_FREE(p.idata);
+	STBI_FREE(p.final);
+	return ok;
+}
+
 static int stbi__png_test(stbi__context *s)
 {
 	int r;
@@ -4576,6 +8672,8 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
 {
 	stbi__png p;
 	p.s = s;
+	p.rows = NULL;
+	p.preview = NULL;
 	return stbi__png_info_raw(&p, x, y, comp);
 }
 #endif
@@ -5649,7 +9747,8 @@ typedef struct
 typedef struct
 {
 	int w, h;
-	stbi_uc *out, *old_out;             // output buffer (always 4 components)
+	stbi_uc *out;                       // the canvas (always 4 components), carried from frame to frame
+	stbi_uc *old_out;                   // what the last frame covered, if it's to be restored
 	int flags, bgindex, ratio, transparent, eflags, delay;
 	stbi_uc  pal[256][4];
 	stbi_uc lpal[256][4];
@@ -5865,29 +9964,26 @@ static void stbi__fill_gif_background(stbi__gif *g, int x0, int y0, int x1, int
 	}
 }
 
-// this function is designed to support animated gifs, although stb_image doesn't support it
-static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, int req_comp)
+// the canvas before the first frame: the background color, but transparent
+static int stbi__gif_start(stbi__context *s, stbi__gif *g, int *comp)
 {
-	int i;
-	stbi_uc *prev_out = 0;
-
-	if (g->out == 0 && !stbi__gif_header(s, g, comp, 0))
+	if (!stbi__gif_header(s, g, comp, 0))
 		return 0; // stbi__g_failure_reason set by stbi__gif_header
-
-	prev_out = g->out;
 	g->out = (stbi_uc *)stbi__malloc(4 * g->w * g->h);
-	if (g->out == 0) return stbi__errpuc("outofmem", "Out of memory");
+	if (g->out == 0) return stbi__err("outofmem", "Out of memory");
+	stbi__fill_gif_background(g, 0, 0, 4 * g->w, 4 * g->w * g->h);
+	return 1;
+}
+
+// composites the next frame onto the canvas, once the last one has been
+// disposed of as its graphic control extension said. returns g->out, s at
+// the end of the stream, or NULL on error
+static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g)
+{
+	int i;
 
 	switch ((g->eflags & 0x1C) >> 2) {
-	case 0: // unspecified (also always used on 1st frame)
-		stbi__fill_gif_background(g, 0, 0, 4 * g->w, 4 * g->w * g->h);
-		break;
-	case 1: // do not dispose
-		if (prev_out) memcpy(g->out, prev_out, 4 * g->w * g->h);
-		g->old_out = prev_out;
-		break;
 	case 2: // dispose to background
-		if (prev_out) memcpy(g->out, prev_out, 4 * g->w * g->h);
 		stbi__fill_gif_background(g, g->start_x, g->start_y, g->max_x, g->max_y);
 		break;
 	case 3: // dispose to previous
@@ -5896,8 +9992,15 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 				memcpy(&g->out[i + g->start_x], &g->old_out[i + g->start_x], g->max_x - g->start_x);
 		}
 		break;
+	default: // unspecified, or do not dispose: the frame stays
+		break;
 	}
 
+	// a graphic control extension only applies to the image right after it
+	g->eflags = 0;
+	g->delay = 0;
+	g->transparent = -1;
+
 	for (;;) {
 		switch (stbi__get8(s)) {
 		case 0x2C: /* Image Descriptor */
@@ -5921,6 +10024,16 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 			g->cur_x = g->start_x;
 			g->cur_y = g->start_y;
 
+			// keep what's under the frame, to put back once it's been shown
+			if (((g->eflags & 0x1C) >> 2) == 3) {
+				if (!g->old_out) {
+					g->old_out = (stbi_uc *)stbi__malloc(4 * g->w * g->h);
+					if (!g->old_out) return stbi__errpuc("outofmem", "Out of memory");
+				}
+				for (i = g->start_y; i < g->max_y; i += 4 * g->w)
+					memcpy(&g->old_out[i + g->start_x], &g->out[i + g->start_x], g->max_x - g->start_x);
+			}
+
 			g->lflags = stbi__get8(s);
 
 			if (g->lflags & 0x40) {
@@ -5965,10 +10078,8 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 					g->delay = stbi__get16le(s);
 					g->transparent = stbi__get8(s);
 				}
-				else {
+				else
 					stbi__skip(s, len);
-					break;
-				}
 			}
 			while ((len = stbi__get8(s)) != 0)
 				stbi__skip(s, len);
@@ -5982,8 +10093,6 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 			return stbi__errpuc("unknown code", "Corrupt GIF");
 		}
 	}
-
-	STBI_NOTUSED(req_comp);
 }
 
 static stbi_uc *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req_comp)
@@ -5992,7 +10101,8 @@ static stbi_uc *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int
 	stbi__gif g;
 	memset(&g, 0, sizeof(g));
 
-	u = stbi__gif_load_next(s, &g, comp, req_comp);
+	if (stbi__gif_start(s, &g, comp))
+		u = stbi__gif_load_next(s, &g);
 	if (u == (stbi_uc *)s) u = 0;  // end of animated gif marker
 	if (u) {
 		*x = g.w;
@@ -6002,10 +10112,90 @@ static stbi_uc *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int
 	}
 	else if (g.out)
 		STBI_FREE(g.out);
+	STBI_FREE(g.old_out);
 
 	return u;
 }
 
+// reads past the rest of the stream without decoding it, noting each frame's
+// delay. anything that can't be read ends it, the way a trailer would
+static int stbi__gif_skim(stbi__context *s, int **delays)
+{
+	int count = 0, size = 0, delay = 0, len;
+	int *d = NULL, *grown;
+	for (;;) {
+		if (stbi__at_eof(s)) break;
+		len = stbi__get8(s);
+		if (len == 0x2C) { // Image Descriptor
+			int lflags;
+			stbi__skip(s, 8);
+			lflags = stbi__get8(s);
+			if (lflags & 0x80)
+				stbi__skip(s, 3 * (2 << (lflags & 7)));
+			stbi__get8(s); // LZW code size
+			while ((len = stbi__get8(s)) != 0)
+				stbi__skip(s, len);
+			if (delays) {
+				if (count == size) {
+					size = size ? size * 2 : 64;
+					grown = (int *)STBI_REALLOC(d, size * sizeof(int));
+					if (!grown) {
+						STBI_FREE(d);
+						return stbi__err("outofmem", "Out of memory") - 1;
+					}
+					d = grown;
+				}
+				d[count] = delay;
+			}
+			++count;
+			delay = 0;
+		}
+		else if (len == 0x21) { // Extension
+			if (stbi__get8(s) == 0xF9) { // Graphic Control Extension.
+				len = stbi__get8(s);
+				if (len == 4) {
+					stbi__get8(s);
+					delay = stbi__get16le(s);
+					stbi__get8(s);
+				}
+				else
+					stbi__skip(s, len);
+			}
+			while ((len = stbi__get8(s)) != 0)
+				stbi__skip(s, len);
+		}
+		else
+			break; // the trailer, or junk
+	}
+	if (delays) *delays = d;
+	return count;
+}
+
+struct stbi_gif_reader
+{
+	stbi__context s;
+	stbi__gif g;
+#ifndef STBI_NO_STDIO
+	FILE *f;        // the file stbi_gif_open opened, closed with the reader
+	FILE *unget;    // stbi_gif_open_from_file's, which gets back what was read ahead
+#endif
+	int done;
+};
+
+// takes the reader once its context is set up, and frees it on failure
+static stbi_gif_reader *stbi__gif_open(stbi_gif_reader *r, int *x, int *y)
+{
+	memset(&r->g, 0, sizeof(r->g));
+	r->done = 0;
+	if (!stbi__gif_start(&r->s, &r->g, NULL)) {
+		stbi_gif_close(r);
+		return NULL;
+	}
+	if (x) *x = r->g.w;
+	if (y) *y = r->g.h;
+	return r;
+}
+
 static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
 	return stbi__gif_info_raw(s, x, y, comp);
@@ -6462,6 +10652,12 @@ static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp)
 
 static int stbi__info_main(stbi__context *s, int *x, int *y, int *comp)
 {
+	// several of the per-format info functions write through these unconditionally
+	int info_dummy;
+	if (!x) x = &info_dummy;
+	if (!y) y = &info_dummy;
+	if (!comp) comp = &info_dummy;
+
 #ifndef STBI_NO_JPEG
 	if (stbi__jpeg_info(s, x, y, comp)) return 1;
 #endif
@@ -6539,6 +10735,187 @@ STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int
 	return stbi__info_main(&s, x, y, comp);
 }
 
+#ifndef STBI_NO_JPEG
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_jpeg_components_info(char const *filename, int *x, int *y, int *comp, int *h_samp, int *v_samp)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	int result;
+	if (!f) return stbi__err("can't fopen", "Unable to open file");
+	result = stbi_jpeg_components_info_from_file(f, x, y, comp, h_samp, v_samp);
+	fclose(f);
+	return result;
+}
+
+STBIDEF int stbi_jpeg_components_info_from_file(FILE *f, int *x, int *y, int *comp, int *h_samp, int *v_samp)
+{
+	int r;
+	stbi__context s;
+	long pos = ftell(f);
+	stbi__start_file(&s, f);
+	r = stbi__jpeg_components_info(&s, x, y, comp, h_samp, v_samp);
+	fseek(f, pos, SEEK_SET);
+	return r;
+}
+
+STBIDEF int stbi_load_jpeg_components(char const *filename, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	int result;
+	if (!f) return stbi__err("can't fopen", "Unable to open file");
+	result = stbi_load_jpeg_components_from_file(f, scale, planes, strides, widths, heights);
+	fclose(f);
+	return result;
+}
+
+STBIDEF int stbi_load_jpeg_components_from_file(FILE *f, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights)
+{
+	int result;
+	stbi__context s;
+	stbi__start_file(&s, f);
+	result = stbi__jpeg_load_components(&s, scale, planes, strides, widths, heights);
+	if (result) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(f, -(int)(s.img_buffer_end - s.img_buffer), SEEK_CUR);
+	}
+	return result;
+}
+#endif // !STBI_NO_STDIO
+
+STBIDEF int stbi_jpeg_components_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int *h_samp, int *v_samp)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__jpeg_components_info(&s, x, y, comp, h_samp, v_samp);
+}
+
+STBIDEF int stbi_jpeg_components_info_from_callbacks(stbi_io_callbacks const *c, void *user, int *x, int *y, int *comp, int *h_samp, int *v_samp)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)c, user);
+	return stbi__jpeg_components_info(&s, x, y, comp, h_samp, v_samp);
+}
+
+STBIDEF int stbi_load_jpeg_components_from_memory(stbi_uc const *buffer, int len, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights)
+{
+	stbi__context s;
+	stbi__start_mem(&s, buffer, len);
+	return stbi__jpeg_load_components(&s, scale, planes, strides, widths, heights);
+}
+
+STBIDEF int stbi_load_jpeg_components_from_callbacks(stbi_io_callbacks const *c, void *user, int scale, stbi_uc * const *planes, int const *strides, int const *widths, int const *heights)
+{
+	stbi__context s;
+	stbi__start_callbacks(&s, (stbi_io_callbacks *)c, user);
+	return stbi__jpeg_load_components(&s, scale, planes, strides, widths, heights);
+}
+#endif // !STBI_NO_JPEG
+
+#ifndef STBI_NO_GIF
+static stbi_gif_reader *stbi__gif_new_reader(void)
+{
+	stbi_gif_reader *r = (stbi_gif_reader *)stbi__malloc(sizeof(stbi_gif_reader));
+	if (!r) return (stbi_gif_reader *)stbi__errpuc("outofmem", "Out of memory");
+#ifndef STBI_NO_STDIO
+	r->f = NULL;
+	r->unget = NULL;
+#endif
+	r->g.out = NULL;
+	r->g.old_out = NULL;
+	return r;
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_reader *stbi_gif_open(char const *filename, int *x, int *y)
+{
+	FILE *f = stbi__fopen(filename, "rb");
+	stbi_gif_reader *r;
+	if (!f) return (stbi_gif_reader *)stbi__errpuc("can't fopen", "Unable to open file");
+	r = stbi__gif_new_reader();
+	if (!r) {
+		fclose(f);
+		return NULL;
+	}
+	r->f = f;
+	stbi__start_file(&r->s, f);
+	return stbi__gif_open(r, x, y);
+}
+
+STBIDEF stbi_gif_reader *stbi_gif_open_from_file(FILE *f, int *x, int *y)
+{
+	stbi_gif_reader *r = stbi__gif_new_reader();
+	if (!r) return NULL;
+	r->unget = f;
+	stbi__start_file(&r->s, f);
+	return stbi__gif_open(r, x, y);
+}
+#endif // !STBI_NO_STDIO
+
+STBIDEF stbi_gif_reader *stbi_gif_open_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+	stbi_gif_reader *r = stbi__gif_new_reader();
+	if (!r) return NULL;
+	stbi__start_mem(&r->s, buffer, len);
+	return stbi__gif_open(r, x, y);
+}
+
+STBIDEF stbi_gif_reader *stbi_gif_open_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y)
+{
+	stbi_gif_reader *r = stbi__gif_new_reader();
+	if (!r) return NULL;
+	stbi__start_callbacks(&r->s, (stbi_io_callbacks *)clbk, user);
+	return stbi__gif_open(r, x, y);
+}
+
+STBIDEF int stbi_gif_next(stbi_gif_reader *r, stbi_uc const **canvas, int *delay)
+{
+	stbi_uc *u;
+	// a file cut short after a whole frame ends like one with a trailer
+	if (r->done || stbi__at_eof(&r->s)) {
+		r->done = 1;
+		return 0;
+	}
+	u = stbi__gif_load_next(&r->s, &r->g);
+	if (u == (stbi_uc *)&r->s) {
+		r->done = 1;
+		return 0;
+	}
+	if (!u) {
+		r->done = 1;
+		return -1;
+	}
+	*canvas = u;
+	if (delay) *delay = r->g.delay;
+	return 1;
+}
+
+STBIDEF int stbi_gif_count_frames(stbi_gif_reader *r, int **delays)
+{
+	int count;
+	if (delays) *delays = NULL;
+	if (r->done) return 0;
+	r->done = 1;
+	count = stbi__gif_skim(&r->s, delays);
+	return count;
+}
+
+STBIDEF void stbi_gif_close(stbi_gif_reader *r)
+{
+	if (!r) return;
+#ifndef STBI_NO_STDIO
+	if (r->f)
+		fclose(r->f);
+	if (r->unget) {
+		// need to 'unget' all the characters in the IO buffer
+		fseek(r->unget, -(int)(r->s.img_buffer_end - r->s.img_buffer), SEEK_CUR);
+	}
+#endif
+	STBI_FREE(r->g.out);
+	STBI_FREE(r->g.old_out);
+	STBI_FREE(r);
+}
+#endif // !STBI_NO_GIF
+
 #endif // STB_IMAGE_IMPLEMENTATION
 
 /*
@@ -0,0 +1,114 @@
+#pragma once
+
+// A fixed set of worker threads that stb_image hands the pieces of a single large page to.
+//
+// The thread asking for the work takes part in it too, and does whatever the workers haven't
+// picked up, so a frame never waits on workers that are busy with other frames. The workers are
+// started on first use and never stopped, since joining threads while a DLL unloads can hang.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+typedef void (*ThreadPoolTask)(void *arg, int index);
+
+typedef struct {
+	ThreadPoolTask task;
+	void *arg;
+	int count;
+	std::atomic<int> next; // Next index to hand out
+	int active;            // Workers still running indices, guarded by the pool's lock
+} ThreadPoolJob;
+
+typedef struct {
+	std::mutex lock;
+	std::condition_variable work;     // Jobs were queued
+	std::condition_variable finished; // A worker left a job
+	std::deque<ThreadPoolJob *> queue;
+	int num_workers;
+	bool started;
+} ThreadPool;
+
+static void
+ThreadPoolRunIndices(ThreadPoolJob *job)
+{
+	for (int i = job->next++; i < job->count; i = job->next++)
+		job->task(job->arg, i);
+}
+
+static void
+ThreadPoolWorker(ThreadPool *pool)
+{
+	std::unique_lock<std::mutex> guard(pool->lock);
+	for (;;)
+	{
+		pool->work.wait(guard, [pool] { return !pool->queue.empty(); });
+
+		// A job stays queued while it has indices left, so several workers can join it
+		ThreadPoolJob *job = pool->queue.front();
+		if (job->next >= job->count)
+		{
+			pool->queue.pop_front();
+			continue;
+		}
+
+		++job->active;
+		guard.unlock();
+		ThreadPoolRunIndices(job);
+		guard.lock();
+		if (--job->active == 0)
+			pool->finished.notify_all();
+	}
+}
+
+// Calls task(arg, i) for every i in [0, count) across the pool and the calling thread, and
+// returns once they've all returned.
+static void
+ThreadPoolRun(ThreadPool *pool, ThreadPoolTask task, void *arg, int count)
+{
+	ThreadPoolJob job;
+	job.task = task;
+	job.arg = arg;
+	job.count = count;
+	job.next = 0;
+	job.active = 0;
+
+	{
+		std::lock_guard<std::mutex> guard(pool->lock);
+		if (!pool->started)
+		{
+			for (int i = 0; i < pool->num_workers; ++i)
+				std::thread(ThreadPoolWorker, pool).detach();
+			pool->started = true;
+		}
+		pool->queue.push_back(&job);
+	}
+	pool->work.notify_all();
+
+	ThreadPoolRunIndices(&job);
+
+	// Every index has been handed out; wait for the workers still running theirs
+	std::unique_lock<std::mutex> guard(pool->lock);
+	for (auto it = pool->queue.begin(); it != pool->queue.end(); ++it)
+	{
+		if (*it == &job)
+		{
+			pool->queue.erase(it);
+			break;
+		}
+	}
+	pool->finished.wait(guard, [&job] { return job.active == 0; });
+}
+
+// One worker per core besides the calling thread.
+static ThreadPool *
+ThreadPoolCreate()
+{
+	ThreadPool *pool = new ThreadPool();
+	int cores = (int)std::thread::hardware_concurrency();
+	pool->num_workers = cores > 1 ? cores - 1 : 0;
+	pool->started = false;
+	return pool;
+}
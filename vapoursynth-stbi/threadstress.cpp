@@ -0,0 +1,322 @@
+// Stress test of stb_image's per-thread state: many threads decode at once, each with its own
+// *_thread settings, and every result and failure reason is checked against that thread's settings
+// and input alone.
+//
+// This isn't part of the plugin. Build it on its own next to stb_image.h and run it; it prints
+// the first few mismatches and exits with 1 if there were any:
+//   cl /O2 /EHsc threadstress.cpp
+//   g++ -O2 -pthread threadstress.cpp -o threadstress
+// Races often don't corrupt a result on a machine with few cores, so it's also worth running a
+// ThreadSanitizer build (g++ -O1 -g -fsanitize=thread -pthread).
+// The input is an iPhone (CgBI) PNG built in memory, with premultiplied BGRA pixels and a different
+// alpha on every pixel, so flipping, converting and unpremultiplying all change the output.
+// Some of the threads load in batches with stbi_load_many, whose images are decoded on other
+// threads and have to come out with the settings of the thread that asked for them.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <atomic>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const int Threads = 32;
+static const int Loads = 400; // Per thread
+static const int Width = 24;
+static const int Height = 16;
+static const int Batch = 16;   // Loads per stbi_load_many
+static const int InFlight = 4; // Per stbi_load_many
+
+typedef std::vector<stbi_uc> Bytes;
+
+enum {
+	InputGood,
+	InputUnknownChunk, // Fails with the chunk's name in the reason
+	InputBadDepth,
+	InputGarbage,
+};
+
+// What one thread decodes and with which settings
+typedef struct {
+	int input;
+	bool use_globals; // Leaves the settings alone, so the process-wide ones apply
+	bool flip, iphone, unpremultiply;
+	bool batch;       // Loads with stbi_load_many
+	bool in_order;    // Of the batches
+} Case;
+
+// The process-wide settings, which only the threads with use_globals see
+static const bool GlobalFlip = true;
+static const bool GlobalIphone = false;
+static const bool GlobalUnpremultiply = true;
+
+static void
+Put32(Bytes &out, unsigned v)
+{
+	out.push_back((stbi_uc)(v >> 24));
+	out.push_back((stbi_uc)(v >> 16));
+	out.push_back((stbi_uc)(v >> 8));
+	out.push_back((stbi_uc)v);
+}
+
+// stb_image doesn't check chunk CRCs, so they're left as 0
+static void
+PutChunk(Bytes &out, const char *type, const Bytes &data)
+{
+	Put32(out, (unsigned)data.size());
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
+	Put32(out, 0);
+}
+
+// Premultiplied B, G, R, A of a pixel as stored in the file
+static void
+StoredPixel(int x, int y, stbi_uc bgra[4])
+{
+	int a = 40 + (y * Width + x) * 7 % 216;
+	bgra[0] = (stbi_uc)((x * 37 + y * 11) % (a + 1));
+	bgra[1] = (stbi_uc)((x * 5 + y * 29) % (a + 1));
+	bgra[2] = (stbi_uc)((x * 17 + y * 3 + 100) % (a + 1));
+	bgra[3] = (stbi_uc)a;
+}
+
+// A CgBI PNG, whose IDAT is a raw deflate stream without the zlib header, or one of the bad inputs.
+// `chunk` names the unknown critical chunk of InputUnknownChunk.
+static Bytes
+MakeInput(int input, const char *chunk)
+{
+	static const stbi_uc signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	if (input == InputGarbage)
+		return Bytes(signature + 1, signature + 8);
+
+	Bytes png(signature, signature + 8);
+	PutChunk(png, "CgBI", Bytes{ 0x50, 0x00, 0x20, 0x02 });
+
+	Bytes ihdr;
+	Put32(ihdr, Width);
+	Put32(ihdr, Height);
+	ihdr.push_back(input == InputBadDepth ? 3 : 8);
+	ihdr.push_back(6); // RGBA
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	PutChunk(png, "IHDR", ihdr);
+
+	if (input == InputUnknownChunk)
+		PutChunk(png, chunk, Bytes());
+
+	// A single stored block of unfiltered rows
+	Bytes raw;
+	for (int y = 0; y < Height; ++y)
+	{
+		raw.push_back(0);
+		for (int x = 0; x < Width; ++x)
+		{
+			stbi_uc bgra[4];
+			StoredPixel(x, y, bgra);
+			raw.insert(raw.end(), bgra, bgra + 4);
+		}
+	}
+	Bytes idat{ 1, (stbi_uc)raw.size(), (stbi_uc)(raw.size() >> 8), (stbi_uc)~raw.size(), (stbi_uc)(~raw.size() >> 8) };
+	idat.insert(idat.end(), raw.begin(), raw.end());
+	PutChunk(png, "IDAT", idat);
+	PutChunk(png, "IEND", Bytes());
+	return png;
+}
+
+// The RGBA pixels stbi_load should return for a good input with these settings
+static Bytes
+Expected(bool flip, bool iphone, bool unpremultiply)
+{
+	Bytes out;
+	for (int j = 0; j < Height; ++j)
+	{
+		int y = flip ? Height - 1 - j : j;
+		for (int x = 0; x < Width; ++x)
+		{
+			stbi_uc p[4];
+			StoredPixel(x, y, p);
+			if (iphone)
+			{
+				stbi_uc b = p[0];
+				p[0] = p[2];
+				p[2] = b;
+				if (unpremultiply)
+					for (int c = 0; c < 3; ++c)
+						p[c] = (stbi_uc)(p[c] * 255 / p[3]);
+			}
+			out.insert(out.end(), p, p + 4);
+		}
+	}
+	return out;
+}
+
+static Case
+ThreadCase(int t)
+{
+	Case c;
+	c.input = t % 5 == 4 ? InputUnknownChunk + t / 5 % 3 : InputGood;
+	c.use_globals = t % 7 == 0;
+	c.flip = (t & 1) != 0;
+	c.iphone = (t & 2) != 0;
+	c.unpremultiply = (t & 4) != 0;
+	c.batch = t % 3 == 1;
+	c.in_order = (t & 16) != 0;
+	if (c.use_globals)
+	{
+		c.flip = GlobalFlip;
+		c.iphone = GlobalIphone;
+		c.unpremultiply = GlobalUnpremultiply;
+	}
+	return c;
+}
+
+static std::atomic<int> Mismatches;
+static std::mutex ReportLock;
+
+static void
+Report(int t, int load, const char *what)
+{
+	if (++Mismatches > 10)
+		return;
+	std::lock_guard<std::mutex> lock(ReportLock);
+	printf("thread %d, load %d: %s\n", t, load, what);
+}
+
+// What one thread expects of each of its loads
+typedef struct {
+	int t;
+	const Case *c;
+	const Bytes *expected;
+	const std::string *reason;
+	int load; // The first of the batch
+} Expectation;
+
+static void
+CheckLoad(const Expectation &e, int load, stbi_uc *data, int x, int y)
+{
+	if (e.c->input == InputGood)
+	{
+		if (!data)
+			Report(e.t, load, stbi_failure_reason());
+		else if (x != Width || y != Height || memcmp(data, &(*e.expected)[0], e.expected->size()))
+			Report(e.t, load, "pixels don't match this thread's settings");
+	}
+	else
+	{
+		const char *failure = stbi_failure_reason();
+		if (data)
+			Report(e.t, load, "bad input decoded");
+		else if (!failure || *e.reason != failure)
+			Report(e.t, load, failure ? failure : "no failure reason");
+	}
+	stbi_image_free(data);
+}
+
+// Called on whichever thread decoded or handed over the image
+static void
+BatchDone(void *user, int index, stbi_uc *data, int x, int y, int comp)
+{
+	const Expectation *e = (const Expectation *)user;
+	CheckLoad(*e, e->load + index, data, x, y);
+}
+
+// Runs every task on a thread of its own, so none of them has the settings of the thread that
+// asked for them
+static void
+RunParallel(void *user, stbi_parallel_task *task, void *arg, int count)
+{
+	std::vector<std::thread> threads;
+	for (int i = 0; i < count; ++i)
+		threads.emplace_back(task, arg, i);
+	for (auto &thread : threads)
+		thread.join();
+}
+
+static void
+Run(int t)
+{
+	Case c = ThreadCase(t);
+
+	// Every thread's unknown chunk has its own name, so a shared reason buffer would show up
+	char chunk[5];
+	snprintf(chunk, sizeof(chunk), "Q%c%c%c", 'a' + t / 26, 'a' + t % 26, 'x');
+	Bytes input = MakeInput(c.input, chunk);
+
+	Bytes expected;
+	std::string reason;
+	switch (c.input)
+	{
+	case InputGood:
+		expected = Expected(c.flip, c.iphone, c.unpremultiply);
+		break;
+	case InputUnknownChunk:
+		reason = std::string(chunk) + " PNG chunk not known";
+		break;
+	case InputBadDepth:
+		reason = "1/2/4/8-bit only";
+		break;
+	case InputGarbage:
+		reason = "unknown image type";
+		break;
+	}
+
+	if (!c.use_globals)
+	{
+		stbi_set_flip_vertically_on_load_thread(c.flip);
+		stbi_convert_iphone_png_to_rgb_thread(c.iphone);
+		stbi_set_unpremultiply_on_load_thread(c.unpremultiply);
+	}
+
+	Expectation e = { t, &c, &expected, &reason, 0 };
+	if (c.batch)
+	{
+		std::vector<stbi_load_source> sources(Batch, stbi_load_source{ nullptr, &input[0], (int)input.size() });
+		for (e.load = 0; e.load < Loads; e.load += Batch)
+			stbi_load_many(sources.data(), Batch, 4, InFlight, c.in_order, BatchDone, &e);
+		return;
+	}
+
+	for (int load = 0; load < Loads; ++load)
+	{
+		int x, y, comp;
+		stbi_uc *data = stbi_load_from_memory(&input[0], (int)input.size(), &x, &y, &comp, 4);
+		CheckLoad(e, load, data, x, y);
+	}
+}
+
+int
+main()
+{
+	// The settings have to change the output, or the test can't tell them apart
+	Bytes plain = Expected(false, false, false);
+	if (plain == Expected(true, false, false) || plain == Expected(false, true, false) ||
+		Expected(false, true, false) == Expected(false, true, true))
+	{
+		printf("test image doesn't tell the settings apart\n");
+		return 1;
+	}
+
+	stbi_set_flip_vertically_on_load(GlobalFlip);
+	stbi_convert_iphone_png_to_rgb(GlobalIphone);
+	stbi_set_unpremultiply_on_load(GlobalUnpremultiply);
+	stbi_set_parallel_runner(RunParallel, nullptr, InFlight);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < Threads; ++t)
+		threads.emplace_back(Run, t);
+	for (auto &thread : threads)
+		thread.join();
+
+	if (Mismatches)
+	{
+		printf("%d of %d loads didn't match\n", Mismatches.load(), Threads * Loads);
+		return 1;
+	}
+	printf("%d threads x %d loads: ok\n", Threads, Loads);
+	return 0;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+// Listing the members of a ZIP (CBZ) archive from its central directory.
+//
+// Only the directory at the end of the archive is read, so opening a large archive costs a couple
+// of reads no matter how many pages it holds. ZIP64 sizes and offsets are understood; spanned
+// archives aren't. Members' data is found through their local headers, see ZipDataOffset.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#define zip_fseek _fseeki64
+#define zip_ftell _ftelli64
+#else
+#define zip_fseek fseeko
+#define zip_ftell ftello
+#endif
+
+enum {
+	ZipStored = 0,
+	ZipDeflated = 8,
+};
+
+typedef struct {
+	std::string name;
+	int method;            // ZipStored, ZipDeflated or something we can't read
+	bool encrypted;
+	int64_t header_offset; // Of the member's local header, which its data follows
+	int64_t packed_size;
+	int64_t size;
+} ZipMember;
+
+static inline uint32_t
+ZipRead16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+ZipRead32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+ZipRead64(const uint8_t *p)
+{
+	return ZipRead32(p) | ((uint64_t)ZipRead32(p + 4) << 32);
+}
+
+static bool
+ZipReadAt(FILE *f, int64_t offset, void *buffer, size_t size)
+{
+	return zip_fseek(f, offset, SEEK_SET) == 0 && fread(buffer, 1, size, f) == size;
+}
+
+// Fills in the sizes and offset a ZIP64 "extended information" extra field overrides. It only holds
+// the ones whose 32-bit fields are saturated, in this order.
+static bool
+ZipReadExtra64(const uint8_t *extra, size_t extra_size, ZipMember *member)
+{
+	while (extra_size >= 4)
+	{
+		uint32_t id = ZipRead16(extra);
+		size_t size = ZipRead16(extra + 2);
+		if (size + 4 > extra_size)
+			return false;
+
+		if (id == 0x0001)
+		{
+			const uint8_t *p = extra + 4;
+			const uint8_t *end = p + size;
+			int64_t *fields[3] = { &member->size, &member->packed_size, &member->header_offset };
+			for (int i = 0; i < 3; ++i)
+			{
+				if (*fields[i] != 0xFFFFFFFF)
+					continue;
+				if (p + 8 > end)
+					return false;
+				*fields[i] = (int64_t)ZipRead64(p);
+				p += 8;
+			}
+			return true;
+		}
+
+		extra += size + 4;
+		extra_size -= size + 4;
+	}
+	return true;
+}
+
+// Lists every member of the archive, directories included, in directory order.
+static bool
+ReadZipDirectory(FILE *f, std::vector<ZipMember> *members)
+{
+	if (zip_fseek(f, 0, SEEK_END))
+		return false;
+	int64_t file_size = zip_ftell(f);
+
+	// The end of central directory record is 22 bytes plus a comment of up to 64 KiB, and a ZIP64
+	// locator (20 bytes) sits right before it.
+	const int64_t eocd_size = 22, locator_size = 20;
+	int64_t tail_size = file_size < eocd_size + 65535 + locator_size ? file_size : eocd_size + 65535 + locator_size;
+	if (tail_size < eocd_size)
+		return false;
+
+	std::vector<uint8_t> tail((size_t)tail_size);
+	if (!ZipReadAt(f, file_size - tail_size, tail.data(), tail.size()))
+		return false;
+
+	int64_t eocd = -1;
+	for (int64_t i = tail_size - eocd_size; i >= 0; --i)
+	{
+		if (ZipRead32(&tail[(size_t)i]) == 0x06054b50)
+		{
+			eocd = i;
+			break;
+		}
+	}
+	if (eocd < 0)
+		return false;
+
+	const uint8_t *p = &tail[(size_t)eocd];
+	if (ZipRead16(p + 4) != 0 || ZipRead16(p + 6) != 0)
+		return false; // Spanned over several files
+
+	uint64_t count = ZipRead16(p + 10);
+	uint64_t directory_size = ZipRead32(p + 12);
+	uint64_t directory_offset = ZipRead32(p + 16);
+
+	if (count == 0xFFFF || directory_size == 0xFFFFFFFF || directory_offset == 0xFFFFFFFF)
+	{
+		if (eocd < locator_size || ZipRead32(p - locator_size) != 0x07064b50)
+			return false;
+
+		uint8_t record[56];
+		if (!ZipReadAt(f, (int64_t)ZipRead64(p - locator_size + 8), record, sizeof(record)) || ZipRead32(record) != 0x06064b50)
+			return false;
+
+		count = ZipRead64(record + 32);
+		directory_size = ZipRead64(record + 40);
+		directory_offset = ZipRead64(record + 48);
+	}
+
+	// Each entry is at least 46 bytes, which also keeps a corrupt count from allocating too much
+	if (directory_offset + directory_size > (uint64_t)file_size || count > directory_size / 46)
+		return false;
+
+	std::vector<uint8_t> directory((size_t)directory_size);
+	if (!ZipReadAt(f, (int64_t)directory_offset, directory.data(), directory.size()))
+		return false;
+
+	members->clear();
+	members->reserve((size_t)count);
+
+	size_t pos = 0;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		if (pos + 46 > directory.size() || ZipRead32(&directory[pos]) != 0x02014b50)
+			return false;
+
+		const uint8_t *entry = &directory[pos];
+		size_t name_size = ZipRead16(entry + 28);
+		size_t extra_size = ZipRead16(entry + 30);
+		size_t comment_size = ZipRead16(entry + 32);
+		if (pos + 46 + name_size + extra_size + comment_size > directory.size())
+			return false;
+
+		ZipMember member;
+		member.name.assign((const char *)entry + 46, name_size);
+		member.method = ZipRead16(entry + 10);
+		member.encrypted = (ZipRead16(entry + 8) & 1) != 0;
+		member.packed_size = ZipRead32(entry + 20);
+		member.size = ZipRead32(entry + 24);
+		member.header_offset = ZipRead32(entry + 42);
+		if (!ZipReadExtra64(entry + 46 + name_size, extra_size, &member))
+			return false;
+
+		members->push_back(member);
+		pos += 46 + name_size + extra_size + comment_size;
+	}
+
+	return true;
+}
+
+// Where a member's data starts, given the first bytes of its local header (at least 30). The local
+// header repeats the name but can carry a different extra field than the central directory.
+static inline int64_t
+ZipDataOffset(int64_t header_offset, const uint8_t *local_header)
+{
+	if (ZipRead32(local_header) != 0x04034b50)
+		return -1;
+	return header_offset + 30 + ZipRead16(local_header + 26) + ZipRead16(local_header + 28);
+}
+
+// The most a local header can take up, so reading this much plus packed_size from header_offset
+// always covers the member's data.
+static const int64_t ZipMaxLocalHeader = 30 + 65535 + 65535;